@@ -0,0 +1,76 @@
+#!/usr/bin/env bash
+# Runs myfind and GNU find over a matrix of tree shapes and queries, with
+# warm and cold caches, and prints the throughput in entries per second,
+# the system calls of one run and the peak RSS. The trees come from
+# bench/gen_tree.sh. A query where myfind prints other paths than find is
+# marked with a *.
+#
+# usage: bench/compare.sh [RUNS] [SHAPE...]
+# Cold cache runs drop the page cache, which needs root, and are skipped
+# otherwise. Counting system calls traces each process with ptrace, when
+# that is not allowed the column shows -1.
+
+RUNS=${1:-3}
+shift
+SHAPES=${*:-wide deep small symlinks mixed}
+TREES=bench/trees
+cd "$(dirname "$0")/.." || exit 1
+
+gcc -O3 -Wall -Wextra -pedantic -pthread myfind.c -o bench/myfind || exit 1
+gcc -O2 -Wall -Wextra -pedantic bench/run_stats.c -o bench/run_stats || exit 1
+bench/gen_tree.sh "$TREES" $SHAPES || exit 1
+GNU_FIND=$(command -v find)
+
+can_drop=false
+if [ -w /proc/sys/vm/drop_caches ]; then
+  can_drop=true
+fi
+
+# stats BIN ARGS..., prints the wall_ns, maxrss_kb and syscalls of one run.
+stats() {
+  ./bench/run_stats "$@" 2>&1 > /dev/null | tail -1
+}
+
+# run SHAPE LABEL CACHE ARGS...
+run() {
+  local shape=$1 label=$2 cache=$3
+  shift 3
+  local entries same
+  entries=$("$GNU_FIND" "$TREES/$shape" | wc -l)
+  same=" "
+  if ! cmp -s <(./bench/myfind "$@" | sort) <("$GNU_FIND" "$@" | sort); then
+    same="*"
+  fi
+  for bin in ./bench/myfind "$GNU_FIND"; do
+    local total=0
+    for r in $(seq 1 "$RUNS"); do
+      if [ "$cache" = cold ]; then
+        sync
+        echo 3 > /proc/sys/vm/drop_caches
+      fi
+      total=$((total + $(stats "$bin" "$@" | awk '{ print $2 }')))
+    done
+    local rss syscalls
+    read -r rss syscalls < <(stats -s "$bin" "$@" | awk '{ print $4, $6 }')
+    awk -v s="$shape" -v l="$label$same" -v c="$cache" -v b="${bin##*/}" -v t="$total" \
+      -v r="$RUNS" -v e="$entries" -v m="$rss" -v n="$syscalls" \
+      'BEGIN { printf "%-9s %-15s %-5s %-7s %10.2f ms %12.0f entries/s %9d syscalls %8d KiB\n",
+               s, l, c, b, t / r / 1000000, e / (t / r / 1000000000), n, m }'
+  done
+}
+
+for cache in warm cold; do
+  if [ "$cache" = cold ] && ! $can_drop; then
+    echo "Skipping cold cache runs, need root to drop caches"
+    continue
+  fi
+  for shape in $SHAPES; do
+    dir=$TREES/$shape
+    run "$shape" "print" "$cache" "$dir"
+    run "$shape" "-name" "$cache" "$dir" -name '*7*'
+    run "$shape" "-type f" "$cache" "$dir" -type f
+    run "$shape" "-mtime 3" "$cache" "$dir" -mtime 3
+    run "$shape" "-exec" "$cache" "$dir" -name '*77*' -exec true {} \;
+    run "$shape" "-L -type f" "$cache" -L "$dir" -type f
+  done
+done
@@ -0,0 +1,99 @@
+#!/usr/bin/env bash
+# Generates the trees bench/compare.sh runs on, one directory per shape
+# under DIR. The sizes can be changed through the environment, and a
+# shape that already exists is left alone.
+#
+# usage: bench/gen_tree.sh DIR [SHAPE...]
+# SHAPE is one of
+#   wide      WIDE_FILES files in one directory
+#   deep      a chain of DEEP_LEVELS directories, each with a few files
+#   small     SMALL_DIRS directories of SMALL_FILES small files, two levels
+#   symlinks  directories of files and a farm of links to them, some dangling
+#   mixed     files, directories, links and fifos with mtimes 0 to 9 days old
+# and defaults to all of them.
+
+DIR=${1:?usage: bench/gen_tree.sh DIR [SHAPE...]}
+shift
+SHAPES=${*:-wide deep small symlinks mixed}
+WIDE_FILES=${WIDE_FILES:-100000}
+DEEP_LEVELS=${DEEP_LEVELS:-1000}
+SMALL_DIRS=${SMALL_DIRS:-200}
+SMALL_FILES=${SMALL_FILES:-250}
+LINK_DIRS=${LINK_DIRS:-50}
+LINK_FILES=${LINK_FILES:-200}
+MIXED_DIRS=${MIXED_DIRS:-100}
+MIXED_FILES=${MIXED_FILES:-200}
+
+# touch_many DIR FORMAT COUNT, creates DIR/FORMAT for 1 to COUNT.
+touch_many() {
+  (cd "$1" && seq -f "$2" 1 "$3" | xargs touch)
+}
+
+gen_wide() {
+  mkdir -p "$1"
+  touch_many "$1" "f%g.txt" "$WIDE_FILES"
+}
+
+gen_deep() {
+  local dir=$1
+  mkdir -p "$dir"
+  for i in $(seq 1 "$DEEP_LEVELS"); do
+    dir=$dir/d
+    mkdir "$dir"
+    touch "$dir/a.c" "$dir/b.h" "$dir/c.txt"
+  done
+}
+
+gen_small() {
+  for i in $(seq 1 "$SMALL_DIRS"); do
+    local dir=$1/s$((i % 10))/d$i
+    mkdir -p "$dir"
+    touch_many "$dir" "f%g.c" "$SMALL_FILES"
+    # Give a tenth of the files some content.
+    for f in "$dir"/f*0.c; do
+      echo "int f$i;" > "$f"
+    done
+  done
+}
+
+gen_symlinks() {
+  for i in $(seq 1 "$LINK_DIRS"); do
+    mkdir -p "$1/targets/d$i" "$1/links/d$i"
+    touch_many "$1/targets/d$i" "f%g" "$LINK_FILES"
+    (cd "$1/links/d$i" && for j in $(seq 1 "$LINK_FILES"); do
+      ln -s "../../targets/d$i/f$j" "l$j"
+    done && ln -s "../../targets/missing$i" dangling)
+    # Links to directories, which -L follows.
+    ln -s "../targets/d$i" "$1/links/dir$i"
+  done
+}
+
+gen_mixed() {
+  local now
+  now=$(date +%s)
+  for i in $(seq 1 "$MIXED_DIRS"); do
+    local dir=$1/m$((i % 7))/d$i
+    mkdir -p "$dir/sub"
+    touch_many "$dir" "f%g.dat" "$MIXED_FILES"
+    ln -s f1.dat "$dir/link"
+    mkfifo "$dir/fifo"
+    # Spread the mtimes over whole days so -mtime N matches a tenth.
+    for age in $(seq 0 9); do
+      seq -f "$dir/f%g.dat" $((age + 1)) 10 "$MIXED_FILES" |
+        xargs touch -d "@$((now - age * 86400 - 3600))"
+    done
+  done
+}
+
+for shape in $SHAPES; do
+  if [ -d "$DIR/$shape" ]; then
+    continue
+  fi
+  case $shape in
+    wide|deep|small|symlinks|mixed) ;;
+    *) echo "unknown shape $shape" >&2; exit 1 ;;
+  esac
+  echo "Generating $DIR/$shape"
+  "gen_$shape" "$DIR/$shape.tmp" || exit 1
+  mv "$DIR/$shape.tmp" "$DIR/$shape"
+done
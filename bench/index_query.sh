@@ -0,0 +1,52 @@
+#!/usr/bin/env bash
+# Compares queries that walk the tree against the same queries run on an
+# index built by -index-build, and against -index-update, which walks
+# again but reuses the listings of unchanged directories.
+#
+# usage: bench/index_query.sh [DIR] [RUNS]
+# DIR defaults to a generated tree.
+
+DIR=${1:-}
+RUNS=${2:-5}
+cd "$(dirname "$0")/.." || exit 1
+
+gcc -O3 -Wall -Wextra -pedantic -pthread myfind.c -o bench/myfind || exit 1
+
+if [ -z "$DIR" ]; then
+  DIR=bench/tree
+  if [ ! -d "$DIR" ]; then
+    echo "Generating $DIR"
+    for i in $(seq 1 100); do
+      mkdir -p "$DIR/d$i"
+      (cd "$DIR/d$i" && touch $(seq -f "f%g" 1 500))
+    done
+  fi
+fi
+
+start=$(date +%s%N)
+./bench/myfind "$DIR" -index-build bench/tree.idx || exit 1
+end=$(date +%s%N)
+awk -v t="$((end - start))" -v s="$(stat -c %s bench/tree.idx)" \
+  'BEGIN { printf "build %.2f ms, %d bytes\n", t / 1000000, s }'
+
+# run LABEL ARGS...
+run() {
+  local label=$1
+  shift
+  local total=0
+  for r in $(seq 1 "$RUNS"); do
+    local start end
+    start=$(date +%s%N)
+    ./bench/myfind "$@" > /dev/null
+    end=$(date +%s%N)
+    total=$((total + end - start))
+  done
+  awk -v l="$label" -v t="$total" -v r="$RUNS" \
+    'BEGIN { printf "%-14s %10.2f ms\n", l, t / r / 1000000 }'
+}
+
+run "-name walk" "$DIR" -name '*7*'
+run "-name index" -index bench/tree.idx -name '*7*'
+run "-mtime walk" "$DIR" -mtime 0
+run "-mtime index" -index bench/tree.idx -mtime 0
+run "-name update" "$DIR" -index-update bench/tree.idx -name '*7*'
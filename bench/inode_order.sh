@@ -0,0 +1,55 @@
+#!/usr/bin/env bash
+# Runs queries that stat every entry with and without -inode-order, with
+# cold caches, and prints the mean wall time of each. The trees come from
+# bench/gen_tree.sh. Where readdir order is not inode order, as with the
+# hashed directories of ext4, the stats of the plain walk seek around the
+# inode table, which -inode-order avoids.
+#
+# usage: bench/inode_order.sh [RUNS] [SHAPE...]
+# Dropping the page cache needs root. Without it the runs are warm, which
+# only shows the cost of reading each directory whole.
+
+RUNS=${1:-3}
+shift
+SHAPES=${*:-wide small mixed}
+TREES=bench/trees
+cd "$(dirname "$0")/.." || exit 1
+
+gcc -O3 -Wall -Wextra -pedantic -pthread myfind.c -o bench/myfind || exit 1
+gcc -O2 -Wall -Wextra -pedantic bench/run_stats.c -o bench/run_stats || exit 1
+bench/gen_tree.sh "$TREES" $SHAPES || exit 1
+
+cache=cold
+if [ ! -w /proc/sys/vm/drop_caches ]; then
+  echo "Not root, running with warm caches"
+  cache=warm
+fi
+
+# run SHAPE LABEL ARGS..., prints the mean wall time with and without
+# -inode-order and checks both print the same.
+run() {
+  local shape=$1 label=$2
+  shift 2
+  if ! cmp -s <(./bench/myfind "$@") <(./bench/myfind "$@" -inode-order); then
+    echo "$shape $label: -inode-order changes the output" >&2
+  fi
+  for order in "" -inode-order; do
+    local total=0
+    for r in $(seq 1 "$RUNS"); do
+      if [ "$cache" = cold ]; then
+        sync
+        echo 3 > /proc/sys/vm/drop_caches
+      fi
+      total=$((total + $(./bench/run_stats ./bench/myfind "$@" $order 2>&1 > /dev/null | tail -1 | awk '{ print $2 }')))
+    done
+    awk -v s="$shape" -v l="$label" -v c="$cache" -v o="${order:-readdir}" -v t="$total" -v r="$RUNS" \
+      'BEGIN { printf "%-9s %-10s %-5s %-12s %10.2f ms\n", s, l, c, o, t / r / 1000000 }'
+  done
+}
+
+for shape in $SHAPES; do
+  dir=$TREES/$shape
+  run "$shape" "-mtime 3" "$dir" -mtime 3
+  run "$shape" "-newer" "$dir" -newer bench/gen_tree.sh
+  run "$shape" "-L" -L "$dir" -type f
+done
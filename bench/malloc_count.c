@@ -0,0 +1,48 @@
+/*
+    Counts the calls to the allocator, for bench/malloc_count.sh. Loaded
+    through LD_PRELOAD, it prints the totals to stderr when the program
+    exits.
+*/
+#include <stdio.h>
+#include <stddef.h>
+#include <stdatomic.h>
+
+extern void* __libc_malloc(size_t size);
+extern void* __libc_calloc(size_t count, size_t size);
+extern void* __libc_realloc(void* memory, size_t size);
+extern void __libc_free(void* memory);
+
+atomic_long num_mallocs = 0;
+atomic_long num_frees = 0;
+
+void* malloc(size_t size)
+{
+    atomic_fetch_add(&num_mallocs, 1);
+    return __libc_malloc(size);
+}
+
+void* calloc(size_t count, size_t size)
+{
+    atomic_fetch_add(&num_mallocs, 1);
+    return __libc_calloc(count, size);
+}
+
+void* realloc(void* memory, size_t size)
+{
+    atomic_fetch_add(&num_mallocs, 1);
+    return __libc_realloc(memory, size);
+}
+
+void free(void* memory)
+{
+    if(memory != NULL)
+    {
+        atomic_fetch_add(&num_frees, 1);
+    }
+    __libc_free(memory);
+}
+
+__attribute__((destructor)) void report_counts()
+{
+    fprintf(stderr, "allocations %ld frees %ld\n", atomic_load(&num_mallocs), atomic_load(&num_frees));
+}
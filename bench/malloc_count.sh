@@ -0,0 +1,50 @@
+#!/usr/bin/env bash
+# Counts the allocator calls per visited entry, for the current myfind.c
+# and optionally for myfind.c at an older git revision.
+#
+# usage: bench/malloc_count.sh [DIR] [REV]
+# DIR defaults to a generated tree, REV for example HEAD~1.
+
+DIR=${1:-}
+REV=${2:-}
+cd "$(dirname "$0")/.." || exit 1
+
+gcc -O2 -shared -fPIC bench/malloc_count.c -o bench/malloc_count.so || exit 1
+gcc -O2 -Wall -Wextra -pedantic -pthread myfind.c -o bench/myfind || exit 1
+bins="bench/myfind"
+if [ -n "$REV" ]; then
+  git show "$REV:myfind.c" > bench/myfind_rev.c || exit 1
+  gcc -O2 -pthread bench/myfind_rev.c -o bench/myfind_rev || exit 1
+  bins="$bins bench/myfind_rev"
+fi
+
+if [ -z "$DIR" ]; then
+  DIR=bench/tree
+  if [ ! -d "$DIR" ]; then
+    echo "Generating $DIR"
+    for i in $(seq 1 100); do
+      mkdir -p "$DIR/d$i"
+      (cd "$DIR/d$i" && touch $(seq -f "f%g" 1 500))
+    done
+  fi
+fi
+
+entries=$(./bench/myfind "$DIR" | wc -l)
+echo "$entries entries under $DIR"
+
+# count LABEL ARGS...
+count() {
+  local label=$1
+  shift
+  for bin in $bins; do
+    LD_PRELOAD=./bench/malloc_count.so "$bin" "$@" 2>&1 > /dev/null | tail -1 |
+      awk -v l="$label" -v b="$bin" -v e="$entries" \
+        '{ printf "%-18s %-18s %10d allocations %8.3f per entry\n", l, b, $2, $2 / e }'
+  done
+}
+
+count "print" "$DIR"
+count "-name no match" "$DIR" -name '*.nomatch'
+count "-type d" "$DIR" -type d
+count "-exec {} +" "$DIR" -exec true {} +
+count "-j 4" -j 4 "$DIR"
@@ -0,0 +1,114 @@
+/*
+    Microbenchmark of the compiled -name patterns against fnmatch.
+
+    Reads file names from stdin, one per line, and matches every name
+    against each pattern given on the command line, with fnmatch and with
+    the matcher myfind compiles. Exits with status 1 if the two disagree.
+    Build and run it through bench/name_match.sh.
+*/
+#define main myfind_main
+#include "../myfind.c"
+#undef main
+
+/*
+    Returns the current time in nanoseconds.
+*/
+long long now_ns()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+/*
+    Called through a pointer like run_name calls it, otherwise the compiler
+    sees through the matcher and hoists the work out of the timing loop.
+*/
+bool (*volatile match_name)(const name_matcher_t*, const char*) = handle_name;
+
+int main(int argc, char** argv)
+{
+    int rounds = 20;
+    int num_names = 0;
+    int names_cap = 1024;
+    char** names = (char**) checked_alloc(names_cap, sizeof(char*));
+    char* line = NULL;
+    size_t line_cap = 0;
+    ssize_t length;
+    while((length = getline(&line, &line_cap, stdin)) > 0)
+    {
+        if(line[length - 1] == '\n')
+        {
+            line[length - 1] = '\0';
+        }
+        if(num_names == names_cap)
+        {
+            names_cap *= 2;
+            names = (char**) checked_realloc(names, names_cap * sizeof(char*));
+        }
+        names[num_names++] = strdup(line);
+    }
+    free(line);
+
+    static const char* kind_names[] = { "any", "exact", "prefix", "suffix", "prefix*suffix",
+                                        "contains", "dfa", "fnmatch" };
+    int status = 0;
+    printf("%d names, %d rounds\n", num_names, rounds);
+    printf("%-20s %-6s %-14s %8s %12s %12s\n", "pattern", "flags", "kind", "matches", "fnmatch ns", "compiled ns");
+    for(int p = 1; p < argc; p++)
+    {
+        for(int fold_case = 0; fold_case <= 1; fold_case++)
+        {
+            name_matcher_t* matcher = compile_name_pattern(argv[p], fold_case);
+            int flags = fold_case ? FNM_CASEFOLD : 0;
+
+            int found = 0;
+            for(int i = 0; i < num_names; i++)
+            {
+                bool want = fnmatch(argv[p], names[i], flags) == 0;
+                bool got = handle_name(matcher, names[i]);
+                found += got;
+                if(want != got)
+                {
+                    printf("MISMATCH %s %s: fnmatch %d compiled %d\n", argv[p], names[i], want, got);
+                    status = 1;
+                }
+            }
+
+            long long start = now_ns();
+            int sink = 0;
+            for(int r = 0; r < rounds; r++)
+            {
+                for(int i = 0; i < num_names; i++)
+                {
+                    sink += fnmatch(argv[p], names[i], flags) == 0;
+                }
+            }
+            long long fnmatch_ns = now_ns() - start;
+
+            start = now_ns();
+            for(int r = 0; r < rounds; r++)
+            {
+                for(int i = 0; i < num_names; i++)
+                {
+                    sink += match_name(matcher, names[i]);
+                }
+
+            }
+            long long compiled_ns = now_ns() - start;
+
+            double per_name = (double) rounds * (num_names > 0 ? num_names : 1);
+            printf("%-20s %-6s %-14s %8d %12.1f %12.1f%s\n", argv[p], fold_case ? "-i" : "",
+                   kind_names[matcher->kind], found, fnmatch_ns / per_name, compiled_ns / per_name,
+                   sink < 0 ? " " : "");
+            free_name_matcher(matcher);
+        }
+    }
+
+    for(int i = 0; i < num_names; i++)
+    {
+        free(names[i]);
+    }
+    free(names);
+    return status;
+}
@@ -0,0 +1,22 @@
+#!/usr/bin/env bash
+# Compares the compiled -name patterns against fnmatch on the file names
+# of a real tree, and checks that both agree on every name.
+#
+# usage: bench/name_match.sh [DIR] [PATTERN...]
+# DIR defaults to /usr. The default patterns cover each kind of matcher.
+
+DIR=${1:-/usr}
+shift
+cd "$(dirname "$0")/.." || exit 1
+
+gcc -O3 -Wall -Wextra -pedantic -pthread myfind.c -o bench/myfind || exit 1
+gcc -O3 -Wall -Wextra -pedantic -pthread bench/name_match.c -o bench/name_match || exit 1
+
+if [ $# -eq 0 ]; then
+  set -- '*' 'Makefile' 'lib*' '*.h' '*.so.*' 'lib*.a' '*test*' \
+         '*.[ch]' '[A-Z]*' '*[0-9][0-9]*' '?????' '*.p[yl]' '[!.]*rc'
+fi
+
+# Only the last component of each path is a name.
+./bench/myfind "$DIR" 2> /dev/null | sed 's|.*/||' > bench/names.txt
+./bench/name_match "$@" < bench/names.txt
@@ -0,0 +1,134 @@
+/*
+    Microbenchmark of the lazily built DFA of -regex against regexec.
+
+    Reads paths from stdin, one per line, and matches every path against
+    each expression given on the command line, with regexec and with the
+    DFA myfind builds. regexec runs on the expression compiled the way GNU
+    find compiles it, a path matches if the match found covers all of it.
+    Exits with status 1 if the two disagree. Build and run it through
+    bench/regex_match.sh.
+*/
+#define main myfind_main
+#include "../myfind.c"
+#undef main
+
+/*
+    Returns the current time in nanoseconds.
+*/
+long long now_ns()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+/*
+    Called through a pointer like run_regex calls it, otherwise the compiler
+    sees through the expression and hoists the work out of the timing loop.
+*/
+bool (*volatile match_path)(const path_regex_t*, const char*, size_t) = handle_regex;
+
+/*
+    Returns true if regexec matches the whole len bytes of path.
+*/
+bool regexec_matches(regex_t* compiled, const char* path, size_t len)
+{
+    regmatch_t match;
+    return regexec(compiled, path, 1, &match, 0) == 0 && match.rm_so == 0 && (size_t) match.rm_eo == len;
+}
+
+int main(int argc, char** argv)
+{
+    int rounds = 3;
+    int num_paths = 0;
+    int paths_cap = 1024;
+    size_t total_len = 0;
+    char** paths = (char**) checked_alloc(paths_cap, sizeof(char*));
+    size_t* lengths = (size_t*) checked_alloc(paths_cap, sizeof(size_t));
+    char* line = NULL;
+    size_t line_cap = 0;
+    ssize_t length;
+    while((length = getline(&line, &line_cap, stdin)) > 0)
+    {
+        if(line[length - 1] == '\n')
+        {
+            line[--length] = '\0';
+        }
+        if(num_paths == paths_cap)
+        {
+            paths_cap *= 2;
+            paths = (char**) checked_realloc(paths, paths_cap * sizeof(char*));
+            lengths = (size_t*) checked_realloc(lengths, paths_cap * sizeof(size_t));
+        }
+        lengths[num_paths] = length;
+        paths[num_paths++] = strdup(line);
+        total_len += length;
+    }
+    free(line);
+
+    int status = 0;
+    printf("%d paths of %.0f bytes on average, %d rounds\n", num_paths,
+           (double) total_len / (num_paths > 0 ? num_paths : 1), rounds);
+    printf("%-36s %-6s %-5s %8s %12s %12s\n", "expression", "flags", "kind", "matches", "regexec ns", "dfa ns");
+    for(int p = 1; p < argc; p++)
+    {
+        for(int fold_case = 0; fold_case <= 1; fold_case++)
+        {
+            path_regex_t* regex = compile_path_regex(argv[p], fold_case);
+            regex_t compiled;
+            memset(&compiled, 0, sizeof(compiled));
+            re_syntax_options = RE_SYNTAX_EMACS | (fold_case ? RE_ICASE : 0);
+            re_compile_pattern(argv[p], strlen(argv[p]), &compiled);
+
+            int found = 0;
+            for(int i = 0; i < num_paths; i++)
+            {
+                bool want = regexec_matches(&compiled, paths[i], lengths[i]);
+                bool got = handle_regex(regex, paths[i], lengths[i]);
+                found += got;
+                if(want != got)
+                {
+                    printf("MISMATCH %s %s: regexec %d dfa %d\n", argv[p], paths[i], want, got);
+                    status = 1;
+                }
+            }
+
+            long long start = now_ns();
+            int sink = 0;
+            for(int r = 0; r < rounds; r++)
+            {
+                for(int i = 0; i < num_paths; i++)
+                {
+                    sink += regexec_matches(&compiled, paths[i], lengths[i]);
+                }
+            }
+            long long regexec_ns = now_ns() - start;
+
+            start = now_ns();
+            for(int r = 0; r < rounds; r++)
+            {
+                for(int i = 0; i < num_paths; i++)
+                {
+                    sink += match_path(regex, paths[i], lengths[i]);
+                }
+            }
+            long long dfa_ns = now_ns() - start;
+
+            double per_path = (double) rounds * (num_paths > 0 ? num_paths : 1);
+            printf("%-36s %-6s %-5s %8d %12.1f %12.1f%s\n", argv[p], fold_case ? "-i" : "",
+                   regex->fallback != NULL ? "gnu" : "dfa", found, regexec_ns / per_path, dfa_ns / per_path,
+                   sink < 0 ? " " : "");
+            regfree(&compiled);
+            free_path_regex(regex);
+            free_regex_caches();
+        }
+    }
+
+    for(int i = 0; i < num_paths; i++)
+    {
+        free(paths[i]);
+    }
+    free(paths);
+    free(lengths);
+    return status;
+}
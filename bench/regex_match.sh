@@ -0,0 +1,29 @@
+#!/usr/bin/env bash
+# Compares the DFA of -regex against regexec on the paths of a tree, and
+# checks that both agree on every path.
+#
+# usage: bench/regex_match.sh [DIR] [REGEX...]
+# DIR defaults to the deep tree of bench/gen_tree.sh, a chain of a thousand
+# directories whose paths run to thousands of bytes. regexec searches for
+# a match at every start, which is slow on such paths, so only every
+# SAMPLE-th path is matched. The default expressions are in the Emacs
+# syntax of -regex.
+
+DIR=${1:-bench/trees/deep}
+shift
+SAMPLE=${SAMPLE:-7}
+cd "$(dirname "$0")/.." || exit 1
+
+gcc -O3 -Wall -Wextra -pedantic -pthread myfind.c -o bench/myfind || exit 1
+gcc -O3 -Wall -Wextra -pedantic -pthread bench/regex_match.c -o bench/regex_match || exit 1
+if [ "$DIR" = bench/trees/deep ]; then
+  bench/gen_tree.sh bench/trees deep || exit 1
+fi
+
+if [ $# -eq 0 ]; then
+  set -- '.*' '.*\.\(c\|h\)' '.*/d/d/[^/]*\.c' '\([^/]*/\)*b\.h' \
+         '.*/\(d/\)+[abc]\..?' '.*/[ab]\.[^c]'
+fi
+
+./bench/myfind "$DIR" 2> /dev/null | awk -v n="$SAMPLE" 'NR % n == 1' > bench/paths.txt
+./bench/regex_match "$@" < bench/paths.txt
@@ -0,0 +1,131 @@
+/*
+    Runs a command and prints its wall time and peak resident set size to
+    stderr, for bench/compare.sh. With -s it also counts the system calls
+    of the command, its threads and the commands it starts, by tracing
+    them with ptrace, which makes the run itself much slower.
+
+    usage: run_stats [-s] COMMAND [ARG...]
+*/
+#define _GNU_SOURCE
+#include <errno.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ptrace.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+/*
+    Returns a monotonic time in nanoseconds.
+*/
+long long now_ns()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+/*
+    Follows the traced processes until all of them are gone and returns
+    the number of system calls they entered. The exit status of pid is
+    stored in status.
+*/
+long long count_syscalls(pid_t pid, int* status)
+{
+    long long count = 0;
+    int options = PTRACE_O_TRACESYSGOOD | PTRACE_O_TRACECLONE | PTRACE_O_TRACEFORK
+                  | PTRACE_O_TRACEVFORK | PTRACE_O_TRACEEXEC | PTRACE_O_EXITKILL;
+    waitpid(pid, status, 0);
+    ptrace(PTRACE_SETOPTIONS, pid, NULL, options);
+    ptrace(PTRACE_SYSCALL, pid, NULL, 0);
+    for(;;)
+    {
+        int stop;
+        pid_t tid = waitpid(-1, &stop, __WALL);
+        if(tid == -1)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            return count;
+        }
+        if(WIFEXITED(stop) || WIFSIGNALED(stop))
+        {
+            if(tid == pid)
+            {
+                *status = stop;
+            }
+            continue;
+        }
+        int signal = 0;
+        if(WSTOPSIG(stop) == (SIGTRAP | 0x80))
+        {
+            struct __ptrace_syscall_info info;
+            if(ptrace(PTRACE_GET_SYSCALL_INFO, tid, sizeof(info), &info) > 0
+               && info.op == PTRACE_SYSCALL_INFO_ENTRY)
+            {
+                count++;
+            }
+        }
+        else if(WSTOPSIG(stop) != SIGTRAP && WSTOPSIG(stop) != SIGSTOP)
+        {
+            // A real signal, which is passed on.
+            signal = WSTOPSIG(stop);
+        }
+        ptrace(PTRACE_SYSCALL, tid, NULL, signal);
+    }
+}
+
+int main(int argc, char** argv)
+{
+    bool trace = argc > 1 && strcmp(argv[1], "-s") == 0;
+    char** command = argv + 1 + trace;
+    if(*command == NULL)
+    {
+        fprintf(stderr, "usage: run_stats [-s] COMMAND [ARG...]\n");
+        return 2;
+    }
+
+    long long start = now_ns();
+    pid_t pid = fork();
+    if(pid == -1)
+    {
+        perror("run_stats: fork");
+        return 2;
+    }
+    if(pid == 0)
+    {
+        if(trace)
+        {
+            ptrace(PTRACE_TRACEME, 0, NULL, 0);
+            raise(SIGSTOP);
+        }
+        execvp(command[0], command);
+        perror(command[0]);
+        _exit(127);
+    }
+
+    int status = 0;
+    long long syscalls = -1;
+    if(trace)
+    {
+        syscalls = count_syscalls(pid, &status);
+    }
+    else
+    {
+        waitpid(pid, &status, 0);
+    }
+    long long elapsed = now_ns() - start;
+
+    // The largest of the waited for children, which is the command unless
+    // something it started was larger.
+    struct rusage usage;
+    getrusage(RUSAGE_CHILDREN, &usage);
+    fprintf(stderr, "wall_ns %lld maxrss_kb %ld syscalls %lld\n", elapsed, usage.ru_maxrss, syscalls);
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+}
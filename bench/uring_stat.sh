@@ -0,0 +1,60 @@
+#!/usr/bin/env bash
+# Compares the synchronous stat path against -uring on a metadata-heavy
+# query, with cold and warm caches.
+#
+# usage: bench/uring_stat.sh [DIR] [RUNS]
+# DIR defaults to a generated tree. Cold cache runs drop the page cache,
+# which needs root, and are skipped otherwise.
+
+DIR=${1:-}
+RUNS=${2:-5}
+cd "$(dirname "$0")/.." || exit 1
+
+gcc -O3 -Wall -Wextra -pedantic -pthread myfind.c -o bench/myfind || exit 1
+
+if [ -z "$DIR" ]; then
+  DIR=bench/tree
+  if [ ! -d "$DIR" ]; then
+    echo "Generating $DIR"
+    for i in $(seq 1 100); do
+      mkdir -p "$DIR/d$i"
+      (cd "$DIR/d$i" && touch $(seq -f "f%g" 1 500))
+    done
+  fi
+fi
+
+can_drop=false
+if [ -w /proc/sys/vm/drop_caches ]; then
+  can_drop=true
+fi
+
+# run LABEL CACHE ARGS...
+run() {
+  local label=$1 cache=$2
+  shift 2
+  local total=0
+  for r in $(seq 1 "$RUNS"); do
+    if [ "$cache" = cold ]; then
+      sync
+      echo 3 > /proc/sys/vm/drop_caches
+    fi
+    local start end
+    start=$(date +%s%N)
+    ./bench/myfind "$@" > /dev/null
+    end=$(date +%s%N)
+    total=$((total + end - start))
+  done
+  awk -v l="$label" -v c="$cache" -v t="$total" -v r="$RUNS" \
+    'BEGIN { printf "%-14s %-5s %10.2f ms\n", l, c, t / r / 1000000 }'
+}
+
+for cache in warm cold; do
+  if [ "$cache" = cold ] && ! $can_drop; then
+    echo "Skipping cold cache runs, need root to drop caches"
+    continue
+  fi
+  run "-mtime sync" "$cache" "$DIR" -mtime 0
+  run "-mtime uring" "$cache" -uring "$DIR" -mtime 0
+  run "-L sync" "$cache" -L "$DIR" -type f
+  run "-L uring" "$cache" -uring -L "$DIR" -type f
+done
@@ -4,6 +4,7 @@
     Completed by: Kai Pinckard
 
 */
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <sys/types.h>
 #include <dirent.h>
@@ -12,31 +13,102 @@
 #include <stdlib.h>
 #include <stdbool.h>
 #include <fnmatch.h>
+#include <regex.h>
 #include <time.h>
 #include <unistd.h>
 #include <sys/wait.h>
 #include <fcntl.h>
 #include <ctype.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <spawn.h>
+#include <errno.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <signal.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#define USE_INOTIFY 1
+#ifdef STATX_BASIC_STATS
+#define USE_STATX 1
+#endif
+#if defined(USE_STATX) && defined(SYS_io_uring_setup) && __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define USE_IO_URING 1
+#endif
+#endif
+#ifdef __SSE2__
+#include <emmintrin.h>
+#define USE_SSE2 1
+#endif
 
 const int NUM_SECS_PER_DAY = 86400;
-// For -name, by default not used
-char* pattern = NULL;
-// For -mtime, by default num_days is not used
-int num_days = -1;
-// Stores all modes that will be accepted.
-mode_t* desired_modes = NULL;
-int num_modes = 0;
-// This stores the arguments to -exec
-char* exec_args = NULL;
-// By default assume the user has not specified -print
-// This does not mean that nothing is printed
-bool should_print = false;
+// The exit status of myfind, set to 1 if a -exec ... + command fails.
+int exit_status = 0;
 // By default do not follow symbolic links
 bool follow_symbolic = false;
-// This is used to store the order arguments occur in.
-char** opt_order = NULL;
-// This is used to keep track of the length of opt_order
-int opt_order_len = 0;
+// For -j, the number of worker threads walking the tree.
+// By default 0, which walks the tree serially on the main thread.
+int num_threads = 0;
+// For -unordered, parallel walks may print matches in any order.
+bool unordered_output = false;
+// For -dirbuf, the size of the buffer directory entries are read into.
+size_t dir_buf_size = 64 * 1024;
+// For -uring, stat the entries of a directory batch through io_uring.
+bool use_uring = false;
+// For -inode-order, read each directory whole and stat its entries in the
+// order of their inode numbers.
+bool inode_order = false;
+// For -exec-jobs, how many -exec commands may run at the same time.
+// By default 0, which runs each command to completion before going on.
+int max_exec_jobs = 0;
+// For -maxfds, how many directories a thread keeps open while walking.
+// Deeper trees are walked by closing and later reopening ancestors.
+int max_open_dirs = 64;
+// For -bfs, walk the tree level by level instead of depth first.
+bool breadth_first = false;
+// For -maxdepth, how deep below the start points files are visited, -1
+// for no limit. Directories at that depth are not opened.
+int max_depth = -1;
+// For -mindepth, files less deep than this are not tested.
+int min_depth = 0;
+// For -xdev and -mount, do not walk below directories on another
+// filesystem than their start point.
+bool stay_on_device = false;
+// Set with -L or -xdev, the walk then keeps the ancestors of the
+// directory it is in, to find loops and mount points.
+bool track_ancestors = false;
+// For -index-build, where to write an index of the walk.
+char* index_build_path = NULL;
+// For -index, the index to run the expression on instead of walking.
+char* index_path = NULL;
+// For -index-update, evaluate the expression while writing the index and
+// reuse the listings of directories that did not change since the last.
+bool index_update = false;
+// For -watch, the socket the daemon answers queries on.
+char* watch_socket = NULL;
+// For -watch-mem, the most memory in bytes the tree of -watch may use
+// before queries walk instead. 0 means no limit.
+size_t watch_mem_limit = 0;
+// For -query, the socket of the -watch daemon that runs the expression.
+char* query_socket = NULL;
+// Set while the -watch daemon parses a query, which runs with the rights
+// and working directory of the daemon.
+bool parsing_query = false;
+// Options a query may not use, they run commands, read the contents of
+// files or write files.
+const char* const QUERY_UNSAFE_OPTIONS[] = {
+    "-exec", "-contains", "-duplicates", "-name-from", "-stats-json",
+    "-index", "-index-build", "-index-update", "-watch", NULL
+};
 
 // A convenient structure to hold file data.
 typedef struct 
@@ -44,17 +116,124 @@ typedef struct
     // Store the file path
     // for example ../testdir/file.txt
     // or ./subdir/subsubdir/
+    // For files found by walk_dir this is NULL until file_path is called.
     char* path;
     // Store the file_name
     // for example file.txt
     // subsubdir
     char* file_name;
-    // stores the information from calling stat
+    // stores the information from calling stat, only valid if have_stat is set
     struct stat statbuffer;
+    bool have_stat;
+    // The file type from the directory entry, DT_UNKNOWN if not known.
+    unsigned char d_type;
+    // The length of the path of the directory containing the file, which
+    // walk_dir keeps at the start of walk_path, for building path.
+    size_t dir_path_len;
+    // An open fd of the directory containing the file, file_name is
+    // relative to it. AT_FDCWD means path has to be used instead.
+    int parent_fd;
+    // With -uring, the stat already submitted for this file or NULL.
+    struct stat_slot* stat_slot;
+    // Set for start points, which are printed exactly as the user gave them.
+    bool is_base_dir;
+    // For -print-pattern, the pattern of -name-from the file matched.
+    const char* matched_pattern;
+    // With -index-update, the file's entry in the previous index if its
+    // directory's listing was reused.
+    const struct index_entry* cached;
+    // How many directories below its start point the file is.
+    int depth;
+    // Set by -prune, or by -xdev at a mount point, the walk does not go
+    // below the directory.
+    bool pruned;
 
 } file_data_t;
 
 
+/*
+    The time of a file that a time predicate looks at.
+*/
+typedef enum
+{
+    ACCESS_TIME,        // -atime, -amin
+    CHANGE_TIME,        // -ctime, -cmin
+    MODIFY_TIME         // -mtime, -mmin, -newer
+} time_field_t;
+
+/*
+    One test or action of the command line, compiled by parse_args with its
+    argument already bound. run returns true if the file passes the test, or
+    if the action succeeded.
+*/
+typedef struct predicate
+{
+    bool (*run)(const struct predicate* pred, file_data_t* file);
+    // Relative cost of the test, side effect free tests are reordered
+    // so the cheapest run first.
+    int cost;
+    bool has_side_effects;
+    // For -name and -iname, the compiled pattern.
+    struct name_matcher* matcher;
+    // For -name-from, the compiled patterns.
+    struct name_set* name_set;
+    // For -regex and -iregex, the compiled expression.
+    struct path_regex* regex;
+    // For -mtime, -mmin, -newer and the like, the time of the file that is
+    // compared against reference. Files are accepted if their time is
+    // before reference ('+', older), after it ('-', newer), or after it
+    // by at most window_secs ('=').
+    time_field_t time_field;
+    struct timespec reference;
+    char comparison;
+    int window_secs;
+    // For -type, all modes that will be accepted.
+    mode_t* modes;
+    int num_modes;
+    // For -exec, the command with {} still in it, NULL terminated.
+    char** exec_argv;
+    int exec_argc;
+    // For -exec ... +, the paths waiting to be passed to the command.
+    struct exec_batch* batch;
+    // For -duplicates, the files collected so far.
+    struct dup_set* dups;
+    // For -print and -print0, the character written after the path.
+    char terminator;
+    // For -contains, the string looked for in the contents of the file.
+    const char* needle;
+    size_t needle_len;
+    // The option the predicate was compiled from, for -stats.
+    const char* name;
+    // For -o, which alternative the predicate belongs to, counting from 0,
+    // and the index after the last predicate of the alternative.
+    int alternative;
+    int alternative_end;
+} predicate_t;
+
+// Costs of the predicates, a stat costs far more than looking at a name.
+const int COST_NAME = 1;
+const int COST_TYPE = 2;
+const int COST_PATH = 3;
+const int COST_STAT = 10;
+const int COST_CONTENT = 50;
+const int COST_ACTION = 100;
+
+// The compiled command line, handle_file runs it on every file.
+predicate_t* program = NULL;
+int program_len = 0;
+// Set if any predicate needs the stat info of every file.
+bool program_needs_stat = false;
+// Set if a predicate looks at the access or change time, which neither
+// the index nor the tree of -watch keep.
+bool program_needs_atime_ctime = false;
+#ifdef USE_STATX
+// The fields ensure_stat asks statx for, narrowed by compile_program to
+// what the program uses so filesystems can skip the others.
+unsigned int stat_mask = STATX_BASIC_STATS;
+// Set if statx is not supported, ensure_stat then calls fstatat.
+_Thread_local bool statx_unavailable = false;
+#endif
+
 // These are needed to keep track of the original base dirs
 // specified by the user. They are stored globally because
 // base dirs should ignore normal formatting and be printed with
@@ -64,781 +243,8406 @@ int num_base_dirs = 0;
 file_data_t* base_dirs = NULL;
 
 /*
-    Returns a new char* containing the directory with the last '/' removed if present
-    For example ../exampledir/ becomes ../exampledir. Caller is responsible for 
-    deallocating returned char*. Assumes directory is not NULL.
+    Works like calloc but exits with the usual error message if the
+    allocation fails, so the caller never receives NULL.
 */
-char* remove_last_slash(const char* directory)
+void* checked_alloc(size_t count, size_t size)
 {
-    if(strlen(directory) > 0)
-    {
-        int last_char_index = strlen(directory) - 1;
-        if(directory[last_char_index] == '/')
-        {
-            char* dir_no_slash = strndup(directory, last_char_index);
-            if(dir_no_slash == NULL)
-            {
-                printf("find: insufficient memory\n");
-                exit(1);
-            }
-            return dir_no_slash;
-        }
-    }
-    char* dir_no_slash = strdup(directory);
-    if(dir_no_slash == NULL)
+    void* memory = calloc(count, size);
+    if(memory == NULL)
     {
         printf("find: insufficient memory\n");
         exit(1);
     }
-    return dir_no_slash;
+    return memory;
 }
 
 /*
-    Returns the dir_name in a new char* caller is responsible for deallocating.
-    For example ../dir/exampledir/ becomes exampledir
+    Works like realloc but exits with the usual error message if the
+    allocation fails.
 */
-char* dir_path_to_dir_name(const char* directory)
+void* checked_realloc(void* memory, size_t size)
 {
-    char* dir_path_no_slash = remove_last_slash(directory);
-
-    // get pointer to last occurance of char
-    char* start_pos = strrchr(dir_path_no_slash, '/');
-    if(start_pos != NULL)
+    void* new_memory = realloc(memory, size);
+    if(new_memory == NULL)
     {
-        // copy str starting from the next char on.
-        char* dir_name = strdup(start_pos + 1);
-        if(dir_name == NULL)
-        {
-            printf("find: insufficient memory\n");
-            exit(1);
-        }
-        free(dir_path_no_slash);
-        return dir_name;
+        printf("find: insufficient memory\n");
+        exit(1);
     }
-    return dir_path_no_slash;
+    return new_memory;
 }
 
 /*
-    Returns the base_dir that corresponds to path or NULL if path
-    is not a base_dir. A path corresponds to a base_dir if the two are the 
-    same ignoring the presence of a trailing slash. 
+    The time spent in one kind of call and how often it was made.
 */
-char* matching_base_dir(const char* path)
+typedef struct
 {
-    char* new_path = remove_last_slash(path);
-    for (int i = 0; i < num_base_dirs; i++)
-    {
-        if(base_dirs[i].path != NULL)
-        {
-            char* new_base = remove_last_slash(base_dirs[i].path);
-            if(strcmp(new_base, new_path) == 0)
-            {
-                free(new_base);
-                free(new_path);
-                char* matching_base_dir = strdup(base_dirs[i].path);
-                if(matching_base_dir == NULL)
-                {
-                    printf("find: insufficient memory\n");
-                    exit(1);
-                }
-                return matching_base_dir;
-            }
-            free(new_base);
-        }
-    }
-    free(new_path);
-    return NULL;
-}
+    uint64_t count;
+    uint64_t ns;
+} stats_timer_t;
 
 /*
-    Takes a complete path as an input such as ../testdir/dir/file.txt or ../testdir/otherdir/
-    prints out the path minus the last slash if it is present. However, base dirs are be printed as specified by the
-    user and not following the usual convention.
+    What -stats counts. Each thread counts into its own copy, which is
+    added to total_stats when the thread is done.
 */
-void print_match(const char* path)
+typedef struct
 {
-    int length = strlen(path);
+    uint64_t dirs_opened;
+    uint64_t dir_open_errors;
+    // Directories closed to stay below -maxfds.
+    uint64_t dirs_spilled;
+    stats_timer_t dir_reads;
+    uint64_t entries_read;
+    // stat calls made, and files whose stat came from io_uring instead.
+    stats_timer_t stats;
+    uint64_t uring_stats;
+    // Files that needed stat info at all.
+    uint64_t files_stated;
+    stats_timer_t exec_spawns;
+    // From starting a command until it was reaped.
+    stats_timer_t exec_runs;
+    stats_timer_t writes;
+    uint64_t bytes_written;
+    // One bucket per power of two nanoseconds.
+    uint64_t stat_histogram[64];
+    uint64_t exec_histogram[64];
+    // Per predicate of program, allocated when first needed.
+    uint64_t* pred_evals;
+    uint64_t* pred_rejects;
+    uint64_t* pred_ns;
+} stats_t;
 
-    // If the path corresponds to a base dir then print it as originally
-    // specified by the user
-
-    char* match;
-    if( (match = matching_base_dir(path) ) != NULL)
-    {
-        printf("%s\n", match);
-        free(match);
-        return;
-    }
-
-    // If the path is not a base dir and ends in a slash do not print the slash.
-    if(strlen(path) > 0)
-    {
-        if(path[length - 1] == '/')
-        {
-            length--;
-        }
-    }
-
-    for (int i = 0; i < length; i++)
-    {
-        putchar(path[i]);
-    }
-    putchar('\n');
-}
+// For -stats, collect stats_t and print them to stderr at the end.
+bool collect_stats = false;
+// For -stats-json, where to write the stats as JSON.
+char* stats_json_path = NULL;
+_Thread_local stats_t thread_stats;
+stats_t total_stats;
+pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
 
 /*
-    Returns true if the file_name matches the pattern. The pattern
-    is the value passed to -name
+    Returns a monotonic time in nanoseconds, or 0 without -stats so the
+    clock is not read at all.
 */
-bool handle_name(const char* pattern, const char* file_name)
+static inline uint64_t stats_now()
 {
-    return fnmatch(pattern, file_name, 0) == 0;
+    if(!collect_stats)
+    {
+        return 0;
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
 }
 
 /*
-    Returns true if the modified time is within num_days of the
-    current time.
+    Adds the time since start, taken by stats_now, to timer and returns
+    it. histogram may be NULL.
 */
-bool occurred_within(const time_t current_time, const time_t m_time, const int num_days)
+uint64_t stats_record(stats_timer_t* timer, uint64_t* histogram, uint64_t start)
 {
-    
-    long int max_dif = NUM_SECS_PER_DAY * (num_days + 1);
-    long int min_dif = NUM_SECS_PER_DAY * num_days;
-    time_t time_dif = current_time - m_time;
-    return time_dif < max_dif && time_dif > min_dif;
+    uint64_t elapsed = stats_now() - start;
+    timer->count++;
+    timer->ns += elapsed;
+    if(histogram != NULL)
+    {
+        int bucket = 0;
+        while(bucket < 63 && (elapsed >> (bucket + 1)) != 0)
+        {
+            bucket++;
+        }
+        histogram[bucket]++;
+    }
+    return elapsed;
 }
 
 /*
-    Returns true if the file specified by file_name was modified at
-    mtime. Note +/- features not implemented. 
+    Adds the counts of the current thread to total_stats.
 */
-bool handle_mtime(const file_data_t file)
+void merge_thread_stats()
 {
-    time_t cur_time;
-    time(&cur_time);
-    return occurred_within(cur_time, file.statbuffer.st_mtime, num_days);
+    if(!collect_stats)
+    {
+        return;
+    }
+    stats_t* from = &thread_stats;
+    pthread_mutex_lock(&stats_lock);
+    // Everything up to the per predicate arrays is a uint64_t.
+    uint64_t* to_counts = (uint64_t*) &total_stats;
+    uint64_t* from_counts = (uint64_t*) from;
+    for(size_t i = 0; i < offsetof(stats_t, pred_evals) / sizeof(uint64_t); i++)
+    {
+        to_counts[i] += from_counts[i];
+    }
+    if(from->pred_evals != NULL)
+    {
+        if(total_stats.pred_evals == NULL)
+        {
+            total_stats.pred_evals = (uint64_t*) checked_alloc(program_len, sizeof(uint64_t));
+            total_stats.pred_rejects = (uint64_t*) checked_alloc(program_len, sizeof(uint64_t));
+            total_stats.pred_ns = (uint64_t*) checked_alloc(program_len, sizeof(uint64_t));
+        }
+        for(int i = 0; i < program_len; i++)
+        {
+            total_stats.pred_evals[i] += from->pred_evals[i];
+            total_stats.pred_rejects[i] += from->pred_rejects[i];
+            total_stats.pred_ns[i] += from->pred_ns[i];
+        }
+        free(from->pred_evals);
+        free(from->pred_rejects);
+        free(from->pred_ns);
+    }
+    pthread_mutex_unlock(&stats_lock);
+    memset(from, 0, sizeof(stats_t));
 }
 
 /*
-    Returns true if the file specified by file_name is of the type
-    passed for -type
+    Prints the nonzero buckets of histogram to out, as text or as a JSON
+    object mapping the upper bound in nanoseconds to the count.
 */
-bool handle_type(const file_data_t file)
+void print_histogram(FILE* out, const uint64_t* histogram, bool json)
 {
-    // If -type was not specified
-    if(num_modes == 0)
-    {
-        return (file.statbuffer.st_mode & S_IFMT) == S_IFMT;
-    }
-    else
+    bool first = true;
+    for(int i = 0; i < 64; i++)
     {
-        // return true if the type matches any of the accepted types.
-        for(int i = 0; i < num_modes; i++)
+        if(histogram[i] == 0)
         {
-            if((file.statbuffer.st_mode & S_IFMT) == desired_modes[i])
-            {
-                return true;
-            }
+            continue;
         }
-        return false;
+        unsigned long long bound = i == 63 ? UINT64_MAX : (2ull << i) - 1;
+        if(json)
+        {
+            fprintf(out, "%s\"%llu\": %llu", first ? "" : ", ", bound, (unsigned long long) histogram[i]);
+        }
+        else
+        {
+            fprintf(out, "    <= %12llu ns %12llu\n", bound, (unsigned long long) histogram[i]);
+        }
+        first = false;
     }
 }
 
-/* 
-    Populate the brackets in exec_args with the file path and return a new string.
-    Caller is responsible for deallocating the returned string.
+/*
+    Prints total_stats to stderr for -stats and writes them to
+    stats_json_path for -stats-json.
 */
-char* populate_command(file_data_t file)
+void report_stats()
 {
-    // calculate allocation size of filled string
-    int path_length = strlen(file.path);
-    int length = strlen(exec_args) + 1;
-    int size_inc = path_length - strlen("{}");
+    merge_thread_stats();
+    stats_t* stats = &total_stats;
+    uint64_t avoided = stats->entries_read > stats->files_stated ? stats->entries_read - stats->files_stated : 0;
+    const double MS = 1000000.0;
 
-    // loop through all but the last char in the string
-    // to find occurances of {}
-    for(int i = 0; exec_args[i+1] != '\0'; i++)
+    FILE* out = stderr;
+    fprintf(out, "find: statistics\n");
+    fprintf(out, "  directories opened  %12llu  (%llu failed, %llu spilled)\n",
+            (unsigned long long) stats->dirs_opened, (unsigned long long) stats->dir_open_errors,
+            (unsigned long long) stats->dirs_spilled);
+    fprintf(out, "  directory reads     %12llu  %10.3f ms\n",
+            (unsigned long long) stats->dir_reads.count, stats->dir_reads.ns / MS);
+    fprintf(out, "  entries read        %12llu\n", (unsigned long long) stats->entries_read);
+    fprintf(out, "  stat calls          %12llu  %10.3f ms\n",
+            (unsigned long long) stats->stats.count, stats->stats.ns / MS);
+    fprintf(out, "  stats from io_uring %12llu\n", (unsigned long long) stats->uring_stats);
+    fprintf(out, "  stats avoided       %12llu\n", (unsigned long long) avoided);
+    for(int i = 0; i < program_len && stats->pred_evals != NULL; i++)
     {
-        if (exec_args[i] == '{' && exec_args[i+1] == '}')
-        {
-            length += size_inc;
-        }
+        fprintf(out, "  %-19s %12llu  %10.3f ms  (%llu rejected)\n", program[i].name,
+                (unsigned long long) stats->pred_evals[i], stats->pred_ns[i] / MS,
+                (unsigned long long) stats->pred_rejects[i]);
     }
+    fprintf(out, "  exec spawns         %12llu  %10.3f ms\n",
+            (unsigned long long) stats->exec_spawns.count, stats->exec_spawns.ns / MS);
+    fprintf(out, "  exec wall time      %12llu  %10.3f ms\n",
+            (unsigned long long) stats->exec_runs.count, stats->exec_runs.ns / MS);
+    fprintf(out, "  output writes       %12llu  %10.3f ms  (%llu bytes)\n",
+            (unsigned long long) stats->writes.count, stats->writes.ns / MS,
+            (unsigned long long) stats->bytes_written);
+    fprintf(out, "  stat latency\n");
+    print_histogram(out, stats->stat_histogram, false);
+    fprintf(out, "  exec latency\n");
+    print_histogram(out, stats->exec_histogram, false);
 
-    char* filled_exec_args = (char*) calloc(length, sizeof(char));
-    if(filled_exec_args == NULL)
+    if(stats_json_path == NULL)
     {
-        printf("find: insufficient memory\n");
-        exit(1);
+        return;
     }
-
-    int filled_str_index = 0;
-    for (unsigned long int original_index = 0; original_index < strlen(exec_args);)
+    out = fopen(stats_json_path, "w");
+    if(out == NULL)
     {
-        if (exec_args[original_index] == '{' && exec_args[original_index+1] == '}')
-        {
-            for(int j = 0; j < path_length; j++)
-            {
-                filled_exec_args[filled_str_index + j] = file.path[j];
-            }
-            filled_str_index += path_length;
-            original_index += 2;
-        }
-        else
-        {
-            filled_exec_args[filled_str_index] = exec_args[original_index];
-            filled_str_index += 1;
-            original_index += 1;
-        }
+        fprintf(stderr, "find: ‘%s’: %s\n", stats_json_path, strerror(errno));
+        exit_status = 1;
+        return;
+    }
+    fprintf(out, "{\n  \"dirs_opened\": %llu,\n  \"dir_open_errors\": %llu,\n  \"dirs_spilled\": %llu,\n",
+            (unsigned long long) stats->dirs_opened, (unsigned long long) stats->dir_open_errors,
+            (unsigned long long) stats->dirs_spilled);
+    fprintf(out, "  \"dir_reads\": {\"count\": %llu, \"ns\": %llu},\n",
+            (unsigned long long) stats->dir_reads.count, (unsigned long long) stats->dir_reads.ns);
+    fprintf(out, "  \"entries_read\": %llu,\n", (unsigned long long) stats->entries_read);
+    fprintf(out, "  \"stats\": {\"count\": %llu, \"ns\": %llu},\n",
+            (unsigned long long) stats->stats.count, (unsigned long long) stats->stats.ns);
+    fprintf(out, "  \"uring_stats\": %llu,\n  \"stats_avoided\": %llu,\n",
+            (unsigned long long) stats->uring_stats, (unsigned long long) avoided);
+    fprintf(out, "  \"predicates\": [");
+    for(int i = 0; i < program_len && stats->pred_evals != NULL; i++)
+    {
+        fprintf(out, "%s\n    {\"name\": \"%s\", \"evaluations\": %llu, \"rejections\": %llu, \"ns\": %llu}",
+                i == 0 ? "" : ",", program[i].name, (unsigned long long) stats->pred_evals[i],
+                (unsigned long long) stats->pred_rejects[i], (unsigned long long) stats->pred_ns[i]);
+    }
+    fprintf(out, "\n  ],\n");
+    fprintf(out, "  \"exec_spawns\": {\"count\": %llu, \"ns\": %llu},\n",
+            (unsigned long long) stats->exec_spawns.count, (unsigned long long) stats->exec_spawns.ns);
+    fprintf(out, "  \"exec_runs\": {\"count\": %llu, \"ns\": %llu},\n",
+            (unsigned long long) stats->exec_runs.count, (unsigned long long) stats->exec_runs.ns);
+    fprintf(out, "  \"writes\": {\"count\": %llu, \"ns\": %llu},\n  \"bytes_written\": %llu,\n",
+            (unsigned long long) stats->writes.count, (unsigned long long) stats->writes.ns,
+            (unsigned long long) stats->bytes_written);
+    fprintf(out, "  \"stat_histogram\": {");
+    print_histogram(out, stats->stat_histogram, true);
+    fprintf(out, "},\n  \"exec_histogram\": {");
+    print_histogram(out, stats->exec_histogram, true);
+    fprintf(out, "}\n}\n");
+    if(fclose(out) != 0)
+    {
+        fprintf(stderr, "find: ‘%s’: %s\n", stats_json_path, strerror(errno));
+        exit_status = 1;
     }
-    return filled_exec_args;
 }
 
+// Buffered output is handed on once it reaches this size.
+const size_t OUT_CHUNK_SIZE = 64 * 1024;
+
 /*
-    Executes the specified command on the file specified. Returns true if
-    the command succeeded and false otherwise.
+    A piece of buffered output produced by a worker thread. In ordered mode
+    the output of a directory is a queue of segments, each holding some text
+    optionally followed by the complete output of one of its subdirectories.
 */
-bool handle_exec(file_data_t file)
+typedef struct out_segment
 {
-    char* filled_exec_args = populate_command(file);
-    bool return_value = system(filled_exec_args) == 0;
-    free(filled_exec_args);
-    return return_value;
-}
+    char* text;
+    size_t len;
+    size_t cap;
+    // The subdirectory whose output comes right after text, or NULL.
+    struct out_node* child;
+    struct out_segment* next;
+} out_segment_t;
 
 /*
-    Checks if a file matches all the requirements specified by the options
-    then either executes a command on it or prints it out as required by the
-    specified options.
+    The output of one directory when walking in parallel with ordered output.
+    The worker walking the directory appends segments to the queue and the
+    main thread removes them in order and writes them to stdout.
 */
-void handle_file(const file_data_t file)
+typedef struct out_node
 {
-    // used to check if default printing behavior should kick in.
-    bool already_printed = false;
+    out_segment_t* head;
+    out_segment_t* tail;
+    // Set once the directory and all of its entries have been handled.
+    bool done;
+} out_node_t;
 
-    // handle the options in the order they were passed in.
-    for(int i = 0; i < opt_order_len; i++)
+// Guards the queue and done flag of every out_node_t.
+pthread_mutex_t out_lock = PTHREAD_MUTEX_INITIALIZER;
+// Signalled whenever a segment is queued or a directory is done.
+pthread_cond_t out_cond = PTHREAD_COND_INITIALIZER;
+
+// Output of the main thread that has not been written to stdout yet.
+char* out_buf = NULL;
+size_t out_buf_len = 0;
+// Keeps workers writing with -unordered from interleaving with each other.
+pthread_mutex_t stdout_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Index of the current worker thread, the main thread is -1.
+_Thread_local int worker_id = -1;
+// The directory output the current worker is producing (ordered mode only).
+_Thread_local out_node_t* cur_out = NULL;
+// Text the current worker has produced but not yet handed on.
+_Thread_local out_segment_t* out_text = NULL;
+
+/*
+    Writes the iovcnt buffers in iov to stdout with as few system calls as
+    possible. Modifies iov to keep track of short writes. On a write error
+    the rest of the output is dropped and the exit status is set to 1.
+*/
+void write_all(struct iovec* iov, int iovcnt)
+{
+    uint64_t start = stats_now();
+    if(collect_stats)
     {
-        if(strcmp(opt_order[i], "-name") == 0)
-        {
-            if(pattern != NULL && !handle_name(pattern, file.file_name))
-            {
-                return;
-            }
-        }
-        else if(strcmp(opt_order[i], "-mtime") == 0)
+        for(int i = 0; i < iovcnt; i++)
         {
-            if(num_days != -1 && !handle_mtime(file))
-            { 
-                return;
-            }
+            thread_stats.bytes_written += iov[i].iov_len;
         }
-        else if(strcmp(opt_order[i], "-type") == 0)
+    }
+    while(iovcnt > 0)
+    {
+        ssize_t written = writev(STDOUT_FILENO, iov, iovcnt);
+        if(written == -1)
         {
-            if(num_modes > 0 && !handle_type(file))
+            if(errno == EINTR)
             {
-                return;
+                continue;
             }
+            exit_status = 1;
+            return;
         }
-        else if(strcmp(opt_order[i], "-exec") == 0)
+        // Skip the buffers that were written completely.
+        while(iovcnt > 0 && (size_t) written >= iov->iov_len)
         {
-            if(exec_args != NULL && !handle_exec(file))
-            {
-                return;
-            } 
+            written -= iov->iov_len;
+            iov++;
+            iovcnt--;
         }
-        else if(strcmp(opt_order[i], "-print") == 0)
+        if(iovcnt > 0)
         {
-            if(exec_args == NULL || should_print)
-            {
-                print_match(file.path);
-            }
-            already_printed = true;
+            iov->iov_base = (char*) iov->iov_base + written;
+            iov->iov_len -= written;
         }
     }
-    if( (already_printed == false) && (exec_args == NULL || should_print) )
+    if(collect_stats)
     {
-        print_match(file.path);
-    }   
+        stats_record(&thread_stats.writes, NULL, start);
+    }
 }
 
 /*
-    Returns a new string that the caller must deallocate that contains a trailing
-    slash.
+    Writes the output buffered by the main thread to stdout. Called before
+    anything else may write to stdout, such as a command started by -exec.
 */
-char* add_slash(const char* directory)
+void out_flush()
 {
-    int length = strlen(directory) + 2;
-    char* dir = (char*) calloc(length, sizeof(char));
-    if(dir == NULL)
+    if(out_buf_len > 0)
     {
-        printf("find: insufficient memory\n");
-        exit(1);
+        struct iovec iov = { out_buf, out_buf_len };
+        out_buf_len = 0;
+        write_all(&iov, 1);
     }
-    return strcat(strcat(dir, directory), "/");
 }
 
 /*
-    Returns a new char* containing the directory and the file name
-    joined into a valid file path. Caller is responsible for deallocating
-    the returned char*.
+    Hands the text buffered by the current worker on. In unordered mode it
+    is written straight to stdout, otherwise it is queued on the output of
+    the directory being walked, followed by child if that is not NULL.
 */
-char* join_path(const char* directory, const char* file_name)
+void out_publish(out_node_t* child)
 {
-    int dir_len = strlen(directory);
-    int total_length = dir_len + strlen(file_name) + 1;
-    bool needs_slash = directory[dir_len-1] != '/';
-
-    if (needs_slash)
+    if(unordered_output)
     {
-        total_length++;
+        if(out_text != NULL && out_text->len > 0)
+        {
+            struct iovec iov = { out_text->text, out_text->len };
+            pthread_mutex_lock(&stdout_lock);
+            write_all(&iov, 1);
+            pthread_mutex_unlock(&stdout_lock);
+            out_text->len = 0;
+        }
+        return;
     }
 
-    char* path = (char*) calloc(total_length, sizeof(char));
-    if(path == NULL)
+    out_segment_t* segment = out_text;
+    if(segment == NULL)
     {
-        printf("find: insufficient memory\n");
-        exit(1);
+        segment = (out_segment_t*) checked_alloc(1, sizeof(out_segment_t));
     }
-    strcat(path, directory);
+    out_text = NULL;
+    segment->child = child;
 
-    if(needs_slash)
+    pthread_mutex_lock(&out_lock);
+    if(cur_out->tail == NULL)
     {
-        strcat(path, "/");
+        cur_out->head = segment;
     }
-
-    return strcat(path, file_name);
+    else
+    {
+        cur_out->tail->next = segment;
+    }
+    cur_out->tail = segment;
+    pthread_cond_signal(&out_cond);
+    pthread_mutex_unlock(&out_lock);
 }
 
 /*
-    Works like stat or lstat depending on value of follow_symbolic
-    returns true if able to get stat info false otherwise.
+    Writes len bytes of text to the output. The serial walk and the main
+    thread collect the text in out_buf and write it with a single writev
+    together with the text that does not fit anymore. Workers buffer the
+    text until it can be written in the right order.
 */
-bool get_stat_info(const char* path,  struct stat* statbuffer)
+void out_write(const char* text, size_t len)
 {
-    if(follow_symbolic)
+    if(worker_id < 0)
     {
-        if(stat(path, statbuffer) == -1)
+        if(out_buf_len + len > OUT_CHUNK_SIZE)
         {
-            return false;
+            struct iovec iov[2] = { { out_buf, out_buf_len }, { (char*) text, len } };
+            out_buf_len = 0;
+            write_all(iov, 2);
+            return;
         }
-    }
-    else
-    {
-        if(lstat(path, statbuffer) == -1)
+        if(out_buf == NULL)
         {
-            return false;
+            out_buf = (char*) checked_alloc(OUT_CHUNK_SIZE, sizeof(char));
         }
+        memcpy(out_buf + out_buf_len, text, len);
+        out_buf_len += len;
+        return;
+    }
+
+    if(out_text == NULL)
+    {
+        out_text = (out_segment_t*) checked_alloc(1, sizeof(out_segment_t));
+    }
+    if(out_text->len + len > out_text->cap)
+    {
+        out_text->cap = out_text->len + len > OUT_CHUNK_SIZE ? out_text->len + len : OUT_CHUNK_SIZE;
+        out_text->text = (char*) checked_realloc(out_text->text, out_text->cap);
+    }
+    memcpy(out_text->text + out_text->len, text, len);
+    out_text->len += len;
+
+    if(out_text->len >= OUT_CHUNK_SIZE)
+    {
+        out_publish(NULL);
     }
-    return true;
 }
 
 /*
-    Recursively traverses the specified directory calling handle_file on each
-    file or directory in encountered during the traversal.
+    Works like printf but writes through out_write.
 */
-void walk_dir(file_data_t dir_file_data)
+void out_printf(const char* format, ...)
 {
-    struct dirent *de;
-    
-    // Every directory handles it self at the beginning
-    handle_file(dir_file_data);
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(NULL, 0, format, args);
+    va_end(args);
 
-    DIR* dr = opendir(dir_file_data.path);
+    char* text = (char*) checked_alloc(length + 1, sizeof(char));
+    va_start(args, format);
+    vsnprintf(text, length + 1, format, args);
+    va_end(args);
 
-    // if dir_file_data is not a directory or can not be opened skip it
-    if (dr == NULL)
-    {
-        char* error_path = remove_last_slash(dir_file_data.path);
-        printf("find: ‘%s’: Permission denied\n", error_path);
-        free(error_path);
-        free(dir_file_data.path);
-        free(dir_file_data.file_name);
-        return;
-    }
+    out_write(text, length);
+    free(text);
+}
 
-    // Get each of the directory entries and handle them as well.
-    while((de = readdir(dr)) != NULL)
+/*
+    Returns a new char* containing the directory with the last '/' removed if present
+    For example ../exampledir/ becomes ../exampledir. Caller is responsible for 
+    deallocating returned char*. Assumes directory is not NULL.
+*/
+char* remove_last_slash(const char* directory)
+{
+    if(strlen(directory) > 0)
     {
-        // Check that the current item is not . or ..
-        if ( (strcmp(de->d_name, "..") != 0 ) && (strcmp(de->d_name, ".") != 0) )
+        int last_char_index = strlen(directory) - 1;
+        if(directory[last_char_index] == '/')
         {
-            char* file_name = strdup(de->d_name);
-            if(file_name == NULL)
+            char* dir_no_slash = strndup(directory, last_char_index);
+            if(dir_no_slash == NULL)
             {
                 printf("find: insufficient memory\n");
                 exit(1);
             }
-            char* path = join_path(dir_file_data.path, de->d_name);
-
-            struct stat statbuffer;
-            get_stat_info(path, &statbuffer);
-            file_data_t cur_file = {path, file_name, statbuffer};
-
-            // Check if the file is of type directory
-            if((cur_file.statbuffer.st_mode & S_IFMT) == S_IFDIR)
-            {
-                // Only follow symbolic links if specified
-                if((cur_file.statbuffer.st_mode & S_IFMT) != S_IFLNK || follow_symbolic)
-                {
-                    char* new_path = add_slash(cur_file.path);
-                    free(cur_file.path);
-                    cur_file.path = new_path;
-                    // Call this function again on each sub directory
-                    walk_dir(cur_file);
-                }
-            }
-            else
-            {
-                // No subdirectories are handled here
-                handle_file(cur_file);
-                free(cur_file.path);
-                free(cur_file.file_name);
-            }
+            return dir_no_slash;
         }
     }
-    free(dir_file_data.path);
-    free(dir_file_data.file_name);
-    free(de);
-    closedir(dr);
+    char* dir_no_slash = strdup(directory);
+    if(dir_no_slash == NULL)
+    {
+        printf("find: insufficient memory\n");
+        exit(1);
+    }
+    return dir_no_slash;
 }
 
 /*
-    Takes a single mode char and returns the corresponding
-    mode bit mask.
+    Returns the dir_name in a new char* caller is responsible for deallocating.
+    For example ../dir/exampledir/ becomes exampledir
 */
-mode_t get_mode_mask(char mode_specifier)
+char* dir_path_to_dir_name(const char* directory)
 {
-    switch(mode_specifier)
+    char* dir_path_no_slash = remove_last_slash(directory);
+
+    // get pointer to last occurance of char
+    char* start_pos = strrchr(dir_path_no_slash, '/');
+    if(start_pos != NULL)
     {
-        case 'b': return S_IFBLK;
-        case 'c': return S_IFCHR;
-        case 'd': return S_IFDIR;
-        //case 'p': return 
-        case 'f': return S_IFREG;
-        case 'l': return S_IFLNK;
-        case 's': return S_IFSOCK;
-        //case 'D': return 
-        default: 
-            printf("find: Unknown argument to -type: %c\n", mode_specifier);
+        // copy str starting from the next char on.
+        char* dir_name = strdup(start_pos + 1);
+        if(dir_name == NULL)
+        {
+            printf("find: insufficient memory\n");
             exit(1);
+        }
+        free(dir_path_no_slash);
+        return dir_name;
     }
+    return dir_path_no_slash;
 }
 
 /*
-    Parses the arguments to -type. Stores the results in global 
-    desired_modes and updates num_modes to the correct number.
+    A path that is appended to as the walk goes down the tree and cut
+    back as it comes up again, so building a path does not allocate.
 */
-void arg_to_mode(char** argv, int index)
+typedef struct
 {
-    // Holds the string the mode specifications.
-    char* mode_specifier = argv[index+1];
-    int length = strlen(mode_specifier);
+    char* text;
+    size_t len;
+    size_t cap;
+} path_buf_t;
+
+// The path of the directory the current thread is walking, followed by
+// the name of the entry whose path was built last.
+_Thread_local path_buf_t walk_path = { NULL, 0, 0 };
+
+/*
+    Appends len bytes of text to the path, keeping it null terminated.
+*/
+void path_append(path_buf_t* path, const char* text, size_t len)
+{
+    if(path->len + len + 1 > path->cap)
+    {
+        path->cap = path->cap == 0 ? 256 : path->cap;
+        while(path->len + len + 1 > path->cap)
+        {
+            path->cap *= 2;
+        }
+        path->text = (char*) checked_realloc(path->text, path->cap);
+    }
+    memcpy(path->text + path->len, text, len);
+    path->len += len;
+    path->text[path->len] = '\0';
+}
+
+/*
+    Cuts the path back to its first len bytes.
+*/
+void path_truncate(path_buf_t* path, size_t len)
+{
+    path->len = len;
+    if(path->text != NULL)
+    {
+        path->text[len] = '\0';
+    }
+}
+
+/*
+    Returns the path of file. Files found by walk_dir only get a path
+    once something needs it, such as printing or -exec. Their path is
+    built in walk_path and stays valid until the walk moves on.
+*/
+const char* file_path(file_data_t* file)
+{
+    if(file->path == NULL)
+    {
+        path_truncate(&walk_path, file->dir_path_len);
+        path_append(&walk_path, file->file_name, strlen(file->file_name));
+        file->path = walk_path.text;
+    }
+    return file->path;
+}
+
+/*
+    A block of memory handed out by an arena.
+*/
+typedef struct arena_block
+{
+    struct arena_block* next;
+    size_t used;
+    size_t cap;
+    char data[];
+} arena_block_t;
+
+/*
+    A bump allocator for memory that outlives one entry but is released
+    all at once, such as the paths waiting in an -exec ... + batch.
+*/
+typedef struct
+{
+    arena_block_t* head;
+} arena_t;
+
+// Size of the blocks of an arena, larger allocations get their own block.
+const size_t ARENA_BLOCK_SIZE = 64 * 1024;
+
+/*
+    Returns size bytes from the arena, valid until the arena is reset.
+*/
+void* arena_alloc(arena_t* arena, size_t size)
+{
+    // Keep everything aligned for any type.
+    size = (size + sizeof(max_align_t) - 1) & ~(sizeof(max_align_t) - 1);
+    arena_block_t* block = arena->head;
+    if(block == NULL || block->used + size > block->cap)
+    {
+        size_t cap = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+        block = (arena_block_t*) checked_alloc(1, sizeof(arena_block_t) + cap);
+        block->cap = cap;
+        block->next = arena->head;
+        arena->head = block;
+    }
+    void* memory = block->data + block->used;
+    block->used += size;
+    return memory;
+}
+
+/*
+    Releases everything allocated from the arena. The newest block is
+    kept for reuse, so an arena that is filled and reset over and over
+    stops allocating.
+*/
+void arena_reset(arena_t* arena)
+{
+    if(arena->head == NULL)
+    {
+        return;
+    }
+    arena_block_t* block = arena->head->next;
+    while(block != NULL)
+    {
+        arena_block_t* next = block->next;
+        free(block);
+        block = next;
+    }
+    arena->head->next = NULL;
+    arena->head->used = 0;
+}
+
+void arena_free(arena_t* arena)
+{
+    arena_reset(arena);
+    free(arena->head);
+    arena->head = NULL;
+}
+
+/*
+    The result of one statx submitted ahead of time. The slot is done once
+    its completion was reaped, result then holds 0 or a negative errno.
+*/
+typedef struct stat_slot
+{
+#ifdef USE_IO_URING
+    struct statx stx;
+#endif
+    int result;
+    bool submitted;
+    bool done;
+} stat_slot_t;
+
+#ifdef USE_IO_URING
+// Number of statx requests that may be in flight on one thread.
+const unsigned STAT_RING_ENTRIES = 128;
+
+/*
+    An io_uring used to run statx requests, the pointers point into the
+    rings shared with the kernel.
+*/
+typedef struct
+{
+    int fd;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    struct io_uring_sqe* sqes;
+    struct io_uring_cqe* cqes;
+    unsigned entries;
+    // Requests queued but not yet passed to io_uring_enter.
+    unsigned to_submit;
+    // Requests submitted whose completion was not reaped yet.
+    unsigned in_flight;
+    void* sq_map;
+    size_t sq_map_size;
+    void* cq_map;
+    size_t cq_map_size;
+    size_t sqes_size;
+} stat_ring_t;
+
+// The ring of the current thread, set up the first time it is needed.
+_Thread_local stat_ring_t* stat_ring = NULL;
+// Set if io_uring or its statx operation is not available.
+_Thread_local bool stat_ring_failed = false;
+
+/*
+    Unmaps and closes the ring of the current thread.
+*/
+void free_stat_ring()
+{
+    if(stat_ring == NULL)
+    {
+        return;
+    }
+    munmap(stat_ring->sqes, stat_ring->sqes_size);
+    if(stat_ring->cq_map != stat_ring->sq_map)
+    {
+        munmap(stat_ring->cq_map, stat_ring->cq_map_size);
+    }
+    munmap(stat_ring->sq_map, stat_ring->sq_map_size);
+    close(stat_ring->fd);
+    free(stat_ring);
+    stat_ring = NULL;
+}
+
+/*
+    Returns the ring of the current thread, setting it up if needed.
+    Returns NULL if io_uring is not available, the caller then stats
+    synchronously.
+*/
+stat_ring_t* get_stat_ring()
+{
+    if(stat_ring != NULL || stat_ring_failed)
+    {
+        return stat_ring;
+    }
+
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int fd = syscall(SYS_io_uring_setup, STAT_RING_ENTRIES, &params);
+    if(fd < 0)
+    {
+        stat_ring_failed = true;
+        return NULL;
+    }
+
+    stat_ring_t* ring = (stat_ring_t*) checked_alloc(1, sizeof(stat_ring_t));
+    ring->fd = fd;
+    ring->entries = params.sq_entries;
+    ring->sq_map_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_map_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if(params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if(ring->cq_map_size > ring->sq_map_size)
+        {
+            ring->sq_map_size = ring->cq_map_size;
+        }
+        ring->cq_map_size = ring->sq_map_size;
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    ring->sq_map = mmap(NULL, ring->sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    ring->cq_map = ring->sq_map;
+    if(ring->sq_map != MAP_FAILED && !(params.features & IORING_FEAT_SINGLE_MMAP))
+    {
+        ring->cq_map = mmap(NULL, ring->cq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    }
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if(ring->sq_map == MAP_FAILED || ring->cq_map == MAP_FAILED || ring->sqes == MAP_FAILED)
+    {
+        if(ring->sqes != MAP_FAILED)
+        {
+            munmap(ring->sqes, ring->sqes_size);
+        }
+        if(ring->cq_map != MAP_FAILED && ring->cq_map != ring->sq_map)
+        {
+            munmap(ring->cq_map, ring->cq_map_size);
+        }
+        if(ring->sq_map != MAP_FAILED)
+        {
+            munmap(ring->sq_map, ring->sq_map_size);
+        }
+        close(fd);
+        free(ring);
+        stat_ring_failed = true;
+        return NULL;
+    }
+
+    char* sq = (char*) ring->sq_map;
+    char* cq = (char*) ring->cq_map;
+    ring->sq_tail = (unsigned*) (sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned*) (sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned*) (sq + params.sq_off.array);
+    ring->cq_head = (unsigned*) (cq + params.cq_off.head);
+    ring->cq_tail = (unsigned*) (cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned*) (cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*) (cq + params.cq_off.cqes);
+
+    stat_ring = ring;
+    return ring;
+}
+
+/*
+    Queues a statx of name, relative to dir_fd, whose result goes to slot.
+    Returns false if the ring is full. Nothing reaches the kernel until
+    stat_ring_enter is called.
+*/
+bool stat_ring_queue(stat_ring_t* ring, int dir_fd, const char* name, stat_slot_t* slot)
+{
+    if(ring->in_flight + ring->to_submit == ring->entries)
+    {
+        return false;
+    }
+    unsigned tail = *ring->sq_tail;
+    unsigned index = tail & *ring->sq_mask;
+    struct io_uring_sqe* sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    sqe->opcode = IORING_OP_STATX;
+    sqe->fd = dir_fd;
+    sqe->addr = (uintptr_t) name;
+    sqe->len = stat_mask;
+    sqe->off = (uintptr_t) &slot->stx;
+    sqe->statx_flags = follow_symbolic ? 0 : AT_SYMLINK_NOFOLLOW;
+    sqe->user_data = (uintptr_t) slot;
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    slot->submitted = true;
+    slot->done = false;
+    ring->to_submit++;
+    return true;
+}
+
+/*
+    Passes queued requests to the kernel and, if wait is set, waits for at
+    least one completion. Then marks the slots of all completions as done.
+*/
+void stat_ring_enter(stat_ring_t* ring, bool wait)
+{
+    if(ring->to_submit > 0 || wait)
+    {
+        unsigned flags = wait ? IORING_ENTER_GETEVENTS : 0;
+        int submitted = syscall(SYS_io_uring_enter, ring->fd, ring->to_submit, wait ? 1 : 0, flags, NULL, 0);
+        if(submitted < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+        {
+            printf("find: io_uring_enter failed\n");
+            exit(1);
+        }
+        if(submitted > 0)
+        {
+            ring->to_submit -= submitted;
+            ring->in_flight += submitted;
+        }
+    }
+
+    unsigned head = *ring->cq_head;
+    unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    for(; head != tail; head++)
+    {
+        struct io_uring_cqe* cqe = &ring->cqes[head & *ring->cq_mask];
+        stat_slot_t* slot = (stat_slot_t*) (uintptr_t) cqe->user_data;
+        slot->result = cqe->res;
+        slot->done = true;
+        ring->in_flight--;
+    }
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+}
+
+/*
+    Waits until the statx of slot has completed.
+*/
+void stat_ring_wait(stat_ring_t* ring, stat_slot_t* slot)
+{
+    while(!slot->done)
+    {
+        stat_ring_enter(ring, true);
+    }
+}
+
+#endif
+
+#ifdef USE_STATX
+/*
+    Fills statbuffer from the result of a statx call.
+*/
+void statx_to_stat(const struct statx* stx, struct stat* statbuffer)
+{
+    memset(statbuffer, 0, sizeof(struct stat));
+    statbuffer->st_dev = makedev(stx->stx_dev_major, stx->stx_dev_minor);
+    statbuffer->st_ino = stx->stx_ino;
+    statbuffer->st_mode = stx->stx_mode;
+    statbuffer->st_nlink = stx->stx_nlink;
+    statbuffer->st_uid = stx->stx_uid;
+    statbuffer->st_gid = stx->stx_gid;
+    statbuffer->st_rdev = makedev(stx->stx_rdev_major, stx->stx_rdev_minor);
+    statbuffer->st_size = stx->stx_size;
+    statbuffer->st_blksize = stx->stx_blksize;
+    statbuffer->st_blocks = stx->stx_blocks;
+    statbuffer->st_atim.tv_sec = stx->stx_atime.tv_sec;
+    statbuffer->st_atim.tv_nsec = stx->stx_atime.tv_nsec;
+    statbuffer->st_mtim.tv_sec = stx->stx_mtime.tv_sec;
+    statbuffer->st_mtim.tv_nsec = stx->stx_mtime.tv_nsec;
+    statbuffer->st_ctim.tv_sec = stx->stx_ctime.tv_sec;
+    statbuffer->st_ctim.tv_nsec = stx->stx_ctime.tv_nsec;
+}
+#endif
+
+/*
+    Works like fstatat with or without AT_SYMLINK_NOFOLLOW depending on value
+    of follow_symbolic, name is relative to dir_fd. Returns true if able to
+    get stat info false otherwise.
+*/
+bool get_stat_info_at(int dir_fd, const char* name, struct stat* statbuffer)
+{
+    int flags = follow_symbolic ? 0 : AT_SYMLINK_NOFOLLOW;
+    uint64_t start = stats_now();
+    bool found = fstatat(dir_fd, name, statbuffer, flags) != -1;
+    if(collect_stats)
+    {
+        stats_record(&thread_stats.stats, thread_stats.stat_histogram, start);
+    }
+    return found;
+}
+
+/*
+    Works like get_stat_info_at, but only asks for the fields in stat_mask.
+*/
+bool get_stat_fields_at(int dir_fd, const char* name, struct stat* statbuffer)
+{
+#ifdef USE_STATX
+    if(!statx_unavailable)
+    {
+        int flags = follow_symbolic ? 0 : AT_SYMLINK_NOFOLLOW;
+        struct statx stx;
+        uint64_t start = stats_now();
+        int result = statx(dir_fd, name, flags, stat_mask, &stx);
+        if(collect_stats)
+        {
+            stats_record(&thread_stats.stats, thread_stats.stat_histogram, start);
+        }
+        if(result == 0)
+        {
+            statx_to_stat(&stx, statbuffer);
+            return true;
+        }
+        if(errno != ENOSYS)
+        {
+            return false;
+        }
+        statx_unavailable = true;
+    }
+#endif
+    return get_stat_info_at(dir_fd, name, statbuffer);
+}
+
+/*
+    Works like stat or lstat depending on value of follow_symbolic
+    returns true if able to get stat info false otherwise.
+*/
+bool get_stat_info(const char* path,  struct stat* statbuffer)
+{
+    return get_stat_info_at(AT_FDCWD, path, statbuffer);
+}
+
+/*
+    Makes sure file->statbuffer holds the stat info of the file, calling
+    stat only the first time. With -L a dangling symlink is described by
+    lstat instead, as find does. Returns false if neither succeeds.
+    With -uring the stat may already have been submitted by walk_dir.
+*/
+bool ensure_stat(file_data_t* file)
+{
+    if(file->have_stat)
+    {
+        return true;
+    }
+    thread_stats.files_stated += collect_stats;
+#ifdef USE_IO_URING
+    // Use the result of a statx submitted by walk_dir if it succeeded,
+    // errors are left to the synchronous path below.
+    stat_slot_t* slot = file->stat_slot;
+    if(slot != NULL && slot->submitted)
+    {
+        stat_ring_wait(stat_ring, slot);
+        if(slot->result == 0)
+        {
+            statx_to_stat(&slot->stx, &file->statbuffer);
+            file->have_stat = true;
+            thread_stats.uring_stats += collect_stats;
+            return true;
+        }
+    }
+#endif
+    int dir_fd = file->parent_fd;
+    const char* name = dir_fd == AT_FDCWD ? file_path(file) : file->file_name;
+
+    file->have_stat = get_stat_fields_at(dir_fd, name, &file->statbuffer);
+    if(!file->have_stat && follow_symbolic)
+    {
+        file->have_stat = fstatat(dir_fd, name, &file->statbuffer, AT_SYMLINK_NOFOLLOW) != -1;
+    }
+    if(!file->have_stat)
+    {
+        memset(&file->statbuffer, 0, sizeof(struct stat));
+    }
+    return file->have_stat;
+}
+
+/*
+    Returns the S_IFMT bits of the file's mode. The type in the directory
+    entry is used when it is known, so no stat is needed. With -L symlinks
+    still have to be resolved by stat.
+*/
+mode_t file_type(file_data_t* file)
+{
+    if(!file->have_stat && !(file->d_type == DT_LNK && follow_symbolic))
+    {
+        switch(file->d_type)
+        {
+            case DT_REG: return S_IFREG;
+            case DT_DIR: return S_IFDIR;
+            case DT_LNK: return S_IFLNK;
+            case DT_BLK: return S_IFBLK;
+            case DT_CHR: return S_IFCHR;
+            case DT_FIFO: return S_IFIFO;
+            case DT_SOCK: return S_IFSOCK;
+            default: break;
+        }
+    }
+    ensure_stat(file);
+    return file->statbuffer.st_mode & S_IFMT;
+}
+
+/*
+    Returns the length of the path of file as it is printed. Paths of
+    directories end in a slash that is not printed, except for start
+    points which are printed as the user gave them.
+*/
+size_t printed_length(file_data_t* file)
+{
+    const char* path = file_path(file);
+    size_t length = strlen(path);
+    if(!file->is_base_dir && length > 1 && path[length - 1] == '/')
+    {
+        length--;
+    }
+    return length;
+}
+
+/*
+    Prints the path of file followed by terminator, a newline for -print
+    and a null character for -print0.
+*/
+void print_match(file_data_t* file, char terminator)
+{
+    out_write(file_path(file), printed_length(file));
+    out_write(&terminator, 1);
+}
+
+/*
+    Returns the path of file as print_match prints it, in a new char* the
+    caller must deallocate. This is what -exec passes for {}.
+*/
+char* printed_path(file_data_t* file)
+{
+    char* path = strndup(file_path(file), printed_length(file));
+    if(path == NULL)
+    {
+        printf("find: insufficient memory\n");
+        exit(1);
+    }
+    return path;
+}
+
+/*
+    The shapes of -name patterns that are matched without fnmatch. Most
+    patterns are an exact name or literal text around a single '*'.
+*/
+typedef enum
+{
+    MATCH_ANY,          // *
+    MATCH_EXACT,        // core
+    MATCH_PREFIX,       // core.*
+    MATCH_SUFFIX,       // *.log
+    MATCH_PREFIX_SUFFIX,// prefix*suffix
+    MATCH_CONTAINS,     // *tmp*
+    MATCH_DFA,          // any other pattern made of *, ? and [...]
+    MATCH_FNMATCH       // patterns the compiler does not handle
+} match_kind_t;
+
+/*
+    A -name or -iname pattern compiled by compile_name_pattern. It is
+    read only once compiled, so all worker threads share it.
+*/
+typedef struct name_matcher
+{
+    match_kind_t kind;
+    const char* pattern;
+    // For -iname, letters match regardless of case.
+    bool fold_case;
+    // For the literal kinds, the text before and after the '*'. With
+    // fold_case both are in lower case.
+    char* prefix;
+    size_t prefix_len;
+    char* suffix;
+    size_t suffix_len;
+    // For MATCH_DFA, the byte classes, the transition table of
+    // num_states * num_classes entries and the first pattern each state
+    // accepts or -1. Entries of next_state are the row of the next state,
+    // so its index times num_classes, or one of the DFA_ values below.
+    unsigned char byte_class[256];
+    int num_classes;
+    int num_states;
+    int* next_state;
+    int* accept_pattern;
+} name_matcher_t;
+
+// Patterns whose transition table would be larger than this use fnmatch.
+const long MAX_DFA_CELLS = 1 << 22;
+// The name can no longer match, whatever follows.
+const int DFA_REJECT = -1;
+// The name matches, whatever follows. The first pattern matched is
+// subtracted from it.
+const int DFA_MATCH = -2;
+
+/*
+    One element of a glob, either a '*' or a set of bytes matched by a
+    literal, a '?' or a [...] expression.
+*/
+typedef struct
+{
+    bool is_star;
+    bool is_literal;
+    unsigned char literal;
+    // One bit per byte value.
+    uint64_t set[4];
+} glob_token_t;
+
+/*
+    Lowers an ASCII letter, the same as tolower in the C locale that
+    fnmatch is running in. Written without branches so loops over names
+    are vectorized.
+*/
+static inline unsigned char fold_ascii(unsigned char c)
+{
+    return c + (((unsigned char) (c - 'A') < 26) << 5);
+}
+
+/*
+    Returns true if the n bytes of text equal literal, which is in lower
+    case, ignoring the case of text.
+*/
+bool equal_folded(const char* text, const char* literal, size_t n)
+{
+    unsigned char diff = 0;
+    for(size_t i = 0; i < n; i++)
+    {
+        diff |= fold_ascii(text[i]) ^ (unsigned char) literal[i];
+    }
+    return diff == 0;
+}
+
+/*
+    Returns true if the n bytes of text equal literal, see fold_case.
+*/
+bool equal_literal(const name_matcher_t* matcher, const char* text, const char* literal, size_t n)
+{
+    if(matcher->fold_case)
+    {
+        return equal_folded(text, literal, n);
+    }
+    return memcmp(text, literal, n) == 0;
+}
+
+void set_add(uint64_t* set, unsigned char c)
+{
+    set[c >> 6] |= (uint64_t) 1 << (c & 63);
+}
+
+bool set_has(const uint64_t* set, unsigned char c)
+{
+    return (set[c >> 6] >> (c & 63)) & 1;
+}
+
+/*
+    Adds the bytes of the character class name, such as alpha in [:alpha:],
+    to set. Returns false if there is no such class.
+*/
+bool add_char_class(uint64_t* set, const char* name, size_t len)
+{
+    static const char* names[] = { "alnum", "alpha", "blank", "cntrl", "digit", "graph",
+                                   "lower", "print", "punct", "space", "upper", "xdigit" };
+    static int (*const tests[])(int) = { isalnum, isalpha, isblank, iscntrl, isdigit, isgraph,
+                                         islower, isprint, ispunct, isspace, isupper, isxdigit };
+    for(size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++)
+    {
+        if(strlen(names[i]) == len && strncmp(names[i], name, len) == 0)
+        {
+            for(int c = 0; c < 256; c++)
+            {
+                if(tests[i](c))
+                {
+                    set_add(set, c);
+                }
+            }
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+    Parses the [...] expression starting at pattern[*index] into the set
+    of token and moves *index past it. Returns false for the expressions
+    left to fnmatch, such as [=a=], [.a.] or a missing ']'.
+*/
+bool parse_bracket(const char* pattern, size_t* index, bool fold_case, glob_token_t* token)
+{
+    size_t i = *index + 1;
+    bool negated = pattern[i] == '!' || pattern[i] == '^';
+    if(negated)
+    {
+        i++;
+    }
+
+    // Character classes test the byte as it is, the other members of the
+    // set are compared to its lower case like fnmatch does.
+    uint64_t members[4] = { 0, 0, 0, 0 };
+    uint64_t classes[4] = { 0, 0, 0, 0 };
+    bool first = true;
+    while(pattern[i] != ']' || first)
+    {
+        first = false;
+        if(pattern[i] == '\0')
+        {
+            return false;
+        }
+        if(pattern[i] == '[' && (pattern[i+1] == '=' || pattern[i+1] == '.'))
+        {
+            return false;
+        }
+        if(pattern[i] == '[' && pattern[i+1] == ':')
+        {
+            const char* end = strstr(pattern + i + 2, ":]");
+            if(end == NULL || !add_char_class(classes, pattern + i + 2, end - (pattern + i + 2)))
+            {
+                return false;
+            }
+            i = end - pattern + 2;
+            continue;
+        }
+
+        if(pattern[i] == '\\')
+        {
+            i++;
+            if(pattern[i] == '\0')
+            {
+                return false;
+            }
+        }
+        unsigned char low = pattern[i++];
+        unsigned char high = low;
+        if(pattern[i] == '-' && pattern[i+1] != ']' && pattern[i+1] != '\0')
+        {
+            i++;
+            if(pattern[i] == '\\' || pattern[i] == '[')
+            {
+                return false;
+            }
+            high = pattern[i++];
+            if(high < low)
+            {
+                return false;
+            }
+        }
+        for(int c = low; c <= high; c++)
+        {
+            set_add(members, fold_case ? fold_ascii(c) : c);
+        }
+    }
+    *index = i + 1;
+
+    for(int c = 0; c < 256; c++)
+    {
+        bool member = set_has(classes, c) || set_has(members, fold_case ? fold_ascii(c) : c);
+        if(member != negated)
+        {
+            set_add(token->set, c);
+        }
+    }
+    return true;
+}
+
+/*
+    Splits pattern into tokens, returns the number of tokens or -1 if the
+    pattern has to be left to fnmatch. Runs of '*' become a single star.
+*/
+int tokenize_glob(const char* pattern, bool fold_case, glob_token_t* tokens)
+{
+    int count = 0;
+    size_t i = 0;
+    while(pattern[i] != '\0')
+    {
+        glob_token_t* token = &tokens[count];
+        memset(token, 0, sizeof(glob_token_t));
+        if(pattern[i] == '*')
+        {
+            i++;
+            if(count > 0 && tokens[count - 1].is_star)
+            {
+                continue;
+            }
+            token->is_star = true;
+        }
+        else if(pattern[i] == '?')
+        {
+            i++;
+            memset(token->set, 0xff, sizeof(token->set));
+        }
+        else if(pattern[i] == '[')
+        {
+            if(!parse_bracket(pattern, &i, fold_case, token))
+            {
+                return -1;
+            }
+        }
+        else
+        {
+            if(pattern[i] == '\\')
+            {
+                i++;
+                if(pattern[i] == '\0')
+                {
+                    return -1;
+                }
+            }
+            unsigned char c = pattern[i++];
+            token->is_literal = true;
+            token->literal = fold_case ? fold_ascii(c) : c;
+            for(int other = 0; other < 256; other++)
+            {
+                if((fold_case ? fold_ascii(other) : other) == token->literal)
+                {
+                    set_add(token->set, other);
+                }
+            }
+        }
+        count++;
+    }
+    return count;
+}
+
+/*
+    Returns the literal text of tokens first to last (exclusive) in a new
+    char* the caller must deallocate.
+*/
+char* tokens_to_literal(const glob_token_t* tokens, int first, int last)
+{
+    char* literal = (char*) checked_alloc(last - first + 1, sizeof(char));
+    for(int i = first; i < last; i++)
+    {
+        literal[i - first] = tokens[i].literal;
+    }
+    return literal;
+}
+
+/*
+    A node of the trie the DFA is built from. Patterns that start with
+    the same tokens share the nodes of those tokens, the same way
+    Aho-Corasick shares the prefixes of its keywords.
+*/
+typedef struct
+{
+    // The token on the edge from the parent, unused for the root.
+    glob_token_t token;
+    int* children;
+    int num_children;
+    int children_cap;
+    // The first pattern that ends here, or -1.
+    int pattern;
+} glob_trie_node_t;
+
+/*
+    The patterns of a -name, -iname or -name-from as one trie, node 0 is
+    the root.
+*/
+typedef struct
+{
+    glob_trie_node_t* nodes;
+    int num_nodes;
+    int cap;
+} glob_trie_t;
+
+/*
+    Adds a node reached by token to the trie and returns its index.
+*/
+int add_trie_node(glob_trie_t* trie, const glob_token_t* token)
+{
+    if(trie->num_nodes == trie->cap)
+    {
+        trie->cap = trie->cap == 0 ? 64 : trie->cap * 2;
+        trie->nodes = (glob_trie_node_t*) checked_realloc(trie->nodes, trie->cap * sizeof(glob_trie_node_t));
+    }
+    glob_trie_node_t* node = &trie->nodes[trie->num_nodes];
+    memset(node, 0, sizeof(glob_trie_node_t));
+    if(token != NULL)
+    {
+        node->token = *token;
+    }
+    node->pattern = -1;
+    return trie->num_nodes++;
+}
+
+/*
+    Adds the tokens of pattern number index to the trie. Patterns have to
+    be added in order, so the first pattern that ends in a node stays.
+*/
+void add_trie_pattern(glob_trie_t* trie, const glob_token_t* tokens, int num_tokens, int index)
+{
+    if(trie->num_nodes == 0)
+    {
+        add_trie_node(trie, NULL);
+    }
+
+    int node = 0;
+    for(int i = 0; i < num_tokens; i++)
+    {
+        int next = -1;
+        for(int c = 0; c < trie->nodes[node].num_children && next < 0; c++)
+        {
+            glob_token_t* edge = &trie->nodes[trie->nodes[node].children[c]].token;
+            if(edge->is_star == tokens[i].is_star && memcmp(edge->set, tokens[i].set, sizeof(edge->set)) == 0)
+            {
+                next = trie->nodes[node].children[c];
+            }
+        }
+        if(next < 0)
+        {
+            next = add_trie_node(trie, &tokens[i]);
+            glob_trie_node_t* parent = &trie->nodes[node];
+            if(parent->num_children == parent->children_cap)
+            {
+                parent->children_cap = parent->children_cap == 0 ? 2 : parent->children_cap * 2;
+                parent->children = (int*) checked_realloc(parent->children, parent->children_cap * sizeof(int));
+            }
+            parent->children[parent->num_children++] = next;
+        }
+        node = next;
+    }
+    if(trie->nodes[node].pattern < 0)
+    {
+        trie->nodes[node].pattern = index;
+    }
+}
+
+void free_trie(glob_trie_t* trie)
+{
+    for(int i = 0; i < trie->num_nodes; i++)
+    {
+        free(trie->nodes[i].children);
+    }
+    free(trie->nodes);
+}
+
+/*
+    Adds node and the nodes reachable from it without reading a byte,
+    which are the stars below it, to the set of nodes that are marked.
+*/
+void add_closure(const glob_trie_t* trie, int node, bool* marked, int* set, int* set_len)
+{
+    if(marked[node])
+    {
+        return;
+    }
+    marked[node] = true;
+    set[(*set_len)++] = node;
+    for(int c = 0; c < trie->nodes[node].num_children; c++)
+    {
+        int child = trie->nodes[node].children[c];
+        if(trie->nodes[child].token.is_star)
+        {
+            add_closure(trie, child, marked, set, set_len);
+        }
+    }
+}
+
+int compare_ints(const void* a, const void* b)
+{
+    return *(const int*) a - *(const int*) b;
+}
+
+/*
+    Turns the nodes collected by add_closure into the sorted set of a DFA
+    state and clears their marks.
+*/
+void finish_node_set(bool* marked, int* set, int set_len)
+{
+    for(int i = 0; i < set_len; i++)
+    {
+        marked[set[i]] = false;
+    }
+    qsort(set, set_len, sizeof(int), compare_ints);
+}
+
+/*
+    Returns the DFA_ value for the set of trie nodes if the name can no
+    longer match or already matched, otherwise 0. A pattern has matched
+    once its trailing star was reached, whatever follows. Of the patterns
+    that matched the first one in the file is reported.
+*/
+int settled_result(const glob_trie_t* trie, const int* set, int set_len)
+{
+    if(set_len == 0)
+    {
+        return DFA_REJECT;
+    }
+    int star_match = INT32_MAX;
+    for(int i = 0; i < set_len; i++)
+    {
+        const glob_trie_node_t* node = &trie->nodes[set[i]];
+        if(node->token.is_star && node->pattern >= 0 && node->pattern < star_match)
+        {
+            star_match = node->pattern;
+        }
+    }
+    return star_match != INT32_MAX ? DFA_MATCH - star_match : 0;
+}
+
+/*
+    The sets of trie nodes that became DFA states while building the DFA.
+    The sets are stored sorted in one pool and found again through an
+    open addressing hash table of their indexes.
+*/
+typedef struct
+{
+    const glob_trie_t* trie;
+    name_matcher_t* matcher;
+    int* state_start;
+    int states_cap;
+    int* pool;
+    int pool_cap;
+    int* table;
+    int table_cap;
+    // For each state 0, DFA_REJECT or DFA_MATCH minus the pattern.
+    int* settled;
+} dfa_builder_t;
+
+uint32_t hash_node_set(const int* set, int set_len)
+{
+    uint32_t hash = 2166136261u;
+    for(int i = 0; i < set_len; i++)
+    {
+        hash = (hash ^ set[i]) * 16777619u;
+    }
+    return hash;
+}
+
+/*
+    Puts state into the first free slot of the hash table for its set.
+*/
+void insert_dfa_state(dfa_builder_t* builder, int state)
+{
+    const int* set = builder->pool + builder->state_start[state];
+    int set_len = builder->state_start[state + 1] - builder->state_start[state];
+    int slot = hash_node_set(set, set_len) & (builder->table_cap - 1);
+    while(builder->table[slot] >= 0)
+    {
+        slot = (slot + 1) & (builder->table_cap - 1);
+    }
+    builder->table[slot] = state;
+}
+
+/*
+    Returns the state of the sorted set of trie nodes, adding it if it is
+    new. Returns -1 if the transition table would grow past MAX_DFA_CELLS.
+*/
+int find_dfa_state(dfa_builder_t* builder, const int* set, int set_len)
+{
+    int slot = hash_node_set(set, set_len) & (builder->table_cap - 1);
+    while(builder->table[slot] >= 0)
+    {
+        int other = builder->table[slot];
+        int other_len = builder->state_start[other + 1] - builder->state_start[other];
+        if(other_len == set_len && memcmp(builder->pool + builder->state_start[other], set, set_len * sizeof(int)) == 0)
+        {
+            return other;
+        }
+        slot = (slot + 1) & (builder->table_cap - 1);
+    }
+
+    name_matcher_t* matcher = builder->matcher;
+    int state = matcher->num_states;
+    if((long) (state + 1) * matcher->num_classes > MAX_DFA_CELLS)
+    {
+        return -1;
+    }
+    if(state == builder->states_cap)
+    {
+        builder->states_cap *= 2;
+        builder->state_start = (int*) checked_realloc(builder->state_start, (builder->states_cap + 1) * sizeof(int));
+        builder->settled = (int*) checked_realloc(builder->settled, builder->states_cap * sizeof(int));
+        matcher->accept_pattern = (int*) checked_realloc(matcher->accept_pattern, builder->states_cap * sizeof(int));
+        matcher->next_state = (int*) checked_realloc(matcher->next_state,
+                                                     builder->states_cap * matcher->num_classes * sizeof(int));
+    }
+    int start = builder->state_start[state];
+    if(start + set_len > builder->pool_cap)
+    {
+        builder->pool_cap = 2 * (start + set_len);
+        builder->pool = (int*) checked_realloc(builder->pool, builder->pool_cap * sizeof(int));
+    }
+    memcpy(builder->pool + start, set, set_len * sizeof(int));
+    builder->state_start[state + 1] = start + set_len;
+
+    matcher->accept_pattern[state] = -1;
+    for(int i = 0; i < set_len; i++)
+    {
+        int pattern = builder->trie->nodes[set[i]].pattern;
+        if(pattern >= 0 && (matcher->accept_pattern[state] < 0 || pattern < matcher->accept_pattern[state]))
+        {
+            matcher->accept_pattern[state] = pattern;
+        }
+    }
+    builder->settled[state] = settled_result(builder->trie, set, set_len);
+    matcher->num_states++;
+
+    if(2 * matcher->num_states > builder->table_cap)
+    {
+        free(builder->table);
+        builder->table_cap *= 2;
+        builder->table = (int*) checked_alloc(builder->table_cap, sizeof(int));
+        memset(builder->table, -1, builder->table_cap * sizeof(int));
+        for(int other = 0; other < matcher->num_states; other++)
+        {
+            insert_dfa_state(builder, other);
+        }
+    }
+    else
+    {
+        insert_dfa_state(builder, state);
+    }
+    return state;
+}
+
+/*
+    Splits the bytes into classes, bytes that are in exactly the same
+    token sets share a class and a column of the transition table.
+    representative gets one byte of each class.
+*/
+void split_byte_classes(name_matcher_t* matcher, const glob_trie_t* trie, int* representative)
+{
+    memset(matcher->byte_class, 0, sizeof(matcher->byte_class));
+    matcher->num_classes = 1;
+    for(int i = 1; i < trie->num_nodes; i++)
+    {
+        if(trie->nodes[i].token.is_star)
+        {
+            continue;
+        }
+        int split[256][2];
+        memset(split, -1, sizeof(split));
+        int num_classes = 0;
+        for(int c = 0; c < 256; c++)
+        {
+            int* class = &split[matcher->byte_class[c]][set_has(trie->nodes[i].token.set, c)];
+            if(*class < 0)
+            {
+                *class = num_classes++;
+            }
+            matcher->byte_class[c] = *class;
+        }
+        matcher->num_classes = num_classes;
+    }
+    for(int c = 255; c >= 0; c--)
+    {
+        representative[matcher->byte_class[c]] = c;
+    }
+}
+
+/*
+    Builds the DFA of the patterns in trie by the subset construction,
+    its states are sets of trie nodes. A name is matched by the pattern
+    that matches first while reading it, or if several match at the same
+    byte by the one first in the file. Returns false if the transition
+    table would have more than MAX_DFA_CELLS entries.
+*/
+bool build_glob_dfa(name_matcher_t* matcher, glob_trie_t* trie)
+{
+    int representative[256];
+    split_byte_classes(matcher, trie, representative);
+    int num_classes = matcher->num_classes;
+
+    dfa_builder_t builder = { .trie = trie, .matcher = matcher, .states_cap = 64, .pool_cap = 1024, .table_cap = 128 };
+    builder.state_start = (int*) checked_alloc(builder.states_cap + 1, sizeof(int));
+    builder.settled = (int*) checked_alloc(builder.states_cap, sizeof(int));
+    builder.pool = (int*) checked_alloc(builder.pool_cap, sizeof(int));
+    builder.table = (int*) checked_alloc(builder.table_cap, sizeof(int));
+    memset(builder.table, -1, builder.table_cap * sizeof(int));
+    matcher->accept_pattern = (int*) checked_alloc(builder.states_cap, sizeof(int));
+    matcher->next_state = (int*) checked_alloc(builder.states_cap * num_classes, sizeof(int));
+    matcher->num_states = 0;
+
+    bool* marked = (bool*) checked_alloc(trie->num_nodes, sizeof(bool));
+    int* set = (int*) checked_alloc(trie->num_nodes, sizeof(int));
+    int set_len = 0;
+    add_closure(trie, 0, marked, set, &set_len);
+    finish_node_set(marked, set, set_len);
+    bool fits = find_dfa_state(&builder, set, set_len) == 0;
+
+    // New states are added at the end, so the loop reaches all of them.
+    for(int state = 0; fits && state < matcher->num_states; state++)
+    {
+        // The match never goes on from a settled state, except from the
+        // initial one, which is entered without a transition.
+        if(builder.settled[state] != 0 && state != 0)
+        {
+            continue;
+        }
+        for(int class = 0; fits && class < num_classes; class++)
+        {
+            set_len = 0;
+            for(int i = builder.state_start[state]; i < builder.state_start[state + 1]; i++)
+            {
+                const glob_trie_node_t* node = &trie->nodes[builder.pool[i]];
+                // A star matches any byte and stays.
+                if(node->token.is_star)
+                {
+                    add_closure(trie, builder.pool[i], marked, set, &set_len);
+                }
+                for(int c = 0; c < node->num_children; c++)
+                {
+                    const glob_trie_node_t* child = &trie->nodes[node->children[c]];
+                    if(!child->token.is_star && set_has(child->token.set, representative[class]))
+                    {
+                        add_closure(trie, node->children[c], marked, set, &set_len);
+                    }
+                }
+            }
+            finish_node_set(marked, set, set_len);
+            int target = find_dfa_state(&builder, set, set_len);
+            fits = target >= 0;
+            matcher->next_state[state * num_classes + class] = target;
+        }
+    }
+
+    // Settled states end the match right away, the others become rows.
+    for(int i = 0; fits && i < matcher->num_states * num_classes; i++)
+    {
+        if(builder.settled[i / num_classes] != 0 && i >= num_classes)
+        {
+            continue;
+        }
+        int target = matcher->next_state[i];
+        matcher->next_state[i] = builder.settled[target] != 0 ? builder.settled[target] : target * num_classes;
+    }
+    free(marked);
+    free(set);
+    free(builder.state_start);
+    free(builder.settled);
+    free(builder.pool);
+    free(builder.table);
+    return fits;
+}
+
+/*
+    Compiles the pattern of -name, or of -iname if fold_case is set, once
+    so matching a name does not have to interpret it again. Patterns that
+    are literal text around at most two stars are compared directly, the
+    rest run through a DFA. Anything else is passed on to fnmatch.
+*/
+name_matcher_t* compile_name_pattern(const char* pattern, bool fold_case)
+{
+    name_matcher_t* matcher = (name_matcher_t*) checked_alloc(1, sizeof(name_matcher_t));
+    matcher->pattern = pattern;
+    matcher->fold_case = fold_case;
+
+    glob_token_t* tokens = (glob_token_t*) checked_alloc(strlen(pattern) + 1, sizeof(glob_token_t));
+    int num_tokens = tokenize_glob(pattern, fold_case, tokens);
+    if(num_tokens < 0)
+    {
+        matcher->kind = MATCH_FNMATCH;
+        free(tokens);
+        return matcher;
+    }
+
+    int num_stars = 0;
+    int first_star = -1;
+    int last_star = -1;
+    bool all_literal = true;
+    for(int i = 0; i < num_tokens; i++)
+    {
+        if(tokens[i].is_star)
+        {
+            num_stars++;
+            last_star = i;
+            if(first_star < 0)
+            {
+                first_star = i;
+            }
+        }
+        else
+        {
+            all_literal = all_literal && tokens[i].is_literal;
+        }
+    }
+
+    if(all_literal && num_stars == 0)
+    {
+        matcher->kind = MATCH_EXACT;
+        matcher->prefix = tokens_to_literal(tokens, 0, num_tokens);
+        matcher->prefix_len = num_tokens;
+    }
+    else if(all_literal && num_stars == 1)
+    {
+        matcher->kind = num_tokens == 1 ? MATCH_ANY
+                      : first_star == num_tokens - 1 ? MATCH_PREFIX
+                      : first_star == 0 ? MATCH_SUFFIX
+                      : MATCH_PREFIX_SUFFIX;
+        matcher->prefix = tokens_to_literal(tokens, 0, first_star);
+        matcher->prefix_len = first_star;
+        matcher->suffix = tokens_to_literal(tokens, first_star + 1, num_tokens);
+        matcher->suffix_len = num_tokens - first_star - 1;
+    }
+    // strstr can not ignore case, -iname uses the DFA for these.
+    else if(all_literal && num_stars == 2 && first_star == 0 && last_star == num_tokens - 1 && !fold_case)
+    {
+        matcher->kind = MATCH_CONTAINS;
+        matcher->prefix = tokens_to_literal(tokens, 1, num_tokens - 1);
+        matcher->prefix_len = num_tokens - 2;
+    }
+    else
+    {
+        glob_trie_t trie = { NULL, 0, 0 };
+        add_trie_pattern(&trie, tokens, num_tokens, 0);
+        matcher->kind = build_glob_dfa(matcher, &trie) ? MATCH_DFA : MATCH_FNMATCH;
+        free_trie(&trie);
+    }
+    free(tokens);
+    return matcher;
+}
+
+/*
+    Frees a matcher returned by compile_name_pattern.
+*/
+void free_name_matcher(name_matcher_t* matcher)
+{
+    if(matcher != NULL)
+    {
+        free(matcher->prefix);
+        free(matcher->suffix);
+        free(matcher->next_state);
+        free(matcher->accept_pattern);
+        free(matcher);
+    }
+}
+
+/*
+    Runs file_name through the DFA of matcher. Returns the first pattern
+    it matches, or -1.
+*/
+int run_dfa(const name_matcher_t* matcher, const char* file_name)
+{
+    int row = 0;
+    for(const unsigned char* c = (const unsigned char*) file_name; *c != '\0'; c++)
+    {
+        row = matcher->next_state[row + matcher->byte_class[*c]];
+        if(row < 0)
+        {
+            return row == DFA_REJECT ? -1 : DFA_MATCH - row;
+        }
+    }
+    return matcher->accept_pattern[row / matcher->num_classes];
+}
+
+/*
+    Returns true if the file_name matches the compiled pattern of -name
+    or -iname.
+*/
+bool handle_name(const name_matcher_t* matcher, const char* file_name)
+{
+    switch(matcher->kind)
+    {
+        case MATCH_ANY:
+            return true;
+        case MATCH_EXACT:
+            return strlen(file_name) == matcher->prefix_len
+                && equal_literal(matcher, file_name, matcher->prefix, matcher->prefix_len);
+        case MATCH_PREFIX:
+            return strnlen(file_name, matcher->prefix_len) == matcher->prefix_len
+                && equal_literal(matcher, file_name, matcher->prefix, matcher->prefix_len);
+        case MATCH_SUFFIX:
+        case MATCH_PREFIX_SUFFIX:
+        {
+            size_t length = strlen(file_name);
+            return length >= matcher->prefix_len + matcher->suffix_len
+                && equal_literal(matcher, file_name, matcher->prefix, matcher->prefix_len)
+                && equal_literal(matcher, file_name + length - matcher->suffix_len,
+                                 matcher->suffix, matcher->suffix_len);
+        }
+        case MATCH_CONTAINS:
+            return strstr(file_name, matcher->prefix) != NULL;
+        case MATCH_DFA:
+            return run_dfa(matcher, file_name) >= 0;
+        case MATCH_FNMATCH:
+            break;
+    }
+    return fnmatch(matcher->pattern, file_name, matcher->fold_case ? FNM_CASEFOLD : 0) == 0;
+}
+
+/*
+    The patterns of -name-from FILE. The patterns the compiler handles
+    share one DFA, so a name is read once however many patterns there
+    are. The others are matched one at a time.
+*/
+typedef struct name_set
+{
+    char** patterns;
+    int num_patterns;
+    // NULL if none of the patterns could go into a DFA.
+    name_matcher_t* dfa;
+    // The patterns left out of the DFA, in order, and their indexes.
+    name_matcher_t** others;
+    int* other_patterns;
+    int num_others;
+} name_set_t;
+
+/*
+    Reads the patterns of -name-from from path, one per line, and compiles
+    them. Empty lines are skipped, no name can match them.
+*/
+name_set_t* load_name_set(const char* path)
+{
+    FILE* file = fopen(path, "r");
+    if(file == NULL)
+    {
+        printf("find: ‘%s’: %s\n", path, strerror(errno));
+        exit(1);
+    }
+
+    name_set_t* set = (name_set_t*) checked_alloc(1, sizeof(name_set_t));
+    int patterns_cap = 0;
+    char* line = NULL;
+    size_t line_cap = 0;
+    ssize_t length;
+    while((length = getline(&line, &line_cap, file)) > 0)
+    {
+        if(line[length - 1] == '\n')
+        {
+            line[--length] = '\0';
+        }
+        if(length == 0)
+        {
+            continue;
+        }
+        if(set->num_patterns == patterns_cap)
+        {
+            patterns_cap = patterns_cap == 0 ? 16 : patterns_cap * 2;
+            set->patterns = (char**) checked_realloc(set->patterns, patterns_cap * sizeof(char*));
+        }
+        set->patterns[set->num_patterns] = strdup(line);
+        if(set->patterns[set->num_patterns] == NULL)
+        {
+            printf("find: insufficient memory\n");
+            exit(1);
+        }
+        set->num_patterns++;
+    }
+    free(line);
+    fclose(file);
+
+    set->others = (name_matcher_t**) checked_alloc(set->num_patterns + 1, sizeof(name_matcher_t*));
+    set->other_patterns = (int*) checked_alloc(set->num_patterns + 1, sizeof(int));
+    glob_trie_t trie = { NULL, 0, 0 };
+    for(int i = 0; i < set->num_patterns; i++)
+    {
+        glob_token_t* tokens = (glob_token_t*) checked_alloc(strlen(set->patterns[i]) + 1, sizeof(glob_token_t));
+        int num_tokens = tokenize_glob(set->patterns[i], false, tokens);
+        if(num_tokens >= 0)
+        {
+            add_trie_pattern(&trie, tokens, num_tokens, i);
+        }
+        else
+        {
+            set->other_patterns[set->num_others] = i;
+            set->others[set->num_others++] = compile_name_pattern(set->patterns[i], false);
+        }
+        free(tokens);
+    }
+
+    if(trie.num_nodes > 0)
+    {
+        set->dfa = (name_matcher_t*) checked_alloc(1, sizeof(name_matcher_t));
+        set->dfa->kind = MATCH_DFA;
+        if(!build_glob_dfa(set->dfa, &trie))
+        {
+            // Too many states, match every pattern on its own instead.
+            free_name_matcher(set->dfa);
+            set->dfa = NULL;
+            for(int i = 0; i < set->num_others; i++)
+            {
+                free_name_matcher(set->others[i]);
+            }
+            for(int i = 0; i < set->num_patterns; i++)
+            {
+                set->other_patterns[i] = i;
+                set->others[i] = compile_name_pattern(set->patterns[i], false);
+            }
+            set->num_others = set->num_patterns;
+        }
+    }
+    free_trie(&trie);
+    return set;
+}
+
+void free_name_set(name_set_t* set)
+{
+    if(set != NULL)
+    {
+        for(int i = 0; i < set->num_others; i++)
+        {
+            free_name_matcher(set->others[i]);
+        }
+        for(int i = 0; i < set->num_patterns; i++)
+        {
+            free(set->patterns[i]);
+        }
+        free_name_matcher(set->dfa);
+        free(set->others);
+        free(set->other_patterns);
+        free(set->patterns);
+        free(set);
+    }
+}
+
+/*
+    Returns the pattern of -name-from that file_name matched, or NULL if
+    it matches none of them. See build_glob_dfa for which pattern that is
+    if several match. The patterns left to fnmatch are only tried if
+    none of the others match.
+*/
+const char* handle_name_from(const name_set_t* set, const char* file_name)
+{
+    int found = set->dfa != NULL ? run_dfa(set->dfa, file_name) : -1;
+    for(int i = 0; i < set->num_others && found < 0; i++)
+    {
+        if(handle_name(set->others[i], file_name))
+        {
+            found = set->other_patterns[i];
+        }
+    }
+    return found >= 0 ? set->patterns[found] : NULL;
+}
+
+/*
+    The operators of -regex expressions. The parser builds a tree of
+    regex_term_t from the first ones, which compile_regex_term turns into
+    an NFA of regex_node_t made of the others.
+*/
+typedef enum
+{
+    REGEX_EMPTY,        // matches the empty string
+    REGEX_CONCAT,       // left then right
+    REGEX_ALTERNATE,    // left or right, \|
+    REGEX_STAR,         // left any number of times, *
+    REGEX_PLUS,         // left at least once, +
+    REGEX_OPTIONAL,     // left at most once, ?
+    REGEX_BYTES,        // one byte of set
+    REGEX_LINE_START,   // ^, at the start of the path or after a newline
+    REGEX_LINE_END,     // $, at the end of the path or before a newline
+    REGEX_SPLIT,        // goes on at both out and alt
+    REGEX_MATCH         // the whole expression matched
+} regex_op_t;
+
+typedef struct
+{
+    regex_op_t op;
+    int left;
+    int right;
+    uint64_t set[4];
+} regex_term_t;
+
+typedef struct
+{
+    regex_op_t op;
+    int out;
+    int alt;
+    // For REGEX_BYTES, one bit per byte value of the path.
+    uint64_t set[4];
+} regex_node_t;
+
+/*
+    A -regex or -iregex expression compiled by compile_path_regex into an
+    NFA. It is read only once compiled, the DFA states are built lazily by
+    each thread in a regex_cache_t of its own.
+*/
+typedef struct path_regex
+{
+    const char* pattern;
+    // Index of the cache of the expression in regex_caches.
+    int id;
+    regex_node_t* nodes;
+    int num_nodes;
+    int start;
+    // Set if there is a ^ or $, which look at the bytes around them. The
+    // newline then gets a byte class of its own.
+    bool has_anchors;
+    unsigned char byte_class[256];
+    // One byte of each class.
+    unsigned char class_byte[256];
+    int num_classes;
+    // For expressions the NFA can not express, such as back references,
+    // the expression compiled by the GNU regex library, otherwise NULL.
+    struct re_pattern_buffer* fallback;
+} path_regex_t;
+
+/*
+    The state of parsing an expression in the default syntax of GNU find,
+    that of Emacs, into regex_term_t.
+*/
+typedef struct
+{
+    const unsigned char* pattern;
+    size_t pos;
+    bool fold_case;
+    regex_term_t* terms;
+    int num_terms;
+    // Cleared when the expression uses something the NFA can not express.
+    bool supported;
+} regex_parser_t;
+
+// The number of -regex and -iregex expressions, each has a cache per thread.
+int num_path_regexes = 0;
+// A thread's DFA of one expression is flushed and built again from scratch
+// when its transitions and node sets would take more ints than this.
+const long REGEX_CACHE_CELLS = 1 << 20;
+// A transition of a regex_cache_t that was not built yet.
+const int REGEX_UNBUILT = -2;
+
+int add_regex_term(regex_parser_t* parser, regex_op_t op, int left, int right)
+{
+    regex_term_t* term = &parser->terms[parser->num_terms];
+    memset(term, 0, sizeof(regex_term_t));
+    term->op = op;
+    term->left = left;
+    term->right = right;
+    return parser->num_terms++;
+}
+
+/*
+    Returns the byte at offset from the current position of parser as the
+    GNU regex library reads it. -iregex reads the expression in upper case,
+    except for the byte after a backslash.
+*/
+unsigned char regex_byte(const regex_parser_t* parser, size_t offset)
+{
+    unsigned char c = parser->pattern[parser->pos + offset];
+    return parser->fold_case ? toupper(c) : c;
+}
+
+/*
+    Returns true if parser is at a backslash followed by op.
+*/
+bool at_regex_operator(const regex_parser_t* parser, char op)
+{
+    return parser->pattern[parser->pos] == '\\' && parser->pattern[parser->pos + 1] == op;
+}
+
+/*
+    Parses the [...] expression at the position of parser into set. In
+    this syntax a backslash is literal inside the brackets and there are
+    no character classes, [:alpha:] is a set of its bytes.
+*/
+void parse_regex_bracket(regex_parser_t* parser, uint64_t* set)
+{
+    parser->pos++;
+    bool negated = regex_byte(parser, 0) == '^';
+    if(negated)
+    {
+        parser->pos++;
+    }
+    bool first = true;
+    while(regex_byte(parser, 0) != ']' || first)
+    {
+        first = false;
+        unsigned char low = regex_byte(parser, 0);
+        if(low == '\0' || (low == '[' && (regex_byte(parser, 1) == '.' || regex_byte(parser, 1) == '=')))
+        {
+            parser->supported = false;
+            return;
+        }
+        unsigned char high = low;
+        parser->pos++;
+        if(regex_byte(parser, 0) == '-' && regex_byte(parser, 1) != ']')
+        {
+            high = regex_byte(parser, 1);
+            if(high == '[' && (regex_byte(parser, 2) == '.' || regex_byte(parser, 2) == '='))
+            {
+                parser->supported = false;
+                return;
+            }
+            parser->pos += 2;
+        }
+        for(int c = low; c <= high; c++)
+        {
+            set_add(set, c);
+        }
+    }
+    parser->pos++;
+    if(negated)
+    {
+        for(int i = 0; i < 4; i++)
+        {
+            set[i] = ~set[i];
+        }
+    }
+}
+
+int parse_regex_alternation(regex_parser_t* parser, int nest);
+
+/*
+    Parses one atom and the *, + and ? after it. ^ is an anchor only at the
+    start of a branch and $ only at the end of one, elsewhere they are
+    literal. A *, + or ? that has nothing before it to repeat, at the start
+    of a branch or after an anchor, is literal too.
+*/
+int parse_regex_piece(regex_parser_t* parser, int nest, bool branch_start)
+{
+    const unsigned char* pattern = parser->pattern;
+    size_t pos = parser->pos;
+    unsigned char c = regex_byte(parser, 0);
+    // Anchors are not repeated, a * after them is the next atom.
+    if(c == '^' && branch_start)
+    {
+        parser->pos++;
+        return add_regex_term(parser, REGEX_LINE_START, -1, -1);
+    }
+    if(c == '$' && (pattern[pos + 1] == '\0' || (pattern[pos + 1] == '\\' && (pattern[pos + 2] == '|' || pattern[pos + 2] == ')'))))
+    {
+        parser->pos++;
+        return add_regex_term(parser, REGEX_LINE_END, -1, -1);
+    }
+
+    int term;
+    if(at_regex_operator(parser, '('))
+    {
+        parser->pos += 2;
+        term = parse_regex_alternation(parser, nest + 1);
+        // Skip the \).
+        parser->pos += 2;
+    }
+    else
+    {
+        term = add_regex_term(parser, REGEX_BYTES, -1, -1);
+        uint64_t* set = parser->terms[term].set;
+        if(c == '\\')
+        {
+            unsigned char escaped = pattern[pos + 1];
+            parser->pos += 2;
+            if(escaped == '\0' || (escaped >= '1' && escaped <= '9') || strchr("<>bB`'", escaped) != NULL)
+            {
+                // Back references and the assertions about words.
+                parser->supported = false;
+            }
+            else if(escaped == 'w' || escaped == 'W' || escaped == 's' || escaped == 'S')
+            {
+                for(int b = 0; b < 256; b++)
+                {
+                    bool member = tolower(escaped) == 'w' ? isalnum(b) || b == '_' : isspace(b) != 0;
+                    if(member == (islower(escaped) != 0))
+                    {
+                        set_add(set, b);
+                    }
+                }
+            }
+            else
+            {
+                set_add(set, escaped);
+            }
+        }
+        else if(c == '.')
+        {
+            parser->pos++;
+            memset(set, 0xff, 4 * sizeof(uint64_t));
+            set[0] &= ~((uint64_t) 1 << '\n');
+        }
+        else if(c == '[')
+        {
+            parse_regex_bracket(parser, set);
+        }
+        else
+        {
+            // Also a *, + or ? with nothing to repeat.
+            parser->pos++;
+            set_add(set, c);
+        }
+    }
+
+    for(;;)
+    {
+        c = regex_byte(parser, 0);
+        regex_op_t op = c == '*' ? REGEX_STAR : c == '+' ? REGEX_PLUS : c == '?' ? REGEX_OPTIONAL : REGEX_EMPTY;
+        if(op == REGEX_EMPTY)
+        {
+            return term;
+        }
+        parser->pos++;
+        term = add_regex_term(parser, op, term, -1);
+    }
+}
+
+/*
+    Parses the atoms up to the next \|, or \) inside a group.
+*/
+int parse_regex_branch(regex_parser_t* parser, int nest)
+{
+    int branch = -1;
+    while(parser->supported && parser->pattern[parser->pos] != '\0' && !at_regex_operator(parser, '|')
+          && !(nest > 0 && at_regex_operator(parser, ')')))
+    {
+        int piece = parse_regex_piece(parser, nest, branch < 0);
+        branch = branch < 0 ? piece : add_regex_term(parser, REGEX_CONCAT, branch, piece);
+    }
+    return branch < 0 ? add_regex_term(parser, REGEX_EMPTY, -1, -1) : branch;
+}
+
+/*
+    Parses the branches up to the end of the expression, or the \) that
+    ends the group when nest is above 0.
+*/
+int parse_regex_alternation(regex_parser_t* parser, int nest)
+{
+    int alternation = parse_regex_branch(parser, nest);
+    while(parser->supported && at_regex_operator(parser, '|'))
+    {
+        parser->pos += 2;
+        int branch = parse_regex_branch(parser, nest);
+        alternation = add_regex_term(parser, REGEX_ALTERNATE, alternation, branch);
+    }
+    return alternation;
+}
+
+int add_regex_node(path_regex_t* regex, regex_op_t op, int out, int alt)
+{
+    regex_node_t* node = &regex->nodes[regex->num_nodes];
+    memset(node, 0, sizeof(regex_node_t));
+    node->op = op;
+    node->out = out;
+    node->alt = alt;
+    return regex->num_nodes++;
+}
+
+/*
+    Adds the NFA nodes of term, followed by the node next, and returns the
+    node the term starts at. The sets of -iregex take the bytes whose upper
+    case is in them, which is how the GNU regex library compares.
+*/
+int compile_regex_term(path_regex_t* regex, const regex_parser_t* parser, int term, int next, bool fold_case)
+{
+    const regex_term_t* t = &parser->terms[term];
+    switch(t->op)
+    {
+        case REGEX_CONCAT:
+            next = compile_regex_term(regex, parser, t->right, next, fold_case);
+            return compile_regex_term(regex, parser, t->left, next, fold_case);
+        case REGEX_ALTERNATE:
+        {
+            int left = compile_regex_term(regex, parser, t->left, next, fold_case);
+            int right = compile_regex_term(regex, parser, t->right, next, fold_case);
+            return add_regex_node(regex, REGEX_SPLIT, left, right);
+        }
+        case REGEX_STAR:
+        case REGEX_PLUS:
+        {
+            int split = add_regex_node(regex, REGEX_SPLIT, -1, next);
+            int body = compile_regex_term(regex, parser, t->left, split, fold_case);
+            regex->nodes[split].out = body;
+            return t->op == REGEX_STAR ? split : body;
+        }
+        case REGEX_OPTIONAL:
+        {
+            int body = compile_regex_term(regex, parser, t->left, next, fold_case);
+            return add_regex_node(regex, REGEX_SPLIT, body, next);
+        }
+        case REGEX_BYTES:
+        {
+            int node = add_regex_node(regex, REGEX_BYTES, next, -1);
+            for(int c = 0; c < 256; c++)
+            {
+                if(set_has(t->set, fold_case ? toupper(c) : c))
+                {
+                    set_add(regex->nodes[node].set, c);
+                }
+            }
+            return node;
+        }
+        case REGEX_LINE_START:
+        case REGEX_LINE_END:
+            regex->has_anchors = true;
+            return add_regex_node(regex, t->op, next, -1);
+        case REGEX_EMPTY:
+        default:
+            return next;
+    }
+}
+
+/*
+    Splits the bytes into classes the same way split_byte_classes does,
+    by the sets of the REGEX_BYTES nodes.
+*/
+void split_regex_classes(path_regex_t* regex)
+{
+    memset(regex->byte_class, 0, sizeof(regex->byte_class));
+    regex->num_classes = 1;
+    uint64_t newline[4] = { 0, 0, 0, 0 };
+    set_add(newline, '\n');
+    for(int i = 0; i <= regex->num_nodes; i++)
+    {
+        const uint64_t* set = newline;
+        if(i < regex->num_nodes)
+        {
+            if(regex->nodes[i].op != REGEX_BYTES)
+            {
+                continue;
+            }
+            set = regex->nodes[i].set;
+        }
+        else if(!regex->has_anchors)
+        {
+            continue;
+        }
+        int split[256][2];
+        memset(split, -1, sizeof(split));
+        int num_classes = 0;
+        for(int c = 0; c < 256; c++)
+        {
+            int* class = &split[regex->byte_class[c]][set_has(set, c)];
+            if(*class < 0)
+            {
+                *class = num_classes++;
+            }
+            regex->byte_class[c] = *class;
+        }
+        regex->num_classes = num_classes;
+    }
+    for(int c = 255; c >= 0; c--)
+    {
+        regex->class_byte[regex->byte_class[c]] = c;
+    }
+}
+
+/*
+    Compiles the expression of -regex, or of -iregex if fold_case is set,
+    into an NFA. The GNU regex library compiles it as well, to report
+    errors in the words of find, and matches the expressions the NFA can
+    not express.
+*/
+path_regex_t* compile_path_regex(const char* pattern, bool fold_case)
+{
+    struct re_pattern_buffer* gnu_regex = (struct re_pattern_buffer*) checked_alloc(1, sizeof(struct re_pattern_buffer));
+    re_syntax_options = RE_SYNTAX_EMACS | (fold_case ? RE_ICASE : 0);
+    const char* error = re_compile_pattern(pattern, strlen(pattern), gnu_regex);
+    if(error != NULL)
+    {
+        printf("find: failed to compile regular expression '%s': %s\n", pattern, error);
+        exit(1);
+    }
+
+    path_regex_t* regex = (path_regex_t*) checked_alloc(1, sizeof(path_regex_t));
+    regex->pattern = pattern;
+    regex->id = num_path_regexes++;
+    regex_parser_t parser = { (const unsigned char*) pattern, 0, fold_case, NULL, 0, true };
+    parser.terms = (regex_term_t*) checked_alloc(4 * strlen(pattern) + 4, sizeof(regex_term_t));
+    int root = parse_regex_alternation(&parser, 0);
+    if(parser.supported)
+    {
+        regex->nodes = (regex_node_t*) checked_alloc(parser.num_terms + 1, sizeof(regex_node_t));
+        int match = add_regex_node(regex, REGEX_MATCH, -1, -1);
+        regex->start = compile_regex_term(regex, &parser, root, match, fold_case);
+        split_regex_classes(regex);
+        regfree(gnu_regex);
+        free(gnu_regex);
+    }
+    else
+    {
+        regex->fallback = gnu_regex;
+    }
+    free(parser.terms);
+    return regex;
+}
+
+/*
+    Frees an expression returned by compile_path_regex.
+*/
+void free_path_regex(path_regex_t* regex)
+{
+    if(regex != NULL)
+    {
+        if(regex->fallback != NULL)
+        {
+            regfree(regex->fallback);
+            free(regex->fallback);
+        }
+        free(regex->nodes);
+        free(regex);
+    }
+}
+
+/*
+    The part of the DFA of a -regex that one thread built so far. Its
+    states are sets of NFA nodes and are added when a transition to them
+    is first taken, so only the states the paths lead to are built. The
+    cache is flushed when it would grow past REGEX_CACHE_CELLS.
+*/
+typedef struct
+{
+    // num_classes transitions per state, the row of the next state,
+    // DFA_REJECT if the path can no longer match, or REGEX_UNBUILT.
+    int* next_row;
+    bool* accepting;
+    int num_states;
+    int states_cap;
+    // The node sets of the states, as in dfa_builder_t.
+    int* state_start;
+    int* pool;
+    int pool_cap;
+    int* table;
+    int table_cap;
+    // The row of the start state, REGEX_UNBUILT after a flush.
+    int start_row;
+    uint64_t flushes;
+    // Room for the node sets being built.
+    bool* marked;
+    int* set;
+    int* line_end_set;
+} regex_cache_t;
+
+// The caches of the current thread, indexed by the id of the expression.
+_Thread_local regex_cache_t** regex_caches = NULL;
+
+/*
+    Adds node and the nodes reachable from it without reading a byte to
+    set. A ^ is passed if line_start is set and a $ if line_end is set.
+*/
+void add_regex_closure(const path_regex_t* regex, int node, bool line_start, bool line_end, bool* marked, int* set, int* set_len)
+{
+    if(marked[node])
+    {
+        return;
+    }
+    marked[node] = true;
+    set[(*set_len)++] = node;
+    const regex_node_t* n = &regex->nodes[node];
+    if(n->op == REGEX_SPLIT)
+    {
+        add_regex_closure(regex, n->out, line_start, line_end, marked, set, set_len);
+        add_regex_closure(regex, n->alt, line_start, line_end, marked, set, set_len);
+    }
+    else if((n->op == REGEX_LINE_START && line_start) || (n->op == REGEX_LINE_END && line_end))
+    {
+        add_regex_closure(regex, n->out, line_start, line_end, marked, set, set_len);
+    }
+}
+
+/*
+    Turns the nodes collected by add_regex_closure into the sorted set of a
+    DFA state and returns its length. Only the nodes that read a byte, the
+    $ that wait for a newline and the match are kept.
+*/
+int finish_regex_set(const path_regex_t* regex, bool* marked, int* set, int set_len)
+{
+    int kept = 0;
+    for(int i = 0; i < set_len; i++)
+    {
+        marked[set[i]] = false;
+        regex_op_t op = regex->nodes[set[i]].op;
+        if(op == REGEX_BYTES || op == REGEX_LINE_END || op == REGEX_MATCH)
+        {
+            set[kept++] = set[i];
+        }
+    }
+    qsort(set, kept, sizeof(int), compare_ints);
+    return kept;
+}
+
+/*
+    Puts in cache->line_end_set the nodes of set with its $ passed, as at
+    the end of the path or before a newline, and returns their number. A
+    set that ends in num_nodes was entered at the start of a line.
+*/
+int pass_line_ends(const path_regex_t* regex, regex_cache_t* cache, const int* set, int set_len)
+{
+    bool line_start = set_len > 0 && set[set_len - 1] == regex->num_nodes;
+    int length = 0;
+    for(int i = 0; i < set_len - line_start; i++)
+    {
+        add_regex_closure(regex, set[i], line_start, true, cache->marked, cache->line_end_set, &length);
+    }
+    return finish_regex_set(regex, cache->marked, cache->line_end_set, length);
+}
+
+regex_cache_t* get_regex_cache(const path_regex_t* regex)
+{
+    if(regex_caches == NULL)
+    {
+        regex_caches = (regex_cache_t**) checked_alloc(num_path_regexes, sizeof(regex_cache_t*));
+    }
+    regex_cache_t* cache = regex_caches[regex->id];
+    if(cache == NULL)
+    {
+        cache = (regex_cache_t*) checked_alloc(1, sizeof(regex_cache_t));
+        cache->states_cap = 16;
+        cache->next_row = (int*) checked_alloc(cache->states_cap * regex->num_classes, sizeof(int));
+        cache->accepting = (bool*) checked_alloc(cache->states_cap, sizeof(bool));
+        cache->state_start = (int*) checked_alloc(cache->states_cap + 1, sizeof(int));
+        cache->pool_cap = 256;
+        cache->pool = (int*) checked_alloc(cache->pool_cap, sizeof(int));
+        cache->table_cap = 32;
+        cache->table = (int*) checked_alloc(cache->table_cap, sizeof(int));
+        memset(cache->table, -1, cache->table_cap * sizeof(int));
+        cache->start_row = REGEX_UNBUILT;
+        cache->marked = (bool*) checked_alloc(regex->num_nodes, sizeof(bool));
+        cache->set = (int*) checked_alloc(regex->num_nodes + 1, sizeof(int));
+        cache->line_end_set = (int*) checked_alloc(regex->num_nodes, sizeof(int));
+        regex_caches[regex->id] = cache;
+    }
+    return cache;
+}
+
+/*
+    Frees the -regex caches of the current thread.
+*/
+void free_regex_caches()
+{
+    for(int i = 0; regex_caches != NULL && i < num_path_regexes; i++)
+    {
+        regex_cache_t* cache = regex_caches[i];
+        if(cache != NULL)
+        {
+            free(cache->next_row);
+            free(cache->accepting);
+            free(cache->state_start);
+            free(cache->pool);
+            free(cache->table);
+            free(cache->marked);
+            free(cache->set);
+            free(cache->line_end_set);
+            free(cache);
+        }
+    }
+    free(regex_caches);
+    regex_caches = NULL;
+}
+
+/*
+    Puts state into the first free slot of the hash table for its set.
+*/
+void insert_regex_state(regex_cache_t* cache, int state)
+{
+    const int* set = cache->pool + cache->state_start[state];
+    int set_len = cache->state_start[state + 1] - cache->state_start[state];
+    int slot = hash_node_set(set, set_len) & (cache->table_cap - 1);
+    while(cache->table[slot] >= 0)
+    {
+        slot = (slot + 1) & (cache->table_cap - 1);
+    }
+    cache->table[slot] = state;
+}
+
+/*
+    Returns the row of the state of the sorted node set, adding the state
+    if it is new. The cache is flushed first if the state would not fit.
+*/
+int find_regex_state(const path_regex_t* regex, regex_cache_t* cache, const int* set, int set_len)
+{
+    int slot = hash_node_set(set, set_len) & (cache->table_cap - 1);
+    while(cache->table[slot] >= 0)
+    {
+        int other = cache->table[slot];
+        int other_len = cache->state_start[other + 1] - cache->state_start[other];
+        if(other_len == set_len && memcmp(cache->pool + cache->state_start[other], set, set_len * sizeof(int)) == 0)
+        {
+            return other * regex->num_classes;
+        }
+        slot = (slot + 1) & (cache->table_cap - 1);
+    }
+
+    int state = cache->num_states;
+    if(state > 0 && (long) (state + 1) * regex->num_classes + cache->state_start[state] + set_len > REGEX_CACHE_CELLS)
+    {
+        cache->num_states = 0;
+        cache->start_row = REGEX_UNBUILT;
+        cache->flushes++;
+        memset(cache->table, -1, cache->table_cap * sizeof(int));
+        state = 0;
+    }
+    if(state == cache->states_cap)
+    {
+        cache->states_cap *= 2;
+        cache->next_row = (int*) checked_realloc(cache->next_row, cache->states_cap * regex->num_classes * sizeof(int));
+        cache->accepting = (bool*) checked_realloc(cache->accepting, cache->states_cap * sizeof(bool));
+        cache->state_start = (int*) checked_realloc(cache->state_start, (cache->states_cap + 1) * sizeof(int));
+    }
+    int start = cache->state_start[state];
+    if(start + set_len > cache->pool_cap)
+    {
+        cache->pool_cap = 2 * (start + set_len);
+        cache->pool = (int*) checked_realloc(cache->pool, cache->pool_cap * sizeof(int));
+    }
+    memcpy(cache->pool + start, set, set_len * sizeof(int));
+    cache->state_start[state + 1] = start + set_len;
+
+    // The path matches if it can end in this state.
+    int length = pass_line_ends(regex, cache, set, set_len);
+    cache->accepting[state] = false;
+    for(int i = 0; i < length; i++)
+    {
+        cache->accepting[state] = cache->accepting[state] || regex->nodes[cache->line_end_set[i]].op == REGEX_MATCH;
+    }
+    for(int class = 0; class < regex->num_classes; class++)
+    {
+        cache->next_row[state * regex->num_classes + class] = REGEX_UNBUILT;
+    }
+    cache->num_states++;
+
+    if(2 * cache->num_states > cache->table_cap)
+    {
+        free(cache->table);
+        cache->table_cap *= 2;
+        cache->table = (int*) checked_alloc(cache->table_cap, sizeof(int));
+        memset(cache->table, -1, cache->table_cap * sizeof(int));
+        for(int other = 0; other < cache->num_states; other++)
+        {
+            insert_regex_state(cache, other);
+        }
+    }
+    else
+    {
+        insert_regex_state(cache, state);
+    }
+    return state * regex->num_classes;
+}
+
+/*
+    Returns the row of the state the path is in before its first byte, or
+    DFA_REJECT if the expression can match nothing.
+*/
+int build_regex_start(const path_regex_t* regex, regex_cache_t* cache)
+{
+    int set_len = 0;
+    add_regex_closure(regex, regex->start, true, false, cache->marked, cache->set, &set_len);
+    set_len = finish_regex_set(regex, cache->marked, cache->set, set_len);
+    if(set_len == 0)
+    {
+        return DFA_REJECT;
+    }
+    if(regex->has_anchors)
+    {
+        cache->set[set_len++] = regex->num_nodes;
+    }
+    int row = find_regex_state(regex, cache, cache->set, set_len);
+    cache->start_row = row;
+    return row;
+}
+
+/*
+    Builds the transition from the state at row on the bytes of class and
+    returns the row of the next state, or DFA_REJECT. Reading a newline
+    passes the $ of the state before and the ^ after it.
+*/
+int build_regex_transition(const path_regex_t* regex, regex_cache_t* cache, int row, int class)
+{
+    int state = row / regex->num_classes;
+    unsigned char c = regex->class_byte[class];
+    const int* from = cache->pool + cache->state_start[state];
+    int from_len = cache->state_start[state + 1] - cache->state_start[state];
+    bool newline = c == '\n' && regex->has_anchors;
+    if(newline)
+    {
+        from_len = pass_line_ends(regex, cache, from, from_len);
+        from = cache->line_end_set;
+    }
+
+    int set_len = 0;
+    for(int i = 0; i < from_len && from[i] < regex->num_nodes; i++)
+    {
+        const regex_node_t* node = &regex->nodes[from[i]];
+        if(node->op == REGEX_BYTES && set_has(node->set, c))
+        {
+            add_regex_closure(regex, node->out, newline, false, cache->marked, cache->set, &set_len);
+        }
+    }
+    set_len = finish_regex_set(regex, cache->marked, cache->set, set_len);
+    if(set_len == 0)
+    {
+        cache->next_row[row + class] = DFA_REJECT;
+        return DFA_REJECT;
+    }
+    if(newline)
+    {
+        cache->set[set_len++] = regex->num_nodes;
+    }
+    uint64_t flushes = cache->flushes;
+    int next = find_regex_state(regex, cache, cache->set, set_len);
+    // A flush took the state at row away.
+    if(cache->flushes == flushes)
+    {
+        cache->next_row[row + class] = next;
+    }
+    return next;
+}
+
+/*
+    Returns true if the len bytes of path match the whole expression of
+    -regex or -iregex. The DFA states the path needs are built the first
+    time a thread reaches them.
+*/
+bool handle_regex(const path_regex_t* regex, const char* path, size_t len)
+{
+    if(regex->fallback != NULL)
+    {
+        return re_match(regex->fallback, path, len, 0, NULL) == (regoff_t) len;
+    }
+    regex_cache_t* cache = get_regex_cache(regex);
+    int row = cache->start_row;
+    if(row == REGEX_UNBUILT)
+    {
+        row = build_regex_start(regex, cache);
+    }
+    const unsigned char* bytes = (const unsigned char*) path;
+    for(size_t i = 0; i < len && row >= 0; i++)
+    {
+        int class = regex->byte_class[bytes[i]];
+        int next = cache->next_row[row + class];
+        row = next != REGEX_UNBUILT ? next : build_regex_transition(regex, cache, row, class);
+    }
+    return row >= 0 && cache->accepting[row / regex->num_classes];
+}
+
+/*
+    Returns a negative number, zero or a positive number if a is before,
+    the same as or after b.
+*/
+int compare_times(struct timespec a, struct timespec b)
+{
+    if(a.tv_sec != b.tv_sec)
+    {
+        return a.tv_sec < b.tv_sec ? -1 : 1;
+    }
+    return (a.tv_nsec > b.tv_nsec) - (a.tv_nsec < b.tv_nsec);
+}
+
+/*
+    Returns the time of file that field names.
+*/
+struct timespec file_time(file_data_t* file, time_field_t field)
+{
+    ensure_stat(file);
+    switch(field)
+    {
+        case ACCESS_TIME:
+            return file->statbuffer.st_atim;
+        case CHANGE_TIME:
+            return file->statbuffer.st_ctim;
+        default:
+            return file->statbuffer.st_mtim;
+    }
+}
+
+/*
+    Returns true if the time of file is after pred->reference for '-',
+    before it for '+', or for '=' after it but at most window_secs after.
+*/
+bool handle_time(file_data_t* file, const predicate_t* pred)
+{
+    struct timespec time = file_time(file, pred->time_field);
+    int order = compare_times(time, pred->reference);
+    if(pred->comparison == '+')
+    {
+        return order < 0;
+    }
+    if(pred->comparison == '-')
+    {
+        return order > 0;
+    }
+    struct timespec window_end = pred->reference;
+    window_end.tv_sec += pred->window_secs;
+    return order > 0 && compare_times(time, window_end) <= 0;
+}
+
+/*
+    Returns true if the file specified by file_name is of one of the
+    num_modes types passed for -type
+*/
+bool handle_type(file_data_t* file, const mode_t* modes, int num_modes)
+{
+    mode_t type = file_type(file);
+    // return true if the type matches any of the accepted types.
+    for(int i = 0; i < num_modes; i++)
+    {
+        if(type == modes[i])
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+    Returns the first occurrence of needle in the len bytes at haystack, or
+    NULL if there is none. With SSE2 16 positions are tested at a time by
+    comparing the first and the last byte of needle, only positions where
+    both match are compared in full.
+*/
+const char* find_substring(const char* haystack, size_t len, const char* needle, size_t needle_len)
+{
+    if(needle_len == 0)
+    {
+        return haystack;
+    }
+    if(needle_len > len)
+    {
+        return NULL;
+    }
+    if(needle_len == 1)
+    {
+        return (const char*) memchr(haystack, needle[0], len);
+    }
+    size_t pos = 0;
+#ifdef USE_SSE2
+    __m128i first = _mm_set1_epi8(needle[0]);
+    __m128i last = _mm_set1_epi8(needle[needle_len - 1]);
+    for(; pos + needle_len - 1 + 16 <= len; pos += 16)
+    {
+        __m128i block_first = _mm_loadu_si128((const __m128i*) (haystack + pos));
+        __m128i block_last = _mm_loadu_si128((const __m128i*) (haystack + pos + needle_len - 1));
+        __m128i matches = _mm_and_si128(_mm_cmpeq_epi8(block_first, first), _mm_cmpeq_epi8(block_last, last));
+        unsigned mask = (unsigned) _mm_movemask_epi8(matches);
+        while(mask != 0)
+        {
+            size_t candidate = pos + __builtin_ctz(mask);
+            if(memcmp(haystack + candidate + 1, needle + 1, needle_len - 2) == 0)
+            {
+                return haystack + candidate;
+            }
+            mask &= mask - 1;
+        }
+    }
+#endif
+    return (const char*) memmem(haystack + pos, len - pos, needle, needle_len);
+}
+
+// -contains reads files in pieces of this size.
+const size_t CONTENT_BUF_SIZE = 256 * 1024;
+// The buffer -contains reads into on the current thread.
+_Thread_local char* content_buf = NULL;
+
+/*
+    Frees the -contains buffer of the current thread.
+*/
+void free_content_buf()
+{
+    free(content_buf);
+    content_buf = NULL;
+}
+
+/*
+    Returns true if the file open on fd contains needle. The file is read
+    into content_buf rather than mapped, a mapping raises SIGBUS if the
+    file is truncated while it is searched. Reading stops at the first
+    match. Returns false with errno set if the file could not be read.
+*/
+bool fd_contains(int fd, const char* needle, size_t needle_len)
+{
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    if(content_buf == NULL)
+    {
+        content_buf = (char*) checked_alloc(CONTENT_BUF_SIZE, sizeof(char));
+    }
+    errno = 0;
+    if(needle_len >= CONTENT_BUF_SIZE)
+    {
+        return false;
+    }
+    // The last needle_len - 1 bytes of each piece are kept in front of the
+    // next, a match may span both. Files that report no size, like those
+    // in /proc, are read until the end all the same.
+    size_t kept = 0;
+    for(;;)
+    {
+        ssize_t nread = read(fd, content_buf + kept, CONTENT_BUF_SIZE - kept);
+        if(nread < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if(nread <= 0)
+        {
+            return false;
+        }
+        size_t len = kept + nread;
+        if(find_substring(content_buf, len, needle, needle_len) != NULL)
+        {
+            return true;
+        }
+        kept = len < needle_len - 1 ? len : needle_len - 1;
+        memmove(content_buf, content_buf + len - kept, kept);
+    }
+}
+
+/*
+    Returns true if file is a regular file that contains needle. Other
+    types are never opened, so fifos and devices do not block the walk.
+    Files that can not be read are reported and do not match.
+*/
+bool handle_contains(file_data_t* file, const char* needle, size_t needle_len)
+{
+    if(file_type(file) != S_IFREG)
+    {
+        return false;
+    }
+    int dir_fd = file->parent_fd;
+    const char* name = dir_fd == AT_FDCWD ? file_path(file) : file->file_name;
+    int flags = O_RDONLY | O_CLOEXEC | O_NOCTTY | O_NONBLOCK | (follow_symbolic ? 0 : O_NOFOLLOW);
+    int fd = openat(dir_fd, name, flags);
+    bool found = false;
+    if(fd != -1)
+    {
+        struct stat statbuffer;
+        errno = 0;
+        if(fstat(fd, &statbuffer) == 0 && S_ISREG(statbuffer.st_mode))
+        {
+            found = fd_contains(fd, needle, needle_len);
+        }
+    }
+    int error = errno;
+    if(!found && error != 0)
+    {
+        out_printf("find: ‘%.*s’: %s\n", (int) printed_length(file), file_path(file), strerror(error));
+        exit_status = 1;
+    }
+    if(fd != -1)
+    {
+        close(fd);
+    }
+    return found;
+}
+
+/*
+    Replaces every {} in arg with path and returns the result in a new
+    char* the caller must deallocate.
+*/
+char* replace_braces(const char* arg, const char* path)
+{
+    int path_length = strlen(path);
+    int length = strlen(arg) + 1;
+
+    // find occurances of {} to calculate allocation size of filled string
+    for(const char* pos = strstr(arg, "{}"); pos != NULL; pos = strstr(pos + 2, "{}"))
+    {
+        length += path_length - 2;
+    }
+
+    char* filled_arg = (char*) checked_alloc(length, sizeof(char));
+    int filled_str_index = 0;
+    for(int original_index = 0; arg[original_index] != '\0';)
+    {
+        if(arg[original_index] == '{' && arg[original_index+1] == '}')
+        {
+            memcpy(filled_arg + filled_str_index, path, path_length);
+            filled_str_index += path_length;
+            original_index += 2;
+        }
+        else
+        {
+            filled_arg[filled_str_index] = arg[original_index];
+            filled_str_index += 1;
+            original_index += 1;
+        }
+    }
+    return filled_arg;
+}
+
+/*
+    Starts the command argv directly, without a shell. Returns its pid, or
+    -1 if it could not be started.
+*/
+pid_t start_command(char** argv)
+{
+    // Anything printed so far has to come before the command's output.
+    if(worker_id < 0)
+    {
+        out_flush();
+    }
+
+    pid_t pid;
+    uint64_t start = stats_now();
+    int error = posix_spawnp(&pid, argv[0], NULL, NULL, argv, environ);
+    if(collect_stats)
+    {
+        stats_record(&thread_stats.exec_spawns, NULL, start);
+    }
+    if(error != 0)
+    {
+        out_printf("find: ‘%s’: %s\n", argv[0], strerror(error));
+        return -1;
+    }
+    return pid;
+}
+
+/*
+    Runs the command argv directly, without a shell, and waits for it.
+    Returns true if it exited with status 0.
+*/
+bool run_command(char** argv)
+{
+    uint64_t start = stats_now();
+    pid_t pid = start_command(argv);
+    if(pid == -1)
+    {
+        return false;
+    }
+
+    int status;
+    while(waitpid(pid, &status, 0) == -1)
+    {
+        if(errno != EINTR)
+        {
+            return false;
+        }
+    }
+    if(collect_stats)
+    {
+        stats_record(&thread_stats.exec_runs, thread_stats.exec_histogram, start);
+    }
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+/*
+    Returns the -exec command with every {} replaced by the path of file,
+    the caller must deallocate it with free_command.
+*/
+char** populate_command(char** exec_argv, int exec_argc, file_data_t* file)
+{
+    char* path = printed_path(file);
+    char** filled_argv = (char**) checked_alloc(exec_argc + 1, sizeof(char*));
+    for(int i = 0; i < exec_argc; i++)
+    {
+        filled_argv[i] = replace_braces(exec_argv[i], path);
+    }
+    free(path);
+    return filled_argv;
+}
+
+/*
+    Frees a command returned by populate_command.
+*/
+void free_command(char** argv)
+{
+    for(int i = 0; argv[i] != NULL; i++)
+    {
+        free(argv[i]);
+    }
+    free(argv);
+}
+
+/*
+    Executes the specified command on the file specified. Returns true if
+    the command succeeded and false otherwise.
+*/
+bool handle_exec(char** exec_argv, int exec_argc, file_data_t* file)
+{
+    char** filled_argv = populate_command(exec_argv, exec_argc, file);
+    bool return_value = run_command(filled_argv);
+    free_command(filled_argv);
+    return return_value;
+}
+
+void run_program(file_data_t* file, int first);
+
+/*
+    A -exec command started with -exec-jobs. If predicates follow the -exec,
+    file holds a copy of the file they still have to be run on once the
+    command succeeded, starting with program[next_pred].
+*/
+typedef struct
+{
+    pid_t pid;
+    // A pidfd for waiting on the command, -1 if not supported.
+    int pidfd;
+    file_data_t* file;
+    int next_pred;
+    // When the command was started, for -stats.
+    uint64_t started;
+} exec_job_t;
+
+exec_job_t* exec_jobs = NULL;
+int num_exec_jobs = 0;
+// Guards exec_jobs, only one thread reaps at a time.
+pthread_mutex_t exec_jobs_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+    Returns a copy of file that stays valid after the walk moved on,
+    everything is found through its full path.
+*/
+file_data_t* copy_file_data(file_data_t* file)
+{
+    file_data_t* copy = (file_data_t*) checked_alloc(1, sizeof(file_data_t));
+    *copy = *file;
+    copy->path = strdup(file_path(file));
+    copy->file_name = strdup(file->file_name);
+    if(copy->path == NULL || copy->file_name == NULL)
+    {
+        printf("find: insufficient memory\n");
+        exit(1);
+    }
+    copy->dir_path_len = 0;
+    copy->parent_fd = AT_FDCWD;
+    copy->stat_slot = NULL;
+    return copy;
+}
+
+/*
+    Waits for one of the running commands to exit, or only checks whether
+    one has if block is false. The job is removed from exec_jobs and copied
+    to finished, with success telling if it exited with status 0. Returns
+    false if no job finished. The caller must hold exec_jobs_lock.
+*/
+bool reap_exec_job(bool block, exec_job_t* finished, bool* success)
+{
+    if(num_exec_jobs == 0)
+    {
+        return false;
+    }
+
+    int index = -1;
+    int status = 0;
+    bool have_pidfds = true;
+    for(int i = 0; i < num_exec_jobs; i++)
+    {
+        have_pidfds = have_pidfds && exec_jobs[i].pidfd != -1;
+    }
+
+    if(have_pidfds)
+    {
+        // Wait for whichever command exits first.
+        struct pollfd fds[num_exec_jobs];
+        for(int i = 0; i < num_exec_jobs; i++)
+        {
+            fds[i].fd = exec_jobs[i].pidfd;
+            fds[i].events = POLLIN;
+            fds[i].revents = 0;
+        }
+        while(poll(fds, num_exec_jobs, block ? -1 : 0) == -1 && errno == EINTR)
+        {
+        }
+        for(int i = 0; i < num_exec_jobs && index == -1; i++)
+        {
+            if(fds[i].revents != 0)
+            {
+                index = i;
+            }
+        }
+        if(index == -1)
+        {
+            return false;
+        }
+        while(waitpid(exec_jobs[index].pid, &status, 0) == -1 && errno == EINTR)
+        {
+        }
+    }
+    else
+    {
+        // Without pidfds wait for the oldest command, or check each one.
+        for(int i = 0; i < (block ? 1 : num_exec_jobs) && index == -1; i++)
+        {
+            pid_t pid;
+            while((pid = waitpid(exec_jobs[i].pid, &status, block ? 0 : WNOHANG)) == -1 && errno == EINTR)
+            {
+            }
+            if(pid == exec_jobs[i].pid || pid == -1)
+            {
+                index = i;
+            }
+        }
+        if(index == -1)
+        {
+            return false;
+        }
+    }
+
+    *finished = exec_jobs[index];
+    *success = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    if(collect_stats)
+    {
+        stats_record(&thread_stats.exec_runs, thread_stats.exec_histogram, finished->started);
+    }
+    if(finished->pidfd != -1)
+    {
+        close(finished->pidfd);
+    }
+    num_exec_jobs--;
+    memmove(&exec_jobs[index], &exec_jobs[index + 1], (num_exec_jobs - index) * sizeof(exec_job_t));
+    return true;
+}
+
+/*
+    Runs the predicates that were waiting on a finished command, if it
+    succeeded, and frees its copy of the file.
+*/
+void finish_exec_job(exec_job_t* job, bool success)
+{
+    if(job->file == NULL)
+    {
+        return;
+    }
+    if(success)
+    {
+        run_program(job->file, job->next_pred);
+    }
+    free(job->file->path);
+    free(job->file->file_name);
+    free(job->file);
+}
+
+/*
+    Starts argv as one of at most max_exec_jobs commands running at once,
+    waiting for one to exit first if needed. The predicates from
+    program[next_pred] on are run on file once the command succeeded.
+*/
+void start_exec_job(char** argv, file_data_t* file, int next_pred)
+{
+    exec_job_t finished;
+    bool success;
+
+    pthread_mutex_lock(&exec_jobs_lock);
+    if(exec_jobs == NULL)
+    {
+        exec_jobs = (exec_job_t*) checked_alloc(max_exec_jobs, sizeof(exec_job_t));
+    }
+    // Finish commands that already exited, then wait if still too many run.
+    while(reap_exec_job(num_exec_jobs == max_exec_jobs, &finished, &success))
+    {
+        // The lock is not held while running predicates, they may start jobs.
+        pthread_mutex_unlock(&exec_jobs_lock);
+        finish_exec_job(&finished, success);
+        pthread_mutex_lock(&exec_jobs_lock);
+    }
+
+    uint64_t started = stats_now();
+    pid_t pid = start_command(argv);
+    if(pid != -1)
+    {
+        exec_job_t* job = &exec_jobs[num_exec_jobs];
+        job->pid = pid;
+        job->started = started;
+#ifdef SYS_pidfd_open
+        job->pidfd = syscall(SYS_pidfd_open, pid, 0);
+#else
+        job->pidfd = -1;
+#endif
+        job->file = next_pred < program_len ? copy_file_data(file) : NULL;
+        job->next_pred = next_pred;
+        num_exec_jobs++;
+    }
+    pthread_mutex_unlock(&exec_jobs_lock);
+}
+
+/*
+    Waits for all commands started with -exec-jobs and runs the predicates
+    waiting on them. Called once the walk is over.
+*/
+void finish_exec_jobs()
+{
+    exec_job_t finished;
+    bool success;
+
+    pthread_mutex_lock(&exec_jobs_lock);
+    while(reap_exec_job(true, &finished, &success))
+    {
+        pthread_mutex_unlock(&exec_jobs_lock);
+        finish_exec_job(&finished, success);
+        pthread_mutex_lock(&exec_jobs_lock);
+    }
+    pthread_mutex_unlock(&exec_jobs_lock);
+    free(exec_jobs);
+}
+
+/*
+    The paths collected for one -exec ... + predicate. Workers share it,
+    so it is guarded by lock.
+*/
+typedef struct exec_batch
+{
+    pthread_mutex_t lock;
+    // The command without the trailing {}, followed by the paths.
+    char** argv;
+    int argc;
+    int cap;
+    // Number of leading argv entries that belong to the command.
+    int command_argc;
+    // Bytes the argv strings and pointers take up, must stay below limit.
+    size_t size;
+    size_t limit;
+    // The size of the command alone.
+    size_t command_size;
+    // Holds the paths until the command ran.
+    arena_t paths;
+} exec_batch_t;
+
+/*
+    Returns the number of bytes the arguments of a command may take up.
+    This is ARG_MAX minus what the environment needs, with some headroom
+    like xargs leaves.
+*/
+size_t exec_arg_limit()
+{
+    long arg_max = sysconf(_SC_ARG_MAX);
+    if(arg_max <= 0)
+    {
+        // The smallest ARG_MAX POSIX allows.
+        arg_max = 4096;
+    }
+    long env_size = 0;
+    for(char** env = environ; *env != NULL; env++)
+    {
+        env_size += strlen(*env) + 1 + sizeof(char*);
+    }
+    long limit = arg_max - env_size - 2048;
+    return limit > 4096 ? limit : 4096;
+}
+
+/*
+    Creates the batch of a -exec ... + predicate whose command, without the
+    trailing {}, is the command_argc strings of command.
+*/
+exec_batch_t* new_exec_batch(char** command, int command_argc)
+{
+    exec_batch_t* batch = (exec_batch_t*) checked_alloc(1, sizeof(exec_batch_t));
+    pthread_mutex_init(&batch->lock, NULL);
+    batch->cap = command_argc + 64;
+    batch->argv = (char**) checked_alloc(batch->cap, sizeof(char*));
+    for(int i = 0; i < command_argc; i++)
+    {
+        batch->argv[i] = command[i];
+        batch->size += strlen(command[i]) + 1 + sizeof(char*);
+    }
+    batch->argc = command_argc;
+    batch->command_argc = command_argc;
+    batch->command_size = batch->size;
+    batch->limit = exec_arg_limit();
+    return batch;
+}
+
+/*
+    Runs the command of the batch on all paths collected so far. A failing
+    command does not stop the walk, but makes myfind exit with status 1.
+    The caller must hold batch->lock.
+*/
+void run_exec_batch(exec_batch_t* batch)
+{
+    if(batch->argc == batch->command_argc)
+    {
+        return;
+    }
+    batch->argv[batch->argc] = NULL;
+    if(!run_command(batch->argv))
+    {
+        exit_status = 1;
+    }
+    arena_reset(&batch->paths);
+    batch->size = batch->command_size;
+    batch->argc = batch->command_argc;
+}
+
+/*
+    Adds the path of file to the batch, first running the command on the
+    paths collected so far if the new one would not fit.
+*/
+void add_to_exec_batch(exec_batch_t* batch, file_data_t* file)
+{
+    size_t path_len = printed_length(file);
+    size_t path_size = path_len + 1 + sizeof(char*);
+
+    pthread_mutex_lock(&batch->lock);
+    if(batch->size + path_size > batch->limit)
+    {
+        run_exec_batch(batch);
+    }
+    // Keep a slot for the terminating NULL.
+    if(batch->argc + 1 >= batch->cap)
+    {
+        batch->cap *= 2;
+        batch->argv = (char**) checked_realloc(batch->argv, batch->cap * sizeof(char*));
+    }
+    char* path = (char*) arena_alloc(&batch->paths, path_len + 1);
+    memcpy(path, file_path(file), path_len);
+    path[path_len] = '\0';
+    batch->argv[batch->argc] = path;
+    batch->argc++;
+    batch->size += path_size;
+    pthread_mutex_unlock(&batch->lock);
+}
+
+/*
+    A file -duplicates compares with the others of its size. The hashes
+    are filled in stage by stage, files that do not collide with any
+    other are dropped after each.
+*/
+typedef struct
+{
+    char* path;
+    off_t size;
+    dev_t dev;
+    ino_t ino;
+    // Of the first and last DUP_PARTIAL_SIZE bytes, and of all of them.
+    uint64_t partial[2];
+    uint64_t full[2];
+    // The errno of a failed read, or -1 if the file changed since the walk.
+    int error;
+} dup_file_t;
+
+/*
+    The files collected by a -duplicates predicate, compared once the
+    walk is over.
+*/
+typedef struct dup_set
+{
+    pthread_mutex_t lock;
+    dup_file_t* files;
+    int num_files;
+    int cap;
+    arena_t paths;
+    // Ends each path, '\0' if the expression has -print0, else '\n'.
+    // An empty record separates the groups.
+    char terminator;
+} dup_set_t;
+
+// How much of each end of a file the first hash of -duplicates reads.
+const size_t DUP_PARTIAL_SIZE = 4096;
+
+/*
+    Adds file to set if it is a regular file with any contents. Its size
+    and inode come from the stat the walk did.
+*/
+void add_to_dup_set(dup_set_t* set, file_data_t* file)
+{
+    if(file_type(file) != S_IFREG || !ensure_stat(file) || file->statbuffer.st_size == 0)
+    {
+        return;
+    }
+    size_t path_len = printed_length(file);
+    pthread_mutex_lock(&set->lock);
+    if(set->num_files == set->cap)
+    {
+        set->cap = set->cap == 0 ? 64 : set->cap * 2;
+        set->files = (dup_file_t*) checked_realloc(set->files, set->cap * sizeof(dup_file_t));
+    }
+    dup_file_t* dup = &set->files[set->num_files++];
+    memset(dup, 0, sizeof(dup_file_t));
+    dup->path = (char*) arena_alloc(&set->paths, path_len + 1);
+    memcpy(dup->path, file_path(file), path_len);
+    dup->path[path_len] = '\0';
+    dup->size = file->statbuffer.st_size;
+    dup->dev = file->statbuffer.st_dev;
+    dup->ino = file->statbuffer.st_ino;
+    pthread_mutex_unlock(&set->lock);
+}
+
+/*
+    Feeds the len bytes at data into the 128 bit hash, the MurmurHash3
+    x64 128 mixing. finish_hash has to be called once all bytes are in.
+    Not a cryptographic hash, collisions can be made on purpose, so files
+    with equal hashes are still compared byte for byte.
+*/
+void hash_bytes(uint64_t hash[2], const char* data, size_t len)
+{
+    const uint64_t C1 = 0x87c37b91114253d5ull;
+    const uint64_t C2 = 0x4cf5ad432745937full;
+    uint64_t h1 = hash[0];
+    uint64_t h2 = hash[1];
+    for(size_t pos = 0; pos < len; pos += 16)
+    {
+        uint64_t k[2] = { 0, 0 };
+        memcpy(k, data + pos, len - pos < 16 ? len - pos : 16);
+        uint64_t k1 = k[0] * C1;
+        k1 = (k1 << 31 | k1 >> 33) * C2;
+        h1 ^= k1;
+        h1 = (h1 << 27 | h1 >> 37) + h2;
+        h1 = h1 * 5 + 0x52dce729;
+        uint64_t k2 = k[1] * C2;
+        k2 = (k2 << 33 | k2 >> 31) * C1;
+        h2 ^= k2;
+        h2 = (h2 << 31 | h2 >> 33) + h1;
+        h2 = h2 * 5 + 0x38495ab5;
+    }
+    hash[0] = h1;
+    hash[1] = h2;
+}
+
+/*
+    Mixes the 64 bits of h so each of them affects all others, the
+    MurmurHash3 finalizer.
+*/
+uint64_t mix_hash_bits(uint64_t h)
+{
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ull;
+    h ^= h >> 33;
+    return h;
+}
+
+/*
+    Finishes the hash of len bytes fed in by hash_bytes.
+*/
+void finish_hash(uint64_t hash[2], uint64_t len)
+{
+    uint64_t h1 = hash[0] ^ len;
+    uint64_t h2 = hash[1] ^ len;
+    h1 += h2;
+    h2 += h1;
+    h1 = mix_hash_bits(h1);
+    h2 = mix_hash_bits(h2);
+    h1 += h2;
+    h2 += h1;
+    hash[0] = h1;
+    hash[1] = h2;
+}
+
+/*
+    Reads up to len bytes at offset into buf, retrying short reads.
+    Returns the number of bytes read, less only at the end of the file,
+    or -1 on errors.
+*/
+ssize_t pread_full(int fd, char* buf, size_t len, off_t offset)
+{
+    size_t done = 0;
+    while(done < len)
+    {
+        ssize_t nread = pread(fd, buf + done, len - done, offset + done);
+        if(nread < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if(nread < 0)
+        {
+            return -1;
+        }
+        if(nread == 0)
+        {
+            break;
+        }
+        done += nread;
+    }
+    return done;
+}
+
+/*
+    Reports that dup could not be read.
+*/
+void print_dup_error(const dup_file_t* dup, int error)
+{
+    out_printf("find: ‘%s’: %s\n", dup->path, strerror(error));
+    exit_status = 1;
+}
+
+/*
+    Hashes the first and last DUP_PARTIAL_SIZE bytes of dup or, if full is
+    set, all of it. Small files are covered by the first hash already,
+    which then also stands for the full one. The inode is taken again
+    from the open file, -index and -watch do not keep it.
+*/
+void hash_dup_file(dup_file_t* dup, bool full)
+{
+    int fd = open(dup->path, O_RDONLY | O_CLOEXEC | O_NOCTTY | O_NONBLOCK);
+    struct stat statbuffer;
+    if(fd == -1 || fstat(fd, &statbuffer) == -1)
+    {
+        dup->error = errno;
+        if(fd != -1)
+        {
+            close(fd);
+        }
+        return;
+    }
+    if(!S_ISREG(statbuffer.st_mode) || statbuffer.st_size != dup->size)
+    {
+        dup->error = -1;
+        close(fd);
+        return;
+    }
+    dup->dev = statbuffer.st_dev;
+    dup->ino = statbuffer.st_ino;
+    if(content_buf == NULL)
+    {
+        content_buf = (char*) checked_alloc(CONTENT_BUF_SIZE, sizeof(char));
+    }
+
+    uint64_t* hash = full ? dup->full : dup->partial;
+    hash[0] = hash[1] = (uint64_t) dup->size;
+    off_t ends[][2] = {
+        { 0, (off_t) DUP_PARTIAL_SIZE },
+        { dup->size - (off_t) DUP_PARTIAL_SIZE, dup->size }
+    };
+    bool whole = full || dup->size <= (off_t) (2 * DUP_PARTIAL_SIZE);
+    if(whole)
+    {
+        ends[0][1] = dup->size;
+    }
+    uint64_t hashed = 0;
+    for(int i = 0; i < (whole ? 1 : 2); i++)
+    {
+        for(off_t offset = ends[i][0]; offset < ends[i][1]; offset += CONTENT_BUF_SIZE)
+        {
+            size_t len = ends[i][1] - offset < (off_t) CONTENT_BUF_SIZE ? (size_t) (ends[i][1] - offset) : CONTENT_BUF_SIZE;
+            ssize_t nread = pread_full(fd, content_buf, len, offset);
+            if(nread != (ssize_t) len)
+            {
+                dup->error = nread < 0 ? errno : -1;
+                close(fd);
+                return;
+            }
+            hash_bytes(hash, content_buf, len);
+            hashed += len;
+        }
+    }
+    finish_hash(hash, hashed);
+    if(whole && !full)
+    {
+        dup->full[0] = dup->partial[0];
+        dup->full[1] = dup->partial[1];
+    }
+    close(fd);
+}
+
+/*
+    The files of a -duplicates stage, hashed by the main thread and the
+    -j helpers alike.
+*/
+typedef struct
+{
+    dup_file_t* files;
+    int num_files;
+    bool full;
+    atomic_int next;
+} dup_hash_job_t;
+
+/*
+    Hashes files of job until none are left.
+*/
+void hash_dup_files(dup_hash_job_t* job)
+{
+    for(int i = atomic_fetch_add(&job->next, 1); i < job->num_files; i = atomic_fetch_add(&job->next, 1))
+    {
+        hash_dup_file(&job->files[i], job->full);
+    }
+}
+
+/*
+    The thread function of the -j helpers of hash_dup_set.
+*/
+void* dup_hash_helper(void* arg)
+{
+    hash_dup_files((dup_hash_job_t*) arg);
+    free_content_buf();
+    return NULL;
+}
+
+/*
+    Hashes the files of set on the main thread and num_threads helpers,
+    then reports the ones that could not be read and drops them. set has
+    to be sorted by drop_unique_dups.
+*/
+void hash_dup_set(dup_set_t* set, bool full)
+{
+    // Small files got their full hash with the partial one. They come
+    // after all larger ones, so the full stage stops short of them.
+    int num_files = set->num_files;
+    while(full && num_files > 0 && set->files[num_files - 1].size <= (off_t) (2 * DUP_PARTIAL_SIZE))
+    {
+        num_files--;
+    }
+    dup_hash_job_t job = { .files = set->files, .num_files = num_files, .full = full };
+    atomic_init(&job.next, 0);
+    pthread_t* helpers = (pthread_t*) checked_alloc(num_threads + 1, sizeof(pthread_t));
+    int num_helpers = 0;
+    for(int i = 0; i < num_threads && i + 1 < num_files; i++)
+    {
+        if(pthread_create(&helpers[num_helpers], NULL, dup_hash_helper, &job) == 0)
+        {
+            num_helpers++;
+        }
+    }
+    hash_dup_files(&job);
+    for(int i = 0; i < num_helpers; i++)
+    {
+        pthread_join(helpers[i], NULL);
+    }
+    free(helpers);
+
+    int kept = 0;
+    for(int i = 0; i < set->num_files; i++)
+    {
+        dup_file_t* dup = &set->files[i];
+        if(dup->error > 0)
+        {
+            print_dup_error(dup, dup->error);
+        }
+        else if(dup->error == 0)
+        {
+            set->files[kept++] = *dup;
+        }
+    }
+    set->num_files = kept;
+}
+
+/*
+    Orders files by size, largest first, then by hashes and path. Hashes
+    not computed yet are all 0.
+*/
+int compare_dup_files(const void* a, const void* b)
+{
+    const dup_file_t* x = (const dup_file_t*) a;
+    const dup_file_t* y = (const dup_file_t*) b;
+    if(x->size != y->size)
+    {
+        return x->size < y->size ? 1 : -1;
+    }
+    int order = memcmp(x->partial, y->partial, sizeof(x->partial));
+    if(order == 0)
+    {
+        order = memcmp(x->full, y->full, sizeof(x->full));
+    }
+    return order != 0 ? order : strcmp(x->path, y->path);
+}
+
+/*
+    Orders files by inode, then by path.
+*/
+int compare_dup_inodes(const void* a, const void* b)
+{
+    const dup_file_t* x = (const dup_file_t*) a;
+    const dup_file_t* y = (const dup_file_t*) b;
+    if(x->dev != y->dev)
+    {
+        return x->dev < y->dev ? -1 : 1;
+    }
+    if(x->ino != y->ino)
+    {
+        return x->ino < y->ino ? -1 : 1;
+    }
+    return strcmp(x->path, y->path);
+}
+
+/*
+    Returns true if the files are alike as far as they were compared.
+*/
+bool same_dup_contents(const dup_file_t* x, const dup_file_t* y)
+{
+    return x->size == y->size && memcmp(x->partial, y->partial, sizeof(x->partial)) == 0
+           && memcmp(x->full, y->full, sizeof(x->full)) == 0;
+}
+
+/*
+    Sorts the files of set and drops the ones alike to no other.
+*/
+void drop_unique_dups(dup_set_t* set)
+{
+    qsort(set->files, set->num_files, sizeof(dup_file_t), compare_dup_files);
+    int kept = 0;
+    for(int i = 0; i < set->num_files; i++)
+    {
+        if((i > 0 && same_dup_contents(&set->files[i - 1], &set->files[i]))
+           || (i + 1 < set->num_files && same_dup_contents(&set->files[i], &set->files[i + 1])))
+        {
+            set->files[kept++] = set->files[i];
+        }
+    }
+    set->num_files = kept;
+}
+
+/*
+    Keeps one path of each inode in set, the first by name. Hard links
+    are the same file, not duplicates of each other.
+*/
+void drop_hard_links(dup_set_t* set)
+{
+    qsort(set->files, set->num_files, sizeof(dup_file_t), compare_dup_inodes);
+    int kept = 0;
+    for(int i = 0; i < set->num_files; i++)
+    {
+        if(kept == 0 || set->files[kept - 1].dev != set->files[i].dev || set->files[kept - 1].ino != set->files[i].ino)
+        {
+            set->files[kept++] = set->files[i];
+        }
+    }
+    set->num_files = kept;
+}
+
+/*
+    Opens dup to compare it, reporting it if it can not be opened.
+    Returns the fd or -1.
+*/
+int open_dup_file(const dup_file_t* dup)
+{
+    int fd = open(dup->path, O_RDONLY | O_CLOEXEC | O_NOCTTY | O_NONBLOCK);
+    if(fd == -1)
+    {
+        print_dup_error(dup, errno);
+    }
+    return fd;
+}
+
+/*
+    Returns true if the files x and y, open on x_fd and y_fd, hold the
+    same bytes, reading them into both halves of content_buf a piece at a
+    time. A file that shrank since it was hashed is simply different,
+    read errors are reported and set *failed to the file that failed.
+*/
+bool same_dup_bytes(const dup_file_t* x, int x_fd, const dup_file_t* y, int y_fd, const dup_file_t** failed)
+{
+    if(content_buf == NULL)
+    {
+        content_buf = (char*) checked_alloc(CONTENT_BUF_SIZE, sizeof(char));
+    }
+    size_t piece = CONTENT_BUF_SIZE / 2;
+    for(off_t offset = 0; offset < x->size; offset += piece)
+    {
+        size_t len = x->size - offset < (off_t) piece ? (size_t) (x->size - offset) : piece;
+        ssize_t x_read = pread_full(x_fd, content_buf, len, offset);
+        ssize_t y_read = x_read < 0 ? 0 : pread_full(y_fd, content_buf + piece, len, offset);
+        if(x_read < 0 || y_read < 0)
+        {
+            *failed = x_read < 0 ? x : y;
+            print_dup_error(*failed, errno);
+            return false;
+        }
+        if(x_read != (ssize_t) len || y_read != (ssize_t) len || memcmp(content_buf, content_buf + piece, len) != 0)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+    Prints the files of a run whose hashes are all equal, once they were
+    compared byte for byte with the first. Files that differ from it are
+    compared among themselves in turn. Each path ends in terminator.
+    *printed is set once any group was printed, groups after the first
+    are preceded by an empty record.
+*/
+void print_dup_group(dup_file_t* files, int num_files, char terminator, bool* printed)
+{
+    bool* done = (bool*) checked_alloc(num_files, sizeof(bool));
+    for(int first = 0; first + 1 < num_files; first++)
+    {
+        int first_fd = done[first] ? -1 : open_dup_file(&files[first]);
+        if(first_fd == -1)
+        {
+            continue;
+        }
+        bool in_group = false;
+        for(int i = first + 1; i < num_files; i++)
+        {
+            int fd = done[i] ? -1 : open_dup_file(&files[i]);
+            if(fd == -1)
+            {
+                done[i] = true;
+                continue;
+            }
+            const dup_file_t* failed = NULL;
+            bool same = same_dup_bytes(&files[first], first_fd, &files[i], fd, &failed);
+            close(fd);
+            if(failed == &files[first])
+            {
+                break;
+            }
+            done[i] = same || failed != NULL;
+            if(!same)
+            {
+                continue;
+            }
+            if(!in_group)
+            {
+                if(*printed)
+                {
+                    out_write(&terminator, 1);
+                }
+                out_write(files[first].path, strlen(files[first].path));
+                out_write(&terminator, 1);
+                in_group = true;
+                *printed = true;
+            }
+            out_write(files[i].path, strlen(files[i].path));
+            out_write(&terminator, 1);
+        }
+        close(first_fd);
+    }
+    free(done);
+}
+
+/*
+    Finds the duplicates among the files of set and prints each group of
+    them, largest files first, with an empty record between groups. Files
+    are grouped by size, then by a hash of their ends and only then by a
+    hash of all of their contents, each stage only looking at the files
+    that still collide. Files left together are compared byte for byte
+    before they are printed.
+*/
+void report_dup_set(dup_set_t* set)
+{
+    // Without files there is no array to sort either.
+    if(set->num_files < 2)
+    {
+        set->num_files = 0;
+        arena_reset(&set->paths);
+        return;
+    }
+    drop_unique_dups(set);
+    hash_dup_set(set, false);
+    drop_hard_links(set);
+    drop_unique_dups(set);
+    hash_dup_set(set, true);
+    drop_unique_dups(set);
+    bool printed = false;
+    for(int start = 0, end; start < set->num_files; start = end)
+    {
+        end = start + 1;
+        while(end < set->num_files && same_dup_contents(&set->files[start], &set->files[end]))
+        {
+            end++;
+        }
+        print_dup_group(set->files + start, end - start, set->terminator, &printed);
+    }
+    set->num_files = 0;
+    arena_reset(&set->paths);
+}
+
+/*
+    The run functions of the predicates, they only unpack the bound
+    arguments for the handle_ functions.
+*/
+bool run_name(const predicate_t* pred, file_data_t* file)
+{
+    return handle_name(pred->matcher, file->file_name);
+}
+
+bool run_name_from(const predicate_t* pred, file_data_t* file)
+{
+    const char* pattern = handle_name_from(pred->name_set, file->file_name);
+    if(pattern != NULL)
+    {
+        file->matched_pattern = pattern;
+    }
+    return pattern != NULL;
+}
+
+bool run_regex(const predicate_t* pred, file_data_t* file)
+{
+    return handle_regex(pred->regex, file_path(file), printed_length(file));
+}
+
+bool run_time(const predicate_t* pred, file_data_t* file)
+{
+    return handle_time(file, pred);
+}
+
+bool run_type(const predicate_t* pred, file_data_t* file)
+{
+    return handle_type(file, pred->modes, pred->num_modes);
+}
+
+bool run_contains(const predicate_t* pred, file_data_t* file)
+{
+    return handle_contains(file, pred->needle, pred->needle_len);
+}
+
+bool run_exec(const predicate_t* pred, file_data_t* file)
+{
+    return handle_exec(pred->exec_argv, pred->exec_argc, file);
+}
+
+// With -exec-jobs the command runs in the background and the predicates
+// after it are run by whoever reaps it, so the file stops here.
+bool run_exec_job(const predicate_t* pred, file_data_t* file)
+{
+    char** filled_argv = populate_command(pred->exec_argv, pred->exec_argc, file);
+    start_exec_job(filled_argv, file, pred - program + 1);
+    free_command(filled_argv);
+    return false;
+}
+
+// -exec ... + is always true, failures only show in the exit status.
+bool run_exec_batched(const predicate_t* pred, file_data_t* file)
+{
+    add_to_exec_batch(pred->batch, file);
+    return true;
+}
+
+// -duplicates is always true, the duplicates are reported after the walk.
+bool run_duplicates(const predicate_t* pred, file_data_t* file)
+{
+    add_to_dup_set(pred->dups, file);
+    return true;
+}
+
+// -prune is always true, the walk checks pruned once the program is done.
+bool run_prune(const predicate_t* pred, file_data_t* file)
+{
+    (void) pred;
+    file->pruned = true;
+    return true;
+}
+
+bool run_print(const predicate_t* pred, file_data_t* file)
+{
+    print_match(file, pred->terminator);
+    return true;
+}
+
+bool run_print_pattern(const predicate_t* pred, file_data_t* file)
+{
+    (void) pred;
+    const char* pattern = file->matched_pattern != NULL ? file->matched_pattern : "";
+    out_write(pattern, strlen(pattern));
+    out_write("\t", 1);
+    print_match(file, '\n');
+    return true;
+}
+
+/*
+    Appends a predicate to the program and returns it so the caller can
+    bind its argument.
+*/
+predicate_t* add_predicate(bool (*run)(const predicate_t*, file_data_t*), int cost, bool has_side_effects)
+{
+    program = (predicate_t*) checked_realloc(program, (program_len + 1) * sizeof(predicate_t));
+    predicate_t* pred = &program[program_len];
+    memset(pred, 0, sizeof(predicate_t));
+    pred->run = run;
+    pred->cost = cost;
+    pred->has_side_effects = has_side_effects;
+    program_len++;
+    return pred;
+}
+
+/*
+    Finishes the program once all arguments are parsed. Between two actions
+    the tests are sorted cheapest first, which can not change the result
+    since they are all evaluated together and have no side effects. Actions
+    keep their place, so -exec and -print still happen in the order given.
+    If there is no action at all the file is printed, as find does, which
+    with -o means at the end of every alternative. -prune is not an action.
+    With -exec-jobs, -exec ... ; commands are started in the background.
+*/
+void compile_program()
+{
+    bool has_action = false;
+    bool has_prune = false;
+    int num_alternatives = program_len > 0 ? program[program_len - 1].alternative + 1 : 1;
+    for(int i = 0; i < program_len; i++)
+    {
+        has_action = has_action || (program[i].has_side_effects && program[i].run != run_prune);
+        has_prune = has_prune || program[i].run == run_prune;
+        program_needs_stat = program_needs_stat || program[i].cost == COST_STAT;
+        if(program[i].run == run_time && program[i].time_field != MODIFY_TIME)
+        {
+            program_needs_atime_ctime = true;
+        }
+    }
+    // A command in the background ends the program for the file until it
+    // is reaped, too late for -prune and for trying the next alternative.
+    for(int i = 0; i < program_len && max_exec_jobs > 0 && num_alternatives == 1 && !has_prune; i++)
+    {
+        if(program[i].run == run_exec)
+        {
+            program[i].run = run_exec_job;
+        }
+    }
+    for(int alternative = 0; alternative < num_alternatives && !has_action; alternative++)
+    {
+        predicate_t* print = add_predicate(run_print, COST_ACTION, true);
+        print->terminator = '\n';
+        print->name = "-print";
+        print->alternative = alternative;
+        predicate_t pred = *print;
+        int end = program_len - 1;
+        while(end > 0 && program[end - 1].alternative > alternative)
+        {
+            program[end] = program[end - 1];
+            end--;
+        }
+        program[end] = pred;
+    }
+
+    // Stable insertion sort within each run of side effect free tests.
+    for(int i = 1; i < program_len; i++)
+    {
+        predicate_t pred = program[i];
+        if(pred.has_side_effects)
+        {
+            continue;
+        }
+        int j = i - 1;
+        while(j >= 0 && !program[j].has_side_effects && program[j].alternative == pred.alternative
+              && program[j].cost > pred.cost)
+        {
+            program[j + 1] = program[j];
+            j--;
+        }
+        program[j + 1] = pred;
+    }
+    for(int i = program_len - 1; i >= 0; i--)
+    {
+        bool last = i + 1 == program_len || program[i + 1].alternative != program[i].alternative;
+        program[i].alternative_end = last ? i + 1 : program[i + 1].alternative_end;
+    }
+
+#ifdef USE_STATX
+    // The walk itself needs the type and inode, the index and the tree of
+    // -watch keep everything.
+    if(index_build_path == NULL && watch_socket == NULL)
+    {
+        const unsigned int TIME_MASKS[] = {
+            [ACCESS_TIME] = STATX_ATIME, [CHANGE_TIME] = STATX_CTIME, [MODIFY_TIME] = STATX_MTIME
+        };
+        stat_mask = STATX_TYPE | STATX_MODE | STATX_INO;
+        for(int i = 0; i < program_len; i++)
+        {
+            if(program[i].run == run_time)
+            {
+                stat_mask |= TIME_MASKS[program[i].time_field];
+            }
+            if(program[i].run == run_duplicates)
+            {
+                stat_mask |= STATX_SIZE;
+            }
+        }
+    }
+#endif
+}
+
+/*
+    Runs the commands of all -exec ... + predicates on the paths they
+    still hold. Called once the walk is over.
+*/
+void flush_exec_batches()
+{
+    for(int i = 0; i < program_len; i++)
+    {
+        if(program[i].batch != NULL)
+        {
+            pthread_mutex_lock(&program[i].batch->lock);
+            run_exec_batch(program[i].batch);
+            pthread_mutex_unlock(&program[i].batch->lock);
+        }
+    }
+}
+
+/*
+    Reports the duplicates found by all -duplicates predicates. Called once
+    the walk is over.
+*/
+void report_duplicates()
+{
+    for(int i = 0; i < program_len; i++)
+    {
+        if(program[i].dups != NULL)
+        {
+            report_dup_set(program[i].dups);
+        }
+    }
+}
+
+/*
+    Frees the program and the arguments bound to it.
+*/
+void free_program()
+{
+    for(int i = 0; i < program_len; i++)
+    {
+        free(program[i].modes);
+        free_name_matcher(program[i].matcher);
+        free_name_set(program[i].name_set);
+        free_path_regex(program[i].regex);
+        // The strings of exec_argv belong to argv.
+        free(program[i].exec_argv);
+        if(program[i].batch != NULL)
+        {
+            pthread_mutex_destroy(&program[i].batch->lock);
+            free(program[i].batch->argv);
+            arena_free(&program[i].batch->paths);
+            free(program[i].batch);
+        }
+        if(program[i].dups != NULL)
+        {
+            pthread_mutex_destroy(&program[i].dups->lock);
+            free(program[i].dups->files);
+            arena_free(&program[i].dups->paths);
+            free(program[i].dups);
+        }
+    }
+    free(program);
+}
+
+void handle_file(file_data_t* file);
+
+/*
+    Returns true if the walk goes below dir once handle_file is done with
+    it, which it does unless -prune or -maxdepth say otherwise.
+*/
+static inline bool may_descend(const file_data_t* dir)
+{
+    return !dir->pruned && dir->depth != max_depth;
+}
+
+/*
+    The header of an index written by -index-build. It is followed by
+    num_entries index_entry_t, num_dirs index_dir_record_t and then by
+    the null terminated names the entries point into. Integers are stored
+    in the byte order of the machine that wrote the index.
+*/
+typedef struct
+{
+    char magic[8];
+    uint64_t num_entries;
+    uint64_t num_dirs;
+    uint64_t names_size;
+    uint64_t flags;
+} index_header_t;
+
+/*
+    A file in an index. Entries are stored in the order the walk found
+    them, so every directory comes before the files in it.
+*/
+typedef struct index_entry
+{
+    // Where the name starts in the names of the index. Start points are
+    // stored with the path given for them.
+    uint64_t name_offset;
+    // In nanoseconds, so -newer compares as precisely as it does on disk.
+    int64_t mtime;
+    int64_t size;
+    // The entry of the directory containing this one, or
+    // INDEX_NO_PARENT for start points.
+    uint32_t parent;
+    // The S_IFMT bits of the mode.
+    uint32_t type;
+} index_entry_t;
+
+/*
+    What -index-update needs to know about a directory of an index to
+    tell if its listing can be reused. Sorted by entry.
+*/
+typedef struct
+{
+    uint32_t entry;
+    // The entry after the last one below the directory.
+    uint32_t end;
+    uint64_t dev;
+    uint64_t ino;
+    // In nanoseconds, any change to the listing updates both.
+    int64_t mtime;
+    int64_t ctime;
+} index_dir_record_t;
+
+const char INDEX_MAGIC[8] = "MYFIND\0\3";
+const uint32_t INDEX_NO_PARENT = UINT32_MAX;
+// Set in the flags of an index built with -L.
+const uint64_t INDEX_FOLLOW = 1;
+
+/*
+    A directory whose entries are still being written or read, with the
+    length of its path followed by a slash.
+*/
+typedef struct
+{
+    uint32_t entry;
+    size_t dir_path_len;
+    // The record written for the directory once all its entries were.
+    index_dir_record_t record;
+} index_dir_t;
+
+/*
+    The state of -index-build. Entries are written to the index as they
+    are found and names to a temporary file that is appended at the end,
+    so memory only grows with the number of directories.
+*/
+typedef struct
+{
+    char* path;
+    char* tmp_path;
+    FILE* entries;
+    FILE* names;
+    uint64_t num_entries;
+    uint64_t names_size;
+    // The directories containing the entry written last.
+    index_dir_t* dirs;
+    int num_dirs;
+    int dirs_cap;
+    // The records of the directories that are done.
+    index_dir_record_t* records;
+    size_t num_records;
+    size_t records_cap;
+} index_builder_t;
+
+/*
+    An index mapped into memory.
+*/
+typedef struct
+{
+    const index_header_t* header;
+    size_t size;
+    const index_entry_t* entries;
+    const index_dir_record_t* dirs;
+    const char* names;
+} index_map_t;
+
+// The index being written for -index-build, NULL otherwise.
+index_builder_t* index_builder = NULL;
+// For -index-update, the previous index whose listings are reused.
+index_map_t index_cache = { NULL, 0, NULL, NULL, NULL };
+// Indexes of the directories of index_cache by (dev, ino), -1 if free.
+int64_t* index_cache_table = NULL;
+size_t index_cache_mask = 0;
+
+/*
+    Maps the index at path into map. Returns false if there is no file at
+    path and may_be_missing is set, any other problem is fatal.
+*/
+bool map_index(const char* path, index_map_t* map, bool may_be_missing)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat statbuffer;
+    if(fd == -1 && errno == ENOENT && may_be_missing)
+    {
+        return false;
+    }
+    if(fd == -1 || fstat(fd, &statbuffer) == -1)
+    {
+        printf("find: ‘%s’: %s\n", path, strerror(errno));
+        exit(1);
+    }
+
+    // Check the sizes in the header before trusting any offset.
+    size_t size = statbuffer.st_size;
+    const index_header_t* header = NULL;
+    if(size >= sizeof(index_header_t))
+    {
+        header = (const index_header_t*) mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if(header == MAP_FAILED)
+    {
+        printf("find: ‘%s’: %s\n", path, strerror(errno));
+        exit(1);
+    }
+    size_t tables_size = size - sizeof(index_header_t);
+    if(header == NULL || memcmp(header->magic, INDEX_MAGIC, sizeof(header->magic)) != 0
+       || header->num_entries >= INDEX_NO_PARENT || header->num_dirs > header->num_entries
+       || header->num_entries * sizeof(index_entry_t) + header->num_dirs * sizeof(index_dir_record_t) > tables_size
+       || header->names_size != tables_size - header->num_entries * sizeof(index_entry_t)
+                                - header->num_dirs * sizeof(index_dir_record_t)
+       || (header->names_size > 0 && ((const char*) header)[size - 1] != '\0'))
+    {
+        printf("find: ‘%s’: not an index built by -index-build\n", path);
+        exit(1);
+    }
+
+    map->header = header;
+    map->size = size;
+    map->entries = (const index_entry_t*) (header + 1);
+    map->dirs = (const index_dir_record_t*) (map->entries + header->num_entries);
+    map->names = (const char*) (map->dirs + header->num_dirs);
+    return true;
+}
+
+/*
+    Writes size bytes to stream, which is part of the index being built.
+*/
+void index_write(const void* data, size_t size, FILE* stream)
+{
+    if(fwrite(data, 1, size, stream) != size)
+    {
+        printf("find: ‘%s’: %s\n", index_builder->path, strerror(errno));
+        exit(1);
+    }
+}
+
+/*
+    Starts writing an index to path. It is written next to path and
+    renamed over it once it is complete, so an index being queried is
+    never seen half written.
+*/
+void start_index_build(char* path)
+{
+    index_builder = (index_builder_t*) checked_alloc(1, sizeof(index_builder_t));
+    index_builder->path = path;
+    index_builder->tmp_path = (char*) checked_alloc(strlen(path) + 5, sizeof(char));
+    strcat(strcpy(index_builder->tmp_path, path), ".tmp");
+    index_builder->entries = fopen(index_builder->tmp_path, "wb");
+    index_builder->names = tmpfile();
+    if(index_builder->entries == NULL || index_builder->names == NULL)
+    {
+        printf("find: ‘%s’: %s\n", path, strerror(errno));
+        exit(1);
+    }
+    // The header is written again once the counts are known.
+    index_header_t header = { .num_entries = 0 };
+    index_write(&header, sizeof(header), index_builder->entries);
+}
+
+/*
+    Returns the time in ts in nanoseconds.
+*/
+int64_t timespec_to_ns(struct timespec ts)
+{
+    return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+    Returns the time ns, in nanoseconds, as a timespec.
+*/
+struct timespec ns_to_timespec(int64_t ns)
+{
+    struct timespec ts = { .tv_sec = ns / 1000000000, .tv_nsec = ns % 1000000000 };
+    // Times before 1970 have to round down.
+    if(ts.tv_nsec < 0)
+    {
+        ts.tv_sec--;
+        ts.tv_nsec += 1000000000;
+    }
+    return ts;
+}
+
+/*
+    Marks the directory written last as done, all entries below it come
+    before end.
+*/
+void pop_index_dir(index_builder_t* builder, uint32_t end)
+{
+    if(builder->num_records == builder->records_cap)
+    {
+        builder->records_cap = builder->records_cap == 0 ? 64 : builder->records_cap * 2;
+        builder->records = (index_dir_record_t*) checked_realloc(builder->records,
+                                                                 builder->records_cap * sizeof(index_dir_record_t));
+    }
+    builder->num_dirs--;
+    index_dir_record_t* record = &builder->records[builder->num_records++];
+    *record = builder->dirs[builder->num_dirs].record;
+    record->end = end;
+}
+
+/*
+    Adds file to the index. Files have to come in the order of a depth
+    first walk, which is how their directory is found again. With
+    -index-update, files of reused listings keep their previous mtime and
+    size unless something stat'ed them.
+*/
+void add_to_index(file_data_t* file)
+{
+    index_builder_t* builder = index_builder;
+    if(builder->num_entries == INDEX_NO_PARENT)
+    {
+        printf("find: ‘%s’: too many files for an index\n", builder->path);
+        exit(1);
+    }
+
+    index_entry_t entry = {
+        .name_offset = builder->names_size,
+        .parent = INDEX_NO_PARENT,
+        .type = file_type(file)
+    };
+    if(file->cached != NULL && !file->have_stat && entry.type != S_IFDIR)
+    {
+        entry.mtime = file->cached->mtime;
+        entry.size = file->cached->size;
+    }
+    else if(ensure_stat(file))
+    {
+        entry.mtime = timespec_to_ns(file->statbuffer.st_mtim);
+        entry.size = file->statbuffer.st_size;
+    }
+
+    // Leave the directories the walk has finished, start points are
+    // not in any.
+    const char* name = file->file_name;
+    while(builder->num_dirs > 0
+          && (file->is_base_dir || builder->dirs[builder->num_dirs - 1].dir_path_len != file->dir_path_len))
+    {
+        pop_index_dir(builder, builder->num_entries);
+    }
+    if(file->is_base_dir)
+    {
+        name = file->path;
+    }
+    else if(builder->num_dirs > 0)
+    {
+        entry.parent = builder->dirs[builder->num_dirs - 1].entry;
+    }
+
+    size_t name_len = strlen(name);
+    index_write(name, name_len + 1, builder->names);
+    builder->names_size += name_len + 1;
+    index_write(&entry, sizeof(entry), builder->entries);
+
+    if(entry.type == S_IFDIR)
+    {
+        if(builder->num_dirs == builder->dirs_cap)
+        {
+            builder->dirs_cap = builder->dirs_cap == 0 ? 16 : builder->dirs_cap * 2;
+            builder->dirs = (index_dir_t*) checked_realloc(builder->dirs, builder->dirs_cap * sizeof(index_dir_t));
+        }
+        // The entries of the directory are found with its path followed
+        // by a slash, start points may already end in one.
+        size_t dir_path_len = file->is_base_dir ? name_len : file->dir_path_len + name_len;
+        if(!file->is_base_dir || name_len == 0 || name[name_len - 1] != '/')
+        {
+            dir_path_len++;
+        }
+        index_dir_t* dir = &builder->dirs[builder->num_dirs++];
+        dir->entry = builder->num_entries;
+        dir->dir_path_len = dir_path_len;
+        memset(&dir->record, 0, sizeof(dir->record));
+        dir->record.entry = builder->num_entries;
+        if(file->have_stat)
+        {
+            dir->record.dev = file->statbuffer.st_dev;
+            dir->record.ino = file->statbuffer.st_ino;
+            dir->record.mtime = timespec_to_ns(file->statbuffer.st_mtim);
+            dir->record.ctime = timespec_to_ns(file->statbuffer.st_ctim);
+        }
+    }
+    builder->num_entries++;
+}
+
+/*
+    Orders directory records by their entry.
+*/
+int compare_dir_records(const void* a, const void* b)
+{
+    uint32_t x = ((const index_dir_record_t*) a)->entry;
+    uint32_t y = ((const index_dir_record_t*) b)->entry;
+    return (x > y) - (x < y);
+}
+
+/*
+    Appends the directory records and the names to the index, fills in
+    its header and puts it in place of the old one.
+*/
+void finish_index_build()
+{
+    index_builder_t* builder = index_builder;
+    while(builder->num_dirs > 0)
+    {
+        pop_index_dir(builder, builder->num_entries);
+    }
+    qsort(builder->records, builder->num_records, sizeof(index_dir_record_t), compare_dir_records);
+    index_write(builder->records, builder->num_records * sizeof(index_dir_record_t), builder->entries);
+
+    char buffer[64 * 1024];
+    size_t count;
+    rewind(builder->names);
+    while((count = fread(buffer, 1, sizeof(buffer), builder->names)) > 0)
+    {
+        index_write(buffer, count, builder->entries);
+    }
+
+    index_header_t header = {
+        .num_entries = builder->num_entries,
+        .num_dirs = builder->num_records,
+        .names_size = builder->names_size,
+        .flags = follow_symbolic ? INDEX_FOLLOW : 0
+    };
+    memcpy(header.magic, INDEX_MAGIC, sizeof(header.magic));
+    if(ferror(builder->names) || fseek(builder->entries, 0, SEEK_SET) != 0)
+    {
+        printf("find: ‘%s’: %s\n", builder->path, strerror(errno));
+        exit(1);
+    }
+    index_write(&header, sizeof(header), builder->entries);
+    if(fclose(builder->entries) != 0 || rename(builder->tmp_path, builder->path) != 0)
+    {
+        printf("find: ‘%s’: %s\n", builder->path, strerror(errno));
+        exit(1);
+    }
+    fclose(builder->names);
+
+    free(builder->tmp_path);
+    free(builder->dirs);
+    free(builder->records);
+    free(builder);
+    index_builder = NULL;
+}
+
+/*
+    Hashes the identity of a directory for index_cache_table.
+*/
+size_t hash_dev_ino(uint64_t dev, uint64_t ino)
+{
+    uint64_t hash = (dev * 0x9e3779b97f4a7c15ull) ^ ino;
+    hash ^= hash >> 29;
+    hash *= 0xbf58476d1ce4e5b9ull;
+    return hash ^ (hash >> 32);
+}
+
+/*
+    Loads the index at path for -index-update, if there is one and it was
+    built with the same -L. Its directories are looked up by (dev, ino),
+    so a listing is reused even if the directory was moved.
+*/
+void load_index_cache(const char* path)
+{
+    if(!map_index(path, &index_cache, true))
+    {
+        return;
+    }
+    const index_header_t* header = index_cache.header;
+    if(header->flags != (follow_symbolic ? INDEX_FOLLOW : 0))
+    {
+        munmap((void*) header, index_cache.size);
+        index_cache.header = NULL;
+        return;
+    }
+
+    size_t table_size = 16;
+    while(table_size < header->num_dirs * 2)
+    {
+        table_size *= 2;
+    }
+    index_cache_mask = table_size - 1;
+    index_cache_table = (int64_t*) checked_alloc(table_size, sizeof(int64_t));
+    memset(index_cache_table, -1, table_size * sizeof(int64_t));
+    for(uint64_t i = 0; i < header->num_dirs; i++)
+    {
+        const index_dir_record_t* record = &index_cache.dirs[i];
+        if(record->entry >= header->num_entries || record->end > header->num_entries || record->end <= record->entry)
+        {
+            printf("find: ‘%s’: not an index built by -index-build\n", path);
+            exit(1);
+        }
+        size_t slot = hash_dev_ino(record->dev, record->ino) & index_cache_mask;
+        while(index_cache_table[slot] != -1)
+        {
+            slot = (slot + 1) & index_cache_mask;
+        }
+        index_cache_table[slot] = i;
+    }
+}
+
+/*
+    Returns the record of the directory with the stat info in statbuffer
+    in index_cache if its listing did not change since, NULL otherwise.
+*/
+const index_dir_record_t* find_cached_dir(const struct stat* statbuffer)
+{
+    size_t slot = hash_dev_ino(statbuffer->st_dev, statbuffer->st_ino) & index_cache_mask;
+    for(; index_cache_table[slot] != -1; slot = (slot + 1) & index_cache_mask)
+    {
+        const index_dir_record_t* record = &index_cache.dirs[index_cache_table[slot]];
+        if(record->dev == statbuffer->st_dev && record->ino == statbuffer->st_ino)
+        {
+            bool unchanged = record->mtime == timespec_to_ns(statbuffer->st_mtim)
+                             && record->ctime == timespec_to_ns(statbuffer->st_ctim);
+            return unchanged ? record : NULL;
+        }
+    }
+    return NULL;
+}
+
+/*
+    Returns the entry after the last one below the entry at index in map,
+    which is the next one unless it is a directory.
+*/
+uint32_t index_entry_end(const index_map_t* map, uint32_t index)
+{
+    if(map->entries[index].type != S_IFDIR)
+    {
+        return index + 1;
+    }
+    size_t low = 0;
+    size_t high = map->header->num_dirs;
+    while(low < high)
+    {
+        size_t middle = low + (high - low) / 2;
+        if(map->dirs[middle].entry < index)
+        {
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+    if(low < map->header->num_dirs && map->dirs[low].entry == index
+       && map->dirs[low].end > index)
+    {
+        return map->dirs[low].end;
+    }
+    return index + 1;
+}
+
+/*
+    Unmaps index_cache.
+*/
+void free_index_cache()
+{
+    if(index_cache.header != NULL)
+    {
+        munmap((void*) index_cache.header, index_cache.size);
+    }
+    free(index_cache_table);
+}
+
+/*
+    Runs the program on every file in the index at path, in the order
+    they were found when it was built. The file is mapped, so nothing
+    but the index is read and no file is stat'ed.
+*/
+void run_index(const char* path)
+{
+    index_map_t map;
+    map_index(path, &map, false);
+    // Symbolic links are followed or not while the index is built.
+    if(map.header->flags != (follow_symbolic ? INDEX_FOLLOW : 0))
+    {
+        printf("find: ‘%s’: the index was built %s -L\n", path, follow_symbolic ? "without" : "with");
+        exit(1);
+    }
+    madvise((void*) map.header, map.size, MADV_SEQUENTIAL);
+
+    index_dir_t* dirs = NULL;
+    int num_dirs = 0;
+    int dirs_cap = 0;
+    for(uint32_t i = 0; i < map.header->num_entries; i++)
+    {
+        const index_entry_t* entry = &map.entries[i];
+        // Leave the directories whose entries all came already.
+        while(num_dirs > 0 && dirs[num_dirs - 1].entry != entry->parent)
+        {
+            num_dirs--;
+        }
+        if(entry->name_offset >= map.header->names_size || (entry->parent != INDEX_NO_PARENT && num_dirs == 0))
+        {
+            printf("find: ‘%s’: not an index built by -index-build\n", path);
+            exit(1);
+        }
+
+        file_data_t file = {
+            .file_name = (char*) map.names + entry->name_offset,
+            .have_stat = true,
+            .d_type = DT_UNKNOWN,
+            .parent_fd = AT_FDCWD,
+            .is_base_dir = entry->parent == INDEX_NO_PARENT,
+            .depth = num_dirs
+        };
+        file.statbuffer.st_mode = entry->type;
+        file.statbuffer.st_mtim = ns_to_timespec(entry->mtime);
+        file.statbuffer.st_size = entry->size;
+        if(file.is_base_dir)
+        {
+            path_truncate(&walk_path, 0);
+        }
+        else
+        {
+            file.dir_path_len = dirs[num_dirs - 1].dir_path_len;
+        }
+
+        if(entry->type != S_IFDIR)
+        {
+            handle_file(&file);
+            continue;
+        }
+        // Build the path of directories right away, their entries are
+        // found behind it.
+        path_truncate(&walk_path, file.dir_path_len);
+        path_append(&walk_path, file.file_name, strlen(file.file_name));
+        if(!file.is_base_dir)
+        {
+            path_append(&walk_path, "/", 1);
+        }
+        file.path = walk_path.text;
+        handle_file(&file);
+        if(!may_descend(&file))
+        {
+            // Skip the entries below, the loop goes on after them.
+            i = index_entry_end(&map, i) - 1;
+            continue;
+        }
+        if(walk_path.text[walk_path.len - 1] != '/')
+        {
+            path_append(&walk_path, "/", 1);
+        }
+
+        if(num_dirs == dirs_cap)
+        {
+            dirs_cap = dirs_cap == 0 ? 16 : dirs_cap * 2;
+            dirs = (index_dir_t*) checked_realloc(dirs, dirs_cap * sizeof(index_dir_t));
+        }
+        dirs[num_dirs].entry = i;
+        dirs[num_dirs].dir_path_len = walk_path.len;
+        num_dirs++;
+    }
+
+    free(dirs);
+    munmap((void*) map.header, map.size);
+}
+
+#ifdef USE_INOTIFY
+/*
+    A file in the tree kept by -watch. Children are kept in the order the
+    directory listed them, so a query prints what a walk would.
+*/
+typedef struct
+{
+    // Start points are stored with the path given for them.
+    char* name;
+    // The S_IFMT bits of the mode.
+    mode_t type;
+    // In nanoseconds.
+    int64_t mtime;
+    off_t size;
+    // -1 for start points and free nodes.
+    int parent;
+    int* children;
+    int num_children;
+    int children_cap;
+    // The inotify watch of a directory, -1 if it has none.
+    int wd;
+    // Why the directory can not be read, 0 if it can. Printed where a
+    // walk would fail to open it.
+    int error;
+    bool in_use;
+    // Set while the directory waits to be listed again.
+    bool dirty;
+} watch_node_t;
+
+// All nodes of the tree, free ones are chained through parent.
+watch_node_t* watch_nodes = NULL;
+int watch_nodes_cap = 0;
+int free_watch_nodes = -1;
+// The start points that are directories, in the order they were given.
+int* watch_roots = NULL;
+int num_watch_roots = 0;
+// Maps inotify watches to their directory, -1 if unused.
+int* watch_wds = NULL;
+int watch_wds_cap = 0;
+int inotify_fd = -1;
+// Set while the tree is kept up to date, cleared once it grows past
+// -watch-mem and queries have to walk instead.
+bool watch_tree_valid = false;
+// Roughly the memory used by the tree.
+size_t watch_mem = 0;
+// Directories with changed listings, to refresh after a batch of events.
+int* dirty_dirs = NULL;
+int num_dirty_dirs = 0;
+int dirty_dirs_cap = 0;
+// The directories containing the file added last by the initial walk.
+index_dir_t* watch_build_dirs = NULL;
+int num_watch_build_dirs = 0;
+int watch_build_dirs_cap = 0;
+
+const uint32_t WATCH_MASK = IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB | IN_MODIFY
+                            | IN_CLOSE_WRITE | IN_ONLYDIR;
+// Events that change the listing of a directory.
+const uint32_t WATCH_LISTING_MASK = IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO;
+
+/*
+    Adds node as the last child of the directory parent.
+*/
+void add_watch_child(int parent, int node)
+{
+    watch_node_t* dir = &watch_nodes[parent];
+    if(dir->num_children == dir->children_cap)
+    {
+        watch_mem += dir->children_cap == 0 ? 4 * sizeof(int) : dir->children_cap * sizeof(int);
+        dir->children_cap = dir->children_cap == 0 ? 4 : dir->children_cap * 2;
+        dir->children = (int*) checked_realloc(dir->children, dir->children_cap * sizeof(int));
+    }
+    dir->children[dir->num_children++] = node;
+    watch_nodes[node].parent = parent;
+}
+
+/*
+    Returns a new node named by the first len bytes of name in parent.
+*/
+int new_watch_node(const char* name, size_t len, int parent)
+{
+    if(free_watch_nodes == -1)
+    {
+        int old_cap = watch_nodes_cap;
+        watch_nodes_cap = watch_nodes_cap == 0 ? 1024 : watch_nodes_cap * 2;
+        watch_nodes = (watch_node_t*) checked_realloc(watch_nodes, watch_nodes_cap * sizeof(watch_node_t));
+        watch_mem += (watch_nodes_cap - old_cap) * sizeof(watch_node_t);
+        for(int i = watch_nodes_cap - 1; i >= old_cap; i--)
+        {
+            watch_nodes[i].in_use = false;
+            watch_nodes[i].parent = free_watch_nodes;
+            free_watch_nodes = i;
+        }
+    }
+    int node = free_watch_nodes;
+    free_watch_nodes = watch_nodes[node].parent;
+
+    watch_node_t* entry = &watch_nodes[node];
+    memset(entry, 0, sizeof(watch_node_t));
+    entry->name = strndup(name, len);
+    if(entry->name == NULL)
+    {
+        printf("find: insufficient memory\n");
+        exit(1);
+    }
+    watch_mem += len + 1;
+    entry->parent = -1;
+    entry->wd = -1;
+    entry->in_use = true;
+    if(parent != -1)
+    {
+        add_watch_child(parent, node);
+    }
+    return node;
+}
+
+/*
+    Copies the type, mtime and size of file into node.
+*/
+void set_watch_node_stat(int node, file_data_t* file)
+{
+    watch_nodes[node].type = file_type(file);
+    if(ensure_stat(file))
+    {
+        watch_nodes[node].mtime = timespec_to_ns(file->statbuffer.st_mtim);
+        watch_nodes[node].size = file->statbuffer.st_size;
+    }
+}
+
+/*
+    Watches the directory node, whose path is in walk_path.
+*/
+void add_watch(int node)
+{
+    int wd = inotify_add_watch(inotify_fd, walk_path.text, WATCH_MASK | (follow_symbolic ? 0 : IN_DONT_FOLLOW));
+    if(wd == -1)
+    {
+        watch_nodes[node].error = errno;
+        if(errno != EACCES)
+        {
+            out_printf("find: ‘%s’: can not watch: %s\n", walk_path.text, strerror(errno));
+        }
+        return;
+    }
+    if(wd >= watch_wds_cap)
+    {
+        int old_cap = watch_wds_cap;
+        watch_wds_cap = watch_wds_cap == 0 ? 1024 : watch_wds_cap;
+        while(wd >= watch_wds_cap)
+        {
+            watch_wds_cap *= 2;
+        }
+        watch_wds = (int*) checked_realloc(watch_wds, watch_wds_cap * sizeof(int));
+        memset(watch_wds + old_cap, -1, (watch_wds_cap - old_cap) * sizeof(int));
+    }
+    watch_wds[wd] = node;
+    watch_nodes[node].wd = wd;
+    watch_nodes[node].error = 0;
+}
+
+/*
+    Frees node and everything below it.
+*/
+void free_watch_subtree(int node)
+{
+    int* stack = (int*) checked_alloc(1, sizeof(int));
+    int stack_len = 1;
+    int stack_cap = 1;
+    stack[0] = node;
+    while(stack_len > 0)
+    {
+        watch_node_t* entry = &watch_nodes[stack[--stack_len]];
+        if(stack_len + entry->num_children > stack_cap)
+        {
+            stack_cap = (stack_len + entry->num_children) * 2;
+            stack = (int*) checked_realloc(stack, stack_cap * sizeof(int));
+        }
+        if(entry->num_children > 0)
+        {
+            memcpy(stack + stack_len, entry->children, entry->num_children * sizeof(int));
+            stack_len += entry->num_children;
+        }
+
+        // A directory moved elsewhere in the tree is watched by the
+        // same wd, which may already belong to its new node.
+        if(entry->wd != -1 && watch_wds[entry->wd] == entry - watch_nodes)
+        {
+            inotify_rm_watch(inotify_fd, entry->wd);
+            watch_wds[entry->wd] = -1;
+        }
+        watch_mem -= strlen(entry->name) + 1 + entry->children_cap * sizeof(int);
+        free(entry->name);
+        free(entry->children);
+        entry->in_use = false;
+        entry->dirty = false;
+        entry->parent = free_watch_nodes;
+        free_watch_nodes = entry - watch_nodes;
+    }
+    free(stack);
+}
+
+/*
+    Frees the whole tree and stops watching, queries walk the tree
+    from now on.
+*/
+void drop_watch_tree()
+{
+    for(int i = 0; i < watch_nodes_cap; i++)
+    {
+        if(watch_nodes[i].in_use)
+        {
+            free(watch_nodes[i].name);
+            free(watch_nodes[i].children);
+        }
+    }
+    free(watch_nodes);
+    free(watch_roots);
+    free(watch_wds);
+    free(dirty_dirs);
+    free(watch_build_dirs);
+    watch_nodes = NULL;
+    watch_roots = NULL;
+    watch_wds = NULL;
+    dirty_dirs = NULL;
+    watch_build_dirs = NULL;
+    if(inotify_fd != -1)
+    {
+        close(inotify_fd);
+        inotify_fd = -1;
+    }
+    watch_tree_valid = false;
+}
+
+/*
+    Drops the tree if it uses more than -watch-mem.
+*/
+void check_watch_mem()
+{
+    if(watch_tree_valid && watch_mem_limit > 0 && watch_mem > watch_mem_limit)
+    {
+        drop_watch_tree();
+        out_printf("find: the tree needs more than -watch-mem, queries walk instead\n");
+    }
+}
+
+/*
+    Adds file, found by the initial walk of -watch, to the tree. Files
+    have to come in the order of a depth first walk, the way
+    add_to_index finds their directory.
+*/
+void add_to_watch_tree(file_data_t* file)
+{
+    if(!watch_tree_valid)
+    {
+        return;
+    }
+    while(num_watch_build_dirs > 0
+          && (file->is_base_dir || watch_build_dirs[num_watch_build_dirs - 1].dir_path_len != file->dir_path_len))
+    {
+        num_watch_build_dirs--;
+    }
+
+    int node;
+    if(file->is_base_dir)
+    {
+        node = new_watch_node(file->path, strlen(file->path), -1);
+        watch_roots = (int*) checked_realloc(watch_roots, (num_watch_roots + 1) * sizeof(int));
+        watch_roots[num_watch_roots++] = node;
+    }
+    else
+    {
+        int parent = watch_build_dirs[num_watch_build_dirs - 1].entry;
+        node = new_watch_node(file->file_name, strlen(file->file_name), parent);
+    }
+    set_watch_node_stat(node, file);
+
+    if(watch_nodes[node].type == S_IFDIR)
+    {
+        // Directories come with their path in walk_path, start points
+        // may not end in a slash yet.
+        add_watch(node);
+        size_t dir_path_len = walk_path.len;
+        if(walk_path.text[dir_path_len - 1] != '/')
+        {
+            dir_path_len++;
+        }
+        if(num_watch_build_dirs == watch_build_dirs_cap)
+        {
+            watch_build_dirs_cap = watch_build_dirs_cap == 0 ? 16 : watch_build_dirs_cap * 2;
+            watch_build_dirs = (index_dir_t*) checked_realloc(watch_build_dirs,
+                                                              watch_build_dirs_cap * sizeof(index_dir_t));
+        }
+        watch_build_dirs[num_watch_build_dirs].entry = node;
+        watch_build_dirs[num_watch_build_dirs].dir_path_len = dir_path_len;
+        num_watch_build_dirs++;
+    }
+    check_watch_mem();
+}
+#endif
+
+/*
+    Checks if a file matches all the requirements specified by the options
+    then either executes a command on it or prints it out as required by the
+    specified options. The options were compiled into program by parse_args.
+*/
+void handle_file(file_data_t* file)
+{
+#ifdef USE_INOTIFY
+    // The initial walk of -watch only builds the tree.
+    if(watch_socket != NULL)
+    {
+        add_to_watch_tree(file);
+        return;
+    }
+#endif
+    if(file->depth < min_depth)
+    {
+        return;
+    }
+    if(index_builder == NULL || index_update)
+    {
+        run_program(file, 0);
+    }
+    // After the program, so a stat it needed is not done twice.
+    if(index_builder != NULL)
+    {
+        add_to_index(file);
+    }
+}
+
+/*
+    Runs the program like run_program and counts the evaluations,
+    rejections and time of each predicate for -stats.
+*/
+void run_program_with_stats(file_data_t* file, int first)
+{
+    stats_t* stats = &thread_stats;
+    if(stats->pred_evals == NULL)
+    {
+        stats->pred_evals = (uint64_t*) checked_alloc(program_len, sizeof(uint64_t));
+        stats->pred_rejects = (uint64_t*) checked_alloc(program_len, sizeof(uint64_t));
+        stats->pred_ns = (uint64_t*) checked_alloc(program_len, sizeof(uint64_t));
+    }
+    int i = first;
+    while(i < program_len)
+    {
+        uint64_t start = stats_now();
+        bool passed = program[i].run(&program[i], file);
+        stats->pred_evals[i]++;
+        stats->pred_ns[i] += stats_now() - start;
+        if(!passed)
+        {
+            // A background -exec only hands the file on to whoever reaps it.
+            stats->pred_rejects[i] += program[i].run != run_exec_job;
+            i = program[i].alternative_end;
+        }
+        else if(i + 1 == program[i].alternative_end)
+        {
+            return;
+        }
+        else
+        {
+            i++;
+        }
+    }
+}
+
+/*
+    Runs the program on file, starting with predicate first.
+*/
+void run_program(file_data_t* file, int first)
+{
+    if(collect_stats)
+    {
+        run_program_with_stats(file, first);
+        return;
+    }
+    int i = first;
+    while(i < program_len)
+    {
+        if(!program[i].run(&program[i], file))
+        {
+            // Go on with the next alternative, if there is one.
+            i = program[i].alternative_end;
+        }
+        else if(i + 1 == program[i].alternative_end)
+        {
+            return;
+        }
+        else
+        {
+            i++;
+        }
+    }
+}
+
+#if defined(__linux__) && defined(SYS_getdents64)
+#define USE_GETDENTS64 1
+
+/*
+    The layout of the records returned by the getdents64 system call.
+*/
+typedef struct
+{
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+} linux_dirent64_t;
+#endif
+
+/*
+    One entry of a directory, as returned by read_dir_batch. name points
+    into the reader's buffer and is only valid until the next batch.
+*/
+typedef struct
+{
+    const char* name;
+    ino_t ino;
+    unsigned char type;
+} dir_entry_t;
+
+/*
+    Reads the entries of an open directory in batches. On Linux entries
+    are read with getdents64 straight into buf, which is reused for every
+    directory read at the same depth, elsewhere readdir is used.
+*/
+typedef struct
+{
+    int fd;
+#ifdef USE_GETDENTS64
+    char* buf;
+#else
+    DIR* dir;
+#endif
+    dir_entry_t* entries;
+    int entries_cap;
+    // With -uring, the statx submitted for each entry of the batch and the
+    // index of the first entry not yet considered for submission.
+    stat_slot_t* slots;
+    int next_prefetch;
+    bool in_use;
+} dir_reader_t;
+
+// The readers of the current thread, there are never more than one per
+// open directory.
+_Thread_local dir_reader_t** dir_readers = NULL;
+_Thread_local int num_dir_readers = 0;
+
+/*
+    Returns a reader for the directory open on fd. The reader is owned by
+    the current thread until it is given back with close_dir_reader, its
+    buffer is then reused for the next directory.
+*/
+dir_reader_t* open_dir_reader(int fd)
+{
+    dir_reader_t* reader = NULL;
+    for(int i = 0; i < num_dir_readers && reader == NULL; i++)
+    {
+        if(!dir_readers[i]->in_use)
+        {
+            reader = dir_readers[i];
+        }
+    }
+    if(reader == NULL)
+    {
+        // The readers themselves never move, walk_dir holds on to them.
+        dir_readers = (dir_reader_t**) checked_realloc(dir_readers, (num_dir_readers + 1) * sizeof(dir_reader_t*));
+        dir_readers[num_dir_readers] = (dir_reader_t*) checked_alloc(1, sizeof(dir_reader_t));
+        reader = dir_readers[num_dir_readers++];
+    }
+    reader->in_use = true;
+    reader->fd = fd;
+#ifdef USE_GETDENTS64
+    if(reader->buf == NULL)
+    {
+        reader->buf = (char*) checked_alloc(dir_buf_size, sizeof(char));
+        // Every record is at least 20 bytes long, so this always fits a full batch.
+        reader->entries_cap = dir_buf_size / 20 + 1;
+        reader->entries = (dir_entry_t*) checked_alloc(reader->entries_cap, sizeof(dir_entry_t));
+        if(use_uring)
+        {
+            reader->slots = (stat_slot_t*) checked_alloc(reader->entries_cap, sizeof(stat_slot_t));
+        }
+    }
+#else
+    reader->dir = fdopendir(fd);
+    if(reader->dir == NULL)
+    {
+        close(fd);
+        reader->in_use = false;
+        return NULL;
+    }
+    if(reader->entries == NULL)
+    {
+        reader->entries_cap = 1;
+        reader->entries = (dir_entry_t*) checked_alloc(1, sizeof(dir_entry_t));
+    }
+#endif
+    return reader;
+}
+
+/*
+    Closes the directory of reader and makes the reader available again.
+*/
+void close_dir_reader(dir_reader_t* reader)
+{
+#ifdef USE_GETDENTS64
+    close(reader->fd);
+#else
+    closedir(reader->dir);
+#endif
+    reader->in_use = false;
+}
+
+/*
+    Reads the next batch of entries into reader->entries, skipping . and ..
+    Returns the number of entries read, 0 once the whole directory was read
+    and -1 with errno set if it could not be read.
+*/
+int read_dir_batch(dir_reader_t* reader)
+{
+    uint64_t start = stats_now();
+    int count = 0;
+#ifdef USE_GETDENTS64
+    while(count == 0)
+    {
+        long nread = syscall(SYS_getdents64, reader->fd, reader->buf, dir_buf_size);
+        if(nread < 0)
+        {
+            count = -1;
+        }
+        if(nread <= 0)
+        {
+            break;
+        }
+        for(long pos = 0; pos < nread;)
+        {
+            linux_dirent64_t* de = (linux_dirent64_t*) (reader->buf + pos);
+            pos += de->d_reclen;
+            if(strcmp(de->d_name, "..") == 0 || strcmp(de->d_name, ".") == 0)
+            {
+                continue;
+            }
+            reader->entries[count].name = de->d_name;
+            reader->entries[count].ino = de->d_ino;
+            reader->entries[count].type = de->d_type;
+            count++;
+        }
+    }
+#else
+    struct dirent* de;
+    // readdir only tells an error from the end by errno.
+    errno = 0;
+    while(count == 0 && (de = readdir(reader->dir)) != NULL)
+    {
+        if(strcmp(de->d_name, "..") != 0 && strcmp(de->d_name, ".") != 0)
+        {
+            reader->entries[0].name = de->d_name;
+            reader->entries[0].ino = de->d_ino;
+            reader->entries[0].type = de->d_type;
+            count = 1;
+        }
+    }
+    if(count == 0 && errno != 0)
+    {
+        count = -1;
+    }
+#endif
+    if(collect_stats)
+    {
+        int error = errno;
+        stats_record(&thread_stats.dir_reads, NULL, start);
+        thread_stats.entries_read += count > 0 ? count : 0;
+        errno = error;
+    }
+    return count;
+}
+
+/*
+    Frees the readers of the current thread.
+*/
+void free_dir_readers()
+{
+    for(int i = 0; i < num_dir_readers; i++)
+    {
+#ifdef USE_GETDENTS64
+        free(dir_readers[i]->buf);
+#endif
+        free(dir_readers[i]->entries);
+        free(dir_readers[i]->slots);
+        free(dir_readers[i]);
+    }
+    free(dir_readers);
+    dir_readers = NULL;
+    num_dir_readers = 0;
+}
+
+/*
+    Returns true if the query needs the stat info of a directory entry of
+    the given type, to evaluate a predicate or to tell if it is a directory.
+*/
+bool entry_needs_stat(unsigned char type)
+{
+    return program_needs_stat || type == DT_UNKNOWN || (type == DT_LNK && follow_symbolic);
+}
+
+/*
+    With -uring, submits a statx for every entry of the batch from
+    reader->next_prefetch on that needs one, as long as the ring has room.
+    walk_dir calls this before handling each entry, so the kernel works
+    ahead of the predicates.
+*/
+void prefetch_stats(dir_reader_t* reader, int count)
+{
+#ifdef USE_IO_URING
+    stat_ring_t* ring = get_stat_ring();
+    if(ring == NULL)
+    {
+        return;
+    }
+    int first = reader->next_prefetch;
+    for(; reader->next_prefetch < count; reader->next_prefetch++)
+    {
+        dir_entry_t* entry = &reader->entries[reader->next_prefetch];
+        stat_slot_t* slot = &reader->slots[reader->next_prefetch];
+        slot->submitted = false;
+        if(entry_needs_stat(entry->type) && !stat_ring_queue(ring, reader->fd, entry->name, slot))
+        {
+            break;
+        }
+    }
+    if(reader->next_prefetch > first)
+    {
+        stat_ring_enter(ring, false);
+    }
+#else
+    (void) reader;
+    (void) count;
+#endif
+}
+
+/*
+    Waits for every statx submitted for the current batch, as they point
+    into the buffer the next batch is read into.
+*/
+void finish_prefetch(dir_reader_t* reader)
+{
+#ifdef USE_IO_URING
+    for(int i = 0; i < reader->next_prefetch; i++)
+    {
+        if(reader->slots[i].submitted)
+        {
+            stat_ring_wait(stat_ring, &reader->slots[i]);
+        }
+    }
+#endif
+    reader->next_prefetch = 0;
+}
+
+/*
+    A directory the walk is below, with -L or -xdev.
+*/
+typedef struct
+{
+    dev_t dev;
+    ino_t ino;
+    // The length of its path as printed, which is a prefix of walk_path.
+    size_t path_len;
+} ancestor_t;
+
+// The ancestors of the directory the current thread is in, from the start
+// point down, and an open addressing hash set of them by (dev, ino). The
+// set holds the index in ancestors plus one, 0 for an empty slot.
+_Thread_local ancestor_t* ancestors = NULL;
+_Thread_local int num_ancestors = 0;
+_Thread_local int* ancestor_set = NULL;
+_Thread_local size_t ancestor_set_size = 0;
+
+/*
+    Returns the slot of ancestor_set where (dev, ino) is looked for first.
+*/
+size_t ancestor_home(dev_t dev, ino_t ino)
+{
+    uint64_t hash = ((uint64_t) ino ^ ((uint64_t) dev << 40)) * 0x9E3779B97F4A7C15ull;
+    return (size_t) (hash >> 32) & (ancestor_set_size - 1);
+}
+
+/*
+    Returns the slot of ancestor_set that holds (dev, ino), or the empty
+    slot where it would go.
+*/
+size_t find_ancestor_slot(dev_t dev, ino_t ino)
+{
+    size_t slot = ancestor_home(dev, ino);
+    while(ancestor_set[slot] != 0)
+    {
+        const ancestor_t* ancestor = &ancestors[ancestor_set[slot] - 1];
+        if(ancestor->dev == dev && ancestor->ino == ino)
+        {
+            break;
+        }
+        slot = (slot + 1) & (ancestor_set_size - 1);
+    }
+    return slot;
+}
+
+/*
+    Returns the index in ancestors of the directory (dev, ino), or -1 if
+    it is not an ancestor.
+*/
+int find_ancestor(dev_t dev, ino_t ino)
+{
+    if(num_ancestors == 0)
+    {
+        return -1;
+    }
+    return ancestor_set[find_ancestor_slot(dev, ino)] - 1;
+}
+
+/*
+    Adds the directory (dev, ino), whose path is path_len long, below the
+    last ancestor. The set is kept at most half full.
+*/
+void push_ancestor(dev_t dev, ino_t ino, size_t path_len)
+{
+    if(2 * (size_t) (num_ancestors + 1) > ancestor_set_size)
+    {
+        free(ancestor_set);
+        ancestor_set_size = ancestor_set_size == 0 ? 64 : ancestor_set_size * 2;
+        ancestor_set = (int*) checked_alloc(ancestor_set_size, sizeof(int));
+        ancestors = (ancestor_t*) checked_realloc(ancestors, ancestor_set_size / 2 * sizeof(ancestor_t));
+        for(int i = 0; i < num_ancestors; i++)
+        {
+            ancestor_set[find_ancestor_slot(ancestors[i].dev, ancestors[i].ino)] = i + 1;
+        }
+    }
+    ancestors[num_ancestors].dev = dev;
+    ancestors[num_ancestors].ino = ino;
+    ancestors[num_ancestors].path_len = path_len;
+    num_ancestors++;
+    ancestor_set[find_ancestor_slot(dev, ino)] = num_ancestors;
+}
+
+/*
+    Removes the last ancestor. Entries behind it in the set are moved back
+    into the hole unless that would put them before their home slot.
+*/
+void pop_ancestor()
+{
+    num_ancestors--;
+    size_t mask = ancestor_set_size - 1;
+    size_t hole = find_ancestor_slot(ancestors[num_ancestors].dev, ancestors[num_ancestors].ino);
+    ancestor_set[hole] = 0;
+    for(size_t slot = (hole + 1) & mask; ancestor_set[slot] != 0; slot = (slot + 1) & mask)
+    {
+        const ancestor_t* ancestor = &ancestors[ancestor_set[slot] - 1];
+        size_t home = ancestor_home(ancestor->dev, ancestor->ino);
+        if(((slot - home) & mask) >= ((slot - hole) & mask))
+        {
+            ancestor_set[hole] = ancestor_set[slot];
+            ancestor_set[slot] = 0;
+            hole = slot;
+        }
+    }
+}
+
+/*
+    Frees the ancestors of the current thread.
+*/
+void free_ancestors()
+{
+    free(ancestors);
+    free(ancestor_set);
+    ancestors = NULL;
+    ancestor_set = NULL;
+    ancestor_set_size = 0;
+    num_ancestors = 0;
+}
+
+/*
+    Reports that the directory file is the same as the ancestor at index,
+    as find does, which leaves it out of the walk.
+*/
+void print_loop_error(file_data_t* file, int index)
+{
+    const char* path = file_path(file);
+    out_printf("find: File system loop detected; ‘%.*s’ is part of the same file system loop as ‘%.*s’.\n",
+               (int) printed_length(file), path, (int) ancestors[index].path_len, path);
+    exit_status = 1;
+}
+
+/*
+    A copy of the fd of a directory whose subdirectories were queued as
+    tasks, which open them relative to it however long their paths are.
+    The directory and each of the tasks hold a reference, the last one to
+    let go closes the fd.
+*/
+typedef struct
+{
+    int fd;
+    atomic_int refs;
+} shared_dir_t;
+
+/*
+    A directory that still has to be walked by one of the worker threads.
+*/
+typedef struct
+{
+    file_data_t dir;
+    // The parent of dir, NULL if dir is opened by its path.
+    shared_dir_t* parent;
+    // Where the output of the directory goes, NULL with -unordered.
+    out_node_t* out;
+    // With -L or -xdev, the ancestors of dir.
+    ancestor_t* ancestors;
+    int num_ancestors;
+} walk_task_t;
+
+/*
+    The task deque of one worker. The owner pushes and pops at the bottom,
+    idle workers steal from the top, which holds the oldest and usually
+    shallowest directories. top and bottom only ever grow, the slot of
+    index i is i % cap.
+*/
+typedef struct
+{
+    pthread_mutex_t lock;
+    walk_task_t** tasks;
+    long top;
+    long bottom;
+    long cap;
+} task_deque_t;
+
+task_deque_t* deques = NULL;
+pthread_t* workers = NULL;
+
+// Number of tasks waiting in any deque.
+atomic_long queued_tasks = 0;
+// Number of tasks queued or running, the walk is over once this is 0.
+atomic_long pending_tasks = 0;
+// Number of workers waiting for tasks.
+atomic_int idle_workers = 0;
+// Guards pool_shutdown and is used to wait on pool_cond and done_cond.
+pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+// Signalled when a task is queued or the workers should exit.
+pthread_cond_t pool_cond = PTHREAD_COND_INITIALIZER;
+// Signalled when pending_tasks drops to 0.
+pthread_cond_t done_cond = PTHREAD_COND_INITIALIZER;
+bool pool_shutdown = false;
+
+void walk_dir(file_data_t dir_file_data);
+void free_walk_stack();
+
+/*
+    Takes a reference to the shared copy of fd kept in *shared, making the
+    copy first if there is none yet, on behalf of the directory fd belongs
+    to. Returns NULL if fd is AT_FDCWD or could not be copied.
+*/
+shared_dir_t* share_dir_fd(int fd, shared_dir_t** shared)
+{
+    if(fd == AT_FDCWD)
+    {
+        return NULL;
+    }
+    if(*shared == NULL)
+    {
+        int copy = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+        if(copy == -1)
+        {
+            return NULL;
+        }
+        *shared = (shared_dir_t*) checked_alloc(1, sizeof(shared_dir_t));
+        (*shared)->fd = copy;
+        atomic_init(&(*shared)->refs, 1);
+    }
+    atomic_fetch_add(&(*shared)->refs, 1);
+    return *shared;
+}
+
+/*
+    Drops a reference to shared, closing its fd if it was the last one.
+*/
+void release_shared_dir(shared_dir_t* shared)
+{
+    if(shared != NULL && atomic_fetch_sub(&shared->refs, 1) == 1)
+    {
+        close(shared->fd);
+        free(shared);
+    }
+}
+
+/*
+    Adds a task to the bottom of the deque, growing it if needed.
+*/
+void push_task(task_deque_t* deque, walk_task_t* task)
+{
+    pthread_mutex_lock(&deque->lock);
+    if(deque->bottom - deque->top == deque->cap)
+    {
+        long new_cap = deque->cap > 0 ? deque->cap * 2 : 64;
+        walk_task_t** new_tasks = (walk_task_t**) checked_alloc(new_cap, sizeof(walk_task_t*));
+        for(long i = deque->top; i < deque->bottom; i++)
+        {
+            new_tasks[i % new_cap] = deque->tasks[i % deque->cap];
+        }
+        free(deque->tasks);
+        deque->tasks = new_tasks;
+        deque->cap = new_cap;
+    }
+    deque->tasks[deque->bottom % deque->cap] = task;
+    deque->bottom++;
+    pthread_mutex_unlock(&deque->lock);
+
+    atomic_fetch_add(&queued_tasks, 1);
+    if(atomic_load(&idle_workers) > 0)
+    {
+        pthread_mutex_lock(&pool_lock);
+        pthread_cond_signal(&pool_cond);
+        pthread_mutex_unlock(&pool_lock);
+    }
+}
+
+/*
+    Removes a task from the bottom (the owner's end) or the top (the
+    thieves' end) of the deque. Returns NULL if the deque is empty.
+*/
+walk_task_t* take_from_deque(task_deque_t* deque, bool from_top)
+{
+    walk_task_t* task = NULL;
+    pthread_mutex_lock(&deque->lock);
+    if(deque->bottom > deque->top)
+    {
+        if(from_top)
+        {
+            task = deque->tasks[deque->top % deque->cap];
+            deque->top++;
+        }
+        else
+        {
+            deque->bottom--;
+            task = deque->tasks[deque->bottom % deque->cap];
+        }
+    }
+    pthread_mutex_unlock(&deque->lock);
+
+    if(task != NULL)
+    {
+        atomic_fetch_sub(&queued_tasks, 1);
+    }
+    return task;
+}
+
+/*
+    Returns the current bottom index of the deque.
+*/
+long deque_bottom(task_deque_t* deque)
+{
+    pthread_mutex_lock(&deque->lock);
+    long bottom = deque->bottom;
+    pthread_mutex_unlock(&deque->lock);
+    return bottom;
+}
+
+/*
+    Reverses the tasks pushed since the bottom index was first. Subdirectories
+    are pushed in readdir order, reversing them makes the owner pop them in
+    that same order, so its output can be written while the walk goes on.
+*/
+void reverse_tasks_since(task_deque_t* deque, long first)
+{
+    pthread_mutex_lock(&deque->lock);
+    long i = first > deque->top ? first : deque->top;
+    long j = deque->bottom - 1;
+    for(; i < j; i++, j--)
+    {
+        walk_task_t* temp = deque->tasks[i % deque->cap];
+        deque->tasks[i % deque->cap] = deque->tasks[j % deque->cap];
+        deque->tasks[j % deque->cap] = temp;
+    }
+    pthread_mutex_unlock(&deque->lock);
+}
+
+/*
+    Returns the next task for worker id, taken from its own deque or stolen
+    from another worker. Waits while there is no work and returns NULL once
+    the pool is shut down.
+*/
+walk_task_t* next_task(int id)
+{
+    while(true)
+    {
+        walk_task_t* task = take_from_deque(&deques[id], false);
+        for(int i = 1; task == NULL && i < num_threads; i++)
+        {
+            task = take_from_deque(&deques[(id + i) % num_threads], true);
+        }
+        if(task != NULL)
+        {
+            return task;
+        }
+
+        pthread_mutex_lock(&pool_lock);
+        atomic_fetch_add(&idle_workers, 1);
+        while(atomic_load(&queued_tasks) == 0 && !pool_shutdown)
+        {
+            pthread_cond_wait(&pool_cond, &pool_lock);
+        }
+        atomic_fetch_sub(&idle_workers, 1);
+        bool exit_worker = pool_shutdown && atomic_load(&queued_tasks) == 0;
+        pthread_mutex_unlock(&pool_lock);
+
+        if(exit_worker)
+        {
+            return NULL;
+        }
+    }
+}
+
+/*
+    Walks the directory of a task on the current worker. Subdirectories
+    found along the way become new tasks on the worker's deque.
+*/
+void run_walk_task(walk_task_t* task)
+{
+    task_deque_t* own_deque = &deques[worker_id];
+    long first_child = deque_bottom(own_deque);
+
+    cur_out = task->out;
+    path_truncate(&walk_path, 0);
+    path_append(&walk_path, task->dir.path, strlen(task->dir.path));
+    for(int i = 0; i < task->num_ancestors; i++)
+    {
+        push_ancestor(task->ancestors[i].dev, task->ancestors[i].ino, task->ancestors[i].path_len);
+    }
+    free(task->ancestors);
+    walk_dir(task->dir);
+    release_shared_dir(task->parent);
+    while(num_ancestors > 0)
+    {
+        pop_ancestor();
+    }
+    out_publish(NULL);
+    if(cur_out != NULL)
+    {
+        pthread_mutex_lock(&out_lock);
+        cur_out->done = true;
+        pthread_cond_signal(&out_cond);
+        pthread_mutex_unlock(&out_lock);
+    }
+    cur_out = NULL;
+
+    reverse_tasks_since(own_deque, first_child);
+    free(task);
+
+    if(atomic_fetch_sub(&pending_tasks, 1) == 1)
+    {
+        pthread_mutex_lock(&pool_lock);
+        pthread_cond_broadcast(&done_cond);
+        pthread_mutex_unlock(&pool_lock);
+    }
+}
+
+/*
+    Main loop of a worker thread.
+*/
+void* walk_worker(void* arg)
+{
+    worker_id = (int) (intptr_t) arg;
+    walk_task_t* task;
+    while((task = next_task(worker_id)) != NULL)
+    {
+        run_walk_task(task);
+    }
+    merge_thread_stats();
+    free_walk_stack();
+    free_dir_readers();
+    free_content_buf();
+    free_regex_caches();
+#ifdef USE_IO_URING
+    free_stat_ring();
+#endif
+    if(out_text != NULL)
+    {
+        free(out_text->text);
+        free(out_text);
+    }
+    free(walk_path.text);
+    return NULL;
+}
+
+/*
+    Creates a task for walking dir whose output goes to out and queues it
+    on deque. The task takes over the reference to parent.
+*/
+void queue_walk_task(file_data_t dir, shared_dir_t* parent, out_node_t* out, task_deque_t* deque)
+{
+    // The path and name are copied behind the task, they belong to the
+    // walk of the parent, which goes on while the task waits.
+    size_t path_len = strlen(dir.path);
+    size_t name_len = strlen(dir.file_name);
+    walk_task_t* task = (walk_task_t*) checked_alloc(1, sizeof(walk_task_t) + path_len + name_len + 2);
+    char* strings = (char*) (task + 1);
+    memcpy(strings, dir.path, path_len + 1);
+    memcpy(strings + path_len + 1, dir.file_name, name_len + 1);
+    dir.path = strings;
+    dir.file_name = strings + path_len + 1;
+    task->dir = dir;
+    task->parent = parent;
+    task->out = out;
+    task->ancestors = NULL;
+    task->num_ancestors = num_ancestors;
+    if(num_ancestors > 0)
+    {
+        task->ancestors = (ancestor_t*) checked_alloc(num_ancestors, sizeof(ancestor_t));
+        memcpy(task->ancestors, ancestors, num_ancestors * sizeof(ancestor_t));
+    }
+    atomic_fetch_add(&pending_tasks, 1);
+    push_task(deque, task);
+}
+
+/*
+    Walks a subdirectory found by walk_dir. The serial walk simply recurses,
+    with -j the subdirectory becomes a task and its output is placed right
+    after everything the current directory has printed so far. shared is
+    where the current directory keeps the copy of its fd the tasks share.
+*/
+void walk_subdir(file_data_t dir, shared_dir_t** shared)
+{
+    if(num_threads == 0)
+    {
+        walk_dir(dir);
+        return;
+    }
+
+    // The parent's fd is closed long before the task runs, so the task gets
+    // a copy of it. Without one it opens the directory by its full path,
+    // which fails past PATH_MAX.
+    shared_dir_t* parent = share_dir_fd(dir.parent_fd, shared);
+    dir.parent_fd = parent != NULL ? parent->fd : AT_FDCWD;
+    out_node_t* child = NULL;
+    if(!unordered_output)
+    {
+        child = (out_node_t*) checked_alloc(1, sizeof(out_node_t));
+        out_publish(child);
+    }
+    queue_walk_task(dir, parent, child, &deques[worker_id]);
+}
+
+/*
+    Writes the output of root and all of its subdirectories to stdout in
+    the order the serial walk would have printed it, waiting for workers
+    where needed. Frees the output as it goes.
+*/
+void write_ordered_output(out_node_t* root)
+{
+    int stack_cap = 64;
+    int depth = 0;
+    out_node_t** stack = (out_node_t**) checked_alloc(stack_cap, sizeof(out_node_t*));
+    stack[depth++] = root;
+
+    while(depth > 0)
+    {
+        out_node_t* node = stack[depth - 1];
+
+        pthread_mutex_lock(&out_lock);
+        while(node->head == NULL && !node->done)
+        {
+            pthread_cond_wait(&out_cond, &out_lock);
+        }
+        out_segment_t* segment = node->head;
+        if(segment != NULL)
+        {
+            node->head = segment->next;
+            if(node->head == NULL)
+            {
+                node->tail = NULL;
+            }
+        }
+        pthread_mutex_unlock(&out_lock);
+
+        if(segment == NULL)
+        {
+            // The directory is done and everything it printed was written.
+            free(node);
+            depth--;
+            continue;
+        }
+
+        if(segment->len > 0)
+        {
+            out_write(segment->text, segment->len);
+        }
+        if(segment->child != NULL)
+        {
+            if(depth == stack_cap)
+            {
+                stack_cap *= 2;
+                stack = (out_node_t**) checked_realloc(stack, stack_cap * sizeof(out_node_t*));
+            }
+            stack[depth++] = segment->child;
+        }
+        free(segment->text);
+        free(segment);
+    }
+    free(stack);
+}
+
+/*
+    Walks the base directory dir using the worker threads. Returns once
+    the whole tree has been walked and printed.
+*/
+void parallel_walk_dir(file_data_t dir)
+{
+    out_node_t* root = NULL;
+    if(!unordered_output)
+    {
+        root = (out_node_t*) checked_alloc(1, sizeof(out_node_t));
+    }
+    else
+    {
+        // The workers write to stdout themselves from now on.
+        out_flush();
+    }
+    queue_walk_task(dir, NULL, root, &deques[0]);
+
+    if(root != NULL)
+    {
+        write_ordered_output(root);
+    }
+
+    pthread_mutex_lock(&pool_lock);
+    while(atomic_load(&pending_tasks) > 0)
+    {
+        pthread_cond_wait(&done_cond, &pool_lock);
+    }
+    pthread_mutex_unlock(&pool_lock);
+}
+
+/*
+    Starts num_threads worker threads, each with its own task deque.
+*/
+void start_workers()
+{
+    deques = (task_deque_t*) checked_alloc(num_threads, sizeof(task_deque_t));
+    workers = (pthread_t*) checked_alloc(num_threads, sizeof(pthread_t));
+    for(int i = 0; i < num_threads; i++)
+    {
+        pthread_mutex_init(&deques[i].lock, NULL);
+    }
+    for(int i = 0; i < num_threads; i++)
+    {
+        if(pthread_create(&workers[i], NULL, walk_worker, (void*) (intptr_t) i) != 0)
+        {
+            printf("find: cannot create thread\n");
+            exit(1);
+        }
+    }
+}
+
+/*
+    Tells the worker threads to exit once they run out of work and waits
+    for them.
+*/
+void stop_workers()
+{
+    pthread_mutex_lock(&pool_lock);
+    pool_shutdown = true;
+    pthread_cond_broadcast(&pool_cond);
+    pthread_mutex_unlock(&pool_lock);
+
+    for(int i = 0; i < num_threads; i++)
+    {
+        pthread_join(workers[i], NULL);
+        pthread_mutex_destroy(&deques[i].lock);
+        free(deques[i].tasks);
+    }
+    free(workers);
+    free(deques);
+}
+
+/*
+    The stat info of a saved entry, taken ahead of time by -inode-order.
+*/
+typedef struct
+{
+    struct stat statbuffer;
+    bool have_stat;
+} entry_stat_t;
+
+/*
+    A directory on the stack of the walk. While it is open its entries
+    come from its reader. To stay below max_open_dirs the shallowest open
+    directories are spilled: their remaining entries are saved and they
+    are closed, to be opened again once the walk comes back to them.
+*/
+typedef struct
+{
+    // -1 while the directory is closed.
+    int fd;
+    // NULL once the remaining entries were saved.
+    dir_reader_t* reader;
+    // The size of the reader's current batch.
+    int count;
+    // The next entry of the batch, or of saved.
+    int next;
+    // The length of walk_path while walking the directory, which is its
+    // path followed by a slash.
+    size_t dir_path_len;
+    dir_entry_t* saved;
+    int num_saved;
+    int saved_cap;
+    arena_t saved_names;
+    // Identifies a spilled directory, to check it is opened again and
+    // not whatever took its place.
+    dev_t dev;
+    ino_t ino;
+    // With -index-update, set if the entries come from index_cache
+    // instead, from cache_next up to cache_end. The directory is never
+    // opened then.
+    bool cached;
+    uint32_t cache_next;
+    uint32_t cache_end;
+    dir_entry_t cache_entry;
+    // With -inode-order, set once all entries were saved and the ones that
+    // need it stated into saved_stats. The reader is only kept for its fd.
+    bool presorted;
+    entry_stat_t* saved_stats;
+    int saved_stats_cap;
+    // With -j, the copy of fd the tasks of the subdirectories share.
+    shared_dir_t* shared;
+} walk_frame_t;
+
+// The directories the current thread is walking inside each other.
+_Thread_local walk_frame_t* walk_stack = NULL;
+_Thread_local int walk_stack_cap = 0;
+// Number of directories on walk_stack that are open.
+_Thread_local int open_dirs = 0;
+
+/*
+    The directories -bfs walks next. The paths of one level are kept
+    until the whole level was walked, then their arena is reused.
+*/
+typedef struct
+{
+    arena_t names;
+    char** paths;
+    int len;
+    int cap;
+    int next;
+    // How many levels below its start point each directory is.
+    int depth;
+} bfs_level_t;
+
+// The level being walked and the one below it.
+bfs_level_t bfs_levels[2];
+int bfs_current = 0;
+
+/*
+    Adds the path of a directory -bfs walks once the current level is done,
+    depth levels below its start point.
+*/
+void queue_bfs_dir(const char* path, size_t len, int depth)
+{
+    bfs_level_t* level = &bfs_levels[1 - bfs_current];
+    level->depth = depth;
+    if(level->len == level->cap)
+    {
+        level->cap = level->cap == 0 ? 64 : level->cap * 2;
+        level->paths = (char**) checked_realloc(level->paths, level->cap * sizeof(char*));
+    }
+    char* copy = (char*) arena_alloc(&level->names, len + 1);
+    memcpy(copy, path, len + 1);
+    level->paths[level->len++] = copy;
+}
+
+/*
+    Returns the path of the next directory -bfs walks, or NULL once there
+    is none, and stores its depth in depth. The path stays valid until the
+    end of its level.
+*/
+const char* next_bfs_dir(int* depth)
+{
+    bfs_level_t* level = &bfs_levels[bfs_current];
+    if(level->next == level->len)
+    {
+        arena_reset(&level->names);
+        level->len = 0;
+        level->next = 0;
+        bfs_current = 1 - bfs_current;
+        level = &bfs_levels[bfs_current];
+        if(level->len == 0)
+        {
+            return NULL;
+        }
+    }
+    *depth = level->depth;
+    return level->paths[level->next++];
+}
+
+/*
+    Prints the error for the directory whose path is the first path_len
+    bytes of walk_path.
+*/
+void print_dir_error_at(size_t path_len, int error)
+{
+    if(path_len > 1 && walk_path.text[path_len - 1] == '/')
+    {
+        path_len--;
+    }
+    out_printf("find: ‘%.*s’: %s\n", (int) path_len, walk_path.text, strerror(error));
+    exit_status = 1;
+}
+
+/*
+    Prints the error for the directory whose path is in walk_path.
+*/
+void print_dir_error(int error)
+{
+    print_dir_error_at(walk_path.len, error);
+}
+
+/*
+    Saves the entries of frame that were not read yet, its reader is at
+    the end of the directory afterwards.
+*/
+void save_walk_entries(walk_frame_t* frame)
+{
+    dir_reader_t* reader = frame->reader;
+    arena_reset(&frame->saved_names);
+    frame->num_saved = 0;
+    do
+    {
+        for(; frame->next < frame->count; frame->next++)
+        {
+            if(frame->num_saved == frame->saved_cap)
+            {
+                frame->saved_cap = frame->saved_cap == 0 ? 16 : frame->saved_cap * 2;
+                frame->saved = (dir_entry_t*) checked_realloc(frame->saved, frame->saved_cap * sizeof(dir_entry_t));
+            }
+            dir_entry_t* entry = &frame->saved[frame->num_saved++];
+            *entry = reader->entries[frame->next];
+            size_t name_len = strlen(entry->name);
+            char* name = (char*) arena_alloc(&frame->saved_names, name_len + 1);
+            memcpy(name, entry->name, name_len + 1);
+            entry->name = name;
+        }
+        frame->count = read_dir_batch(reader);
+        frame->next = 0;
+    } while(frame->count > 0);
+    if(frame->count < 0)
+    {
+        // A spilled frame is not the deepest, walk_path goes on below it.
+        print_dir_error_at(frame->dir_path_len, errno);
+        frame->count = 0;
+    }
+}
+
+/*
+    Saves the entries of frame that were not read yet and closes it.
+*/
+void spill_walk_frame(walk_frame_t* frame)
+{
+    struct stat statbuffer;
+    fstat(frame->fd, &statbuffer);
+    frame->dev = statbuffer.st_dev;
+    frame->ino = statbuffer.st_ino;
+
+    dir_reader_t* reader = frame->reader;
+    if(reader == NULL || frame->presorted)
+    {
+        // Opened again after a spill or read whole by -inode-order, the
+        // entries are saved already.
+        if(reader != NULL)
+        {
+            close_dir_reader(reader);
+            frame->reader = NULL;
+            thread_stats.dirs_spilled += collect_stats;
+        }
+        else
+        {
+            close(frame->fd);
+        }
+        frame->fd = -1;
+        open_dirs--;
+        return;
+    }
+    // Submitted statx calls point into the reader's buffer.
+    finish_prefetch(reader);
+    save_walk_entries(frame);
+    close_dir_reader(reader);
+    frame->reader = NULL;
+    frame->fd = -1;
+    open_dirs--;
+    thread_stats.dirs_spilled += collect_stats;
+}
+
+/*
+    An entry of a directory read by -inode-order, by inode number.
+*/
+typedef struct
+{
+    ino_t ino;
+    int index;
+} inode_ref_t;
+
+// The entries of the directory being read by -inode-order that need stat.
+_Thread_local inode_ref_t* inode_refs = NULL;
+_Thread_local int inode_refs_cap = 0;
+
+/*
+    Orders inode references by their inode number.
+*/
+int compare_inode_refs(const void* a, const void* b)
+{
+    ino_t x = ((const inode_ref_t*) a)->ino;
+    ino_t y = ((const inode_ref_t*) b)->ino;
+    return (x > y) - (x < y);
+}
+
+/*
+    With -inode-order, reads all entries of frame, which was just opened,
+    and stats the ones that need it by increasing inode number. On most
+    filesystems that is the order of the inode table on disk, so the stats
+    do not seek back and forth across it. The entries are still handed out
+    in the order the directory lists them.
+*/
+void presort_walk_frame(walk_frame_t* frame)
+{
+    save_walk_entries(frame);
+    frame->presorted = true;
+    frame->next = 0;
+    if(frame->num_saved > frame->saved_stats_cap)
+    {
+        frame->saved_stats_cap = frame->num_saved;
+        free(frame->saved_stats);
+        frame->saved_stats = (entry_stat_t*) checked_alloc(frame->saved_stats_cap, sizeof(entry_stat_t));
+    }
+    if(frame->num_saved > inode_refs_cap)
+    {
+        inode_refs_cap = frame->num_saved;
+        free(inode_refs);
+        inode_refs = (inode_ref_t*) checked_alloc(inode_refs_cap, sizeof(inode_ref_t));
+    }
+
+    int num_refs = 0;
+    for(int i = 0; i < frame->num_saved; i++)
+    {
+        unsigned char type = frame->saved[i].type;
+        frame->saved_stats[i].have_stat = false;
+        if(entry_needs_stat(type) || (track_ancestors && type == DT_DIR))
+        {
+            inode_refs[num_refs].ino = frame->saved[i].ino;
+            inode_refs[num_refs].index = i;
+            num_refs++;
+        }
+    }
+    qsort(inode_refs, num_refs, sizeof(inode_ref_t), compare_inode_refs);
+    for(int i = 0; i < num_refs; i++)
+    {
+        int index = inode_refs[i].index;
+        file_data_t file = {
+            .path = NULL,
+            .file_name = (char*) frame->saved[index].name,
+            .have_stat = false,
+            .parent_fd = frame->fd
+        };
+        // Failures are left to walk_dir, which reports them.
+        if(ensure_stat(&file))
+        {
+            frame->saved_stats[index].statbuffer = file.statbuffer;
+            frame->saved_stats[index].have_stat = true;
+        }
+    }
+}
+
+/*
+    Makes room on walk_stack for a frame at depth. New frames start out
+    zeroed, their buffers are kept for reuse once they were allocated.
+*/
+void grow_walk_stack(int depth)
+{
+    if(depth == walk_stack_cap)
+    {
+        int old_cap = walk_stack_cap;
+        walk_stack_cap = walk_stack_cap == 0 ? 16 : walk_stack_cap * 2;
+        walk_stack = (walk_frame_t*) checked_realloc(walk_stack, walk_stack_cap * sizeof(walk_frame_t));
+        memset(walk_stack + old_cap, 0, (walk_stack_cap - old_cap) * sizeof(walk_frame_t));
+    }
+}
+
+/*
+    Opens dir, whose path is in walk_path, and pushes it on walk_stack at
+    depth. Spills the shallowest open directories if there are more than
+    max_open_dirs now. Returns false if dir could not be opened.
+*/
+bool push_walk_frame(file_data_t* dir, int depth)
+{
+    // Open the directory relative to its parent, so the kernel does not have
+    // to walk the whole path again. Entries are then looked up relative to it.
+    const char* open_name = dir->parent_fd == AT_FDCWD ? walk_path.text : dir->file_name;
+    int dir_fd = openat(dir->parent_fd, open_name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    dir_reader_t* reader = dir_fd == -1 ? NULL : open_dir_reader(dir_fd);
+    if(reader == NULL)
+    {
+        thread_stats.dir_open_errors += collect_stats;
+        print_dir_error(errno);
+        return false;
+    }
+    thread_stats.dirs_opened += collect_stats;
+
+    grow_walk_stack(depth);
+    // Start points may be given without a slash at the end.
+    if(walk_path.text[walk_path.len - 1] != '/')
+    {
+        path_append(&walk_path, "/", 1);
+    }
+
+    walk_frame_t* frame = &walk_stack[depth];
+    frame->fd = dir_fd;
+    frame->reader = reader;
+    frame->cached = false;
+    frame->presorted = false;
+    frame->count = 0;
+    frame->next = 0;
+    frame->num_saved = 0;
+    frame->dir_path_len = walk_path.len;
+    open_dirs++;
+    if(inode_order)
+    {
+        presort_walk_frame(frame);
+    }
+
+    for(int i = 0; i < depth && open_dirs > max_open_dirs; i++)
+    {
+        if(walk_stack[i].fd != -1)
+        {
+            spill_walk_frame(&walk_stack[i]);
+        }
+    }
+    return true;
+}
+
+/*
+    Closes the directory at depth and, if its parent was spilled, opens
+    the parent again, preferably through "..", which works however long
+    the path is. Returns false if the parent could not be opened again.
+*/
+bool pop_walk_frame(int depth)
+{
+    walk_frame_t* frame = &walk_stack[depth];
+    bool reopened = true;
+    if(depth > 0 && walk_stack[depth - 1].fd == -1 && !walk_stack[depth - 1].cached)
+    {
+        walk_frame_t* parent = &walk_stack[depth - 1];
+        struct stat statbuffer;
+        parent->fd = openat(frame->fd, "..", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if(parent->fd != -1 && (fstat(parent->fd, &statbuffer) == -1 || statbuffer.st_dev != parent->dev
+                                || statbuffer.st_ino != parent->ino))
+        {
+            // With -L the parent of a directory is not where it was found.
+            close(parent->fd);
+            parent->fd = -1;
+        }
+        path_truncate(&walk_path, parent->dir_path_len);
+        if(parent->fd == -1)
+        {
+            parent->fd = openat(AT_FDCWD, walk_path.text, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        }
+        if(parent->fd == -1)
+        {
+            print_dir_error(errno);
+            reopened = false;
+        }
+        else
+        {
+            open_dirs++;
+        }
+    }
+
+    if(frame->reader != NULL)
+    {
+        close_dir_reader(frame->reader);
+        frame->reader = NULL;
+        open_dirs--;
+    }
+    else if(frame->fd != -1)
+    {
+        close(frame->fd);
+        open_dirs--;
+    }
+    frame->fd = -1;
+    release_shared_dir(frame->shared);
+    frame->shared = NULL;
+    if(track_ancestors)
+    {
+        pop_ancestor();
+    }
+    return reopened;
+}
+
+/*
+    Returns the next entry of frame or NULL once all were read. slot gets
+    the statx submitted for the entry with -uring, or NULL.
+*/
+dir_entry_t* next_walk_entry(walk_frame_t* frame, stat_slot_t** slot)
+{
+    *slot = NULL;
+    dir_reader_t* reader = frame->reader;
+    if(reader == NULL || frame->presorted)
+    {
+        return frame->next < frame->num_saved ? &frame->saved[frame->next++] : NULL;
+    }
+
+    if(frame->next == frame->count)
+    {
+        finish_prefetch(reader);
+        frame->count = read_dir_batch(reader);
+        frame->next = 0;
+        if(frame->count < 0)
+        {
+            print_dir_error_at(frame->dir_path_len, errno);
+            frame->count = 0;
+        }
+        if(frame->count == 0)
+        {
+            return NULL;
+        }
+    }
+    if(use_uring)
+    {
+        prefetch_stats(reader, frame->count);
+        if(frame->next < reader->next_prefetch)
+        {
+            *slot = &reader->slots[frame->next];
+        }
+    }
+    return &reader->entries[frame->next++];
+}
+
+/*
+    Pushes dir, whose path is in walk_path, on walk_stack at depth with the
+    listing it had in index_cache. Returns false if it changed since or is
+    not in index_cache, then it has to be read.
+*/
+bool push_cached_frame(file_data_t* dir, int depth)
+{
+    if(index_cache.header == NULL)
+    {
+        return false;
+    }
+    const index_dir_record_t* record = ensure_stat(dir) ? find_cached_dir(&dir->statbuffer) : NULL;
+    if(record == NULL)
+    {
+        return false;
+    }
+
+    grow_walk_stack(depth);
+    if(walk_path.text[walk_path.len - 1] != '/')
+    {
+        path_append(&walk_path, "/", 1);
+    }
+
+    walk_frame_t* frame = &walk_stack[depth];
+    frame->fd = -1;
+    frame->reader = NULL;
+    frame->cached = true;
+    frame->presorted = false;
+    frame->cache_next = record->entry + 1;
+    frame->cache_end = record->end;
+    frame->num_saved = 0;
+    frame->dir_path_len = walk_path.len;
+    return true;
+}
+
+/*
+    Returns the next entry of a frame pushed by push_cached_frame or NULL
+    once all were returned. cached gets the entry in index_cache.
+*/
+dir_entry_t* next_cached_entry(walk_frame_t* frame, const index_entry_t** cached)
+{
+    if(frame->cache_next >= frame->cache_end)
+    {
+        return NULL;
+    }
+    const index_entry_t* entry = &index_cache.entries[frame->cache_next];
+    frame->cache_next = index_entry_end(&index_cache, frame->cache_next);
+    if(entry->name_offset >= index_cache.header->names_size)
+    {
+        return next_cached_entry(frame, cached);
+    }
+    frame->cache_entry.name = index_cache.names + entry->name_offset;
+    frame->cache_entry.ino = 0;
+    frame->cache_entry.type = IFTODT(entry->type);
+    *cached = entry;
+    return &frame->cache_entry;
+}
+
+/*
+    Frees the walk stack of the current thread.
+*/
+void free_walk_stack()
+{
+    for(int i = 0; i < walk_stack_cap; i++)
+    {
+        free(walk_stack[i].saved);
+        free(walk_stack[i].saved_stats);
+        arena_free(&walk_stack[i].saved_names);
+    }
+    free(walk_stack);
+    walk_stack = NULL;
+    walk_stack_cap = 0;
+    free(inode_refs);
+    inode_refs = NULL;
+    inode_refs_cap = 0;
+    free_ancestors();
+}
+
+/*
+    Walks the tree below the specified directory calling handle_file on each
+    file or directory encountered during the traversal. The walk keeps its
+    own stack of directories instead of recursing, so the depth of the tree
+    is only limited by memory. With -j each subdirectory is handed to
+    walk_subdir and walked as a separate task, with -bfs it is walked once
+    the current level is done. walk_path has to hold the path of the
+    directory, the paths of the entries are built behind it.
+*/
+void walk_dir(file_data_t dir_file_data)
+{
+    dir_file_data.path = walk_path.text;
+    // Every directory handles it self at the beginning
+    handle_file(&dir_file_data);
+
+    // The entries of walk_stack[i] are base_depth + i + 1 levels deep.
+    int base_depth = dir_file_data.depth;
+    int depth = 0;
+    size_t base_len = printed_length(&dir_file_data);
+    if(may_descend(&dir_file_data)
+       && (push_cached_frame(&dir_file_data, 0) || push_walk_frame(&dir_file_data, 0)))
+    {
+        depth = 1;
+        if(track_ancestors)
+        {
+            push_ancestor(dir_file_data.statbuffer.st_dev, dir_file_data.statbuffer.st_ino, base_len);
+        }
+    }
+
+    while(depth > 0)
+    {
+        walk_frame_t* frame = &walk_stack[depth - 1];
+        stat_slot_t* slot = NULL;
+        const index_entry_t* cached = NULL;
+        dir_entry_t* entry = frame->cached ? next_cached_entry(frame, &cached) : next_walk_entry(frame, &slot);
+        if(entry == NULL)
+        {
+            depth--;
+            // A parent that can not be opened again is left with the rest
+            // of its entries.
+            while(!pop_walk_frame(depth) && depth > 0)
+            {
+                depth--;
+            }
+
+            // With -bfs the next directory of the level is walked now.
+            const char* next_dir;
+            if(depth == 0 && breadth_first && (next_dir = next_bfs_dir(&base_depth)) != NULL)
+            {
+                path_truncate(&walk_path, 0);
+                path_append(&walk_path, next_dir, strlen(next_dir));
+                file_data_t bfs_dir = { .parent_fd = AT_FDCWD };
+                if(push_walk_frame(&bfs_dir, 0))
+                {
+                    depth = 1;
+                }
+            }
+            continue;
+        }
+
+        // The path is only built if the file is printed or passed to -exec
+        // and stat is only called if the entry's type is not enough.
+        file_data_t cur_file = {
+            .path = NULL,
+            .file_name = (char*) entry->name,
+            .have_stat = false,
+            .d_type = entry->type,
+            .dir_path_len = frame->dir_path_len,
+            .parent_fd = frame->cached ? AT_FDCWD : frame->fd,
+            .stat_slot = slot,
+            .cached = cached,
+            .depth = base_depth + depth
+        };
+        if(frame->presorted && frame->saved_stats[frame->next - 1].have_stat)
+        {
+            cur_file.statbuffer = frame->saved_stats[frame->next - 1].statbuffer;
+            cur_file.have_stat = true;
+        }
+
+        // A directory that is one of its own ancestors is left out, even
+        // at -maxdepth, as find does.
+        if(track_ancestors && file_type(&cur_file) == S_IFDIR && ensure_stat(&cur_file))
+        {
+            int ancestor = find_ancestor(cur_file.statbuffer.st_dev, cur_file.statbuffer.st_ino);
+            if(ancestor >= 0)
+            {
+                print_loop_error(&cur_file, ancestor);
+                continue;
+            }
+            // Mount points are handled, but not walked.
+            cur_file.pruned = stay_on_device && cur_file.statbuffer.st_dev != ancestors[0].dev;
+        }
+
+        // Check if the file is of type directory, symlinks are only
+        // reported as directories with -L. At -maxdepth that does not
+        // matter, nothing below is visited.
+        if(cur_file.depth == max_depth || file_type(&cur_file) != S_IFDIR)
+        {
+            // No subdirectories are handled here
+            handle_file(&cur_file);
+            continue;
+        }
+
+        // Take the result of a submitted statx now, the slot belongs
+        // to this reader and the subdirectory may be walked elsewhere.
+        if(cur_file.stat_slot != NULL && cur_file.stat_slot->submitted)
+        {
+            ensure_stat(&cur_file);
+        }
+        cur_file.stat_slot = NULL;
+        path_truncate(&walk_path, frame->dir_path_len);
+        path_append(&walk_path, entry->name, strlen(entry->name));
+        path_append(&walk_path, "/", 1);
+        cur_file.path = walk_path.text;
+        if(num_threads > 0)
+        {
+            // Walk the sub directory on another thread
+            walk_subdir(cur_file, &frame->shared);
+        }
+        else if(breadth_first)
+        {
+            handle_file(&cur_file);
+            if(may_descend(&cur_file))
+            {
+                queue_bfs_dir(walk_path.text, walk_path.len, cur_file.depth);
+            }
+        }
+        else
+        {
+            handle_file(&cur_file);
+            // The entry's name stays in the reader until the subdirectory
+            // is open, which is all push_walk_frame needs it for.
+            if(may_descend(&cur_file)
+               && (push_cached_frame(&cur_file, depth) || push_walk_frame(&cur_file, depth)))
+            {
+                depth++;
+                if(track_ancestors)
+                {
+                    push_ancestor(cur_file.statbuffer.st_dev, cur_file.statbuffer.st_ino, walk_path.len - 1);
+                }
+            }
+        }
+    }
+}
+
+/*
+    Takes a single mode char and returns the corresponding
+    mode bit mask.
+*/
+mode_t get_mode_mask(char mode_specifier)
+{
+    switch(mode_specifier)
+    {
+        case 'b': return S_IFBLK;
+        case 'c': return S_IFCHR;
+        case 'd': return S_IFDIR;
+        //case 'p': return 
+        case 'f': return S_IFREG;
+        case 'l': return S_IFLNK;
+        case 's': return S_IFSOCK;
+        //case 'D': return 
+        default: 
+            printf("find: Unknown argument to -type: %c\n", mode_specifier);
+            exit(1);
+    }
+}
+
+/*
+    Parses the arguments to -type. Stores the results in pred->modes
+    and updates pred->num_modes to the correct number.
+*/
+void arg_to_mode(char* mode_specifier, predicate_t* pred)
+{
+    int length = strlen(mode_specifier);
    
     // Reserve space storing modes.
-    desired_modes = (mode_t*) calloc(length % 2 + length / 2, sizeof(mode_t));
+    mode_t* desired_modes = (mode_t*) calloc(length % 2 + length / 2, sizeof(mode_t));
     if(desired_modes == NULL)
     {
-        printf("find: insufficient memory\n");
-        exit(1);
+        printf("find: insufficient memory\n");
+        exit(1);
+    }
+
+    // Keep track of if we are expecting another mode.
+    bool needs_mode = false;
+    for(int i = 0; i < length; i++)
+    {
+        // if i is odd then it must be a ','
+        if(i % 2 == 1)
+        {
+            // We are expecting another argument to -type since there was a preceeding ','
+            needs_mode = true;
+            if(mode_specifier[i] != ',')
+            {
+                printf("find: Must separate multiple arguments to -type using: ','\n");
+                exit(1);
+            }
+        }
+        else
+        {
+            needs_mode = false;
+            desired_modes[pred->num_modes] = get_mode_mask(mode_specifier[i]);
+            pred->num_modes += 1;
+        }
+    }
+    pred->modes = desired_modes;
+    if(needs_mode)
+    {
+        printf("find: Last file type in list argument to -type is missing, i.e., list is ending on: ','\n");
+        exit(1);
+    }
+}
+
+/*
+    parses the exec commands starting at index index and updates index to hold
+    the the index of the terminating ; or +. The command is bound to pred,
+    a + after {} makes it collect paths into a batch.
+*/
+void get_exec_args(char** argv, int argc, int* index, predicate_t* pred)
+{
+    int end_index = -1;
+    bool batched = false;
+    for(int i = *index + 1; i < argc; i++)
+    {
+        if(strcmp(argv[i], ";") == 0)
+        {
+            end_index = i;
+            break;
+        }
+        // + only ends the command right after a {}, like in find.
+        if(strcmp(argv[i], "+") == 0 && i > *index + 1 && strcmp(argv[i-1], "{}") == 0)
+        {
+            end_index = i;
+            batched = true;
+            break;
+        }
+    }
+    if(end_index == -1)
+    {
+        printf("find: missing argument to `-exec'\n");
+        exit(1);
+    }
+    if(end_index == *index + 1)
+    {
+        printf("find: invalid argument `%s' to `-exec'\n", argv[end_index]);
+        exit(1);
+    }
+
+    pred->exec_argc = end_index - (*index + 1);
+    pred->exec_argv = (char**) checked_alloc(pred->exec_argc + 1, sizeof(char*));
+    for(int i = 0; i < pred->exec_argc; i++)
+    {
+        pred->exec_argv[i] = argv[*index + 1 + i];
+    }
+    if(batched)
+    {
+        // The paths take the place of the final {}.
+        pred->batch = new_exec_batch(pred->exec_argv, pred->exec_argc - 1);
+        pred->run = run_exec_batched;
+    }
+    *index = end_index;
+}
+
+/*
+    adds another base dir to the global base_dirs
+*/
+void base_path_to_file_data(char* base_path)
+{
+    struct stat statbuffer;
+    char* base_path_no_slash = remove_last_slash(base_path);
+    if(get_stat_info(base_path, &statbuffer))
+    {
+        base_dirs[num_base_dirs].path = base_path;
+        base_dirs[num_base_dirs].file_name = dir_path_to_dir_name(base_path);
+        base_dirs[num_base_dirs].statbuffer = statbuffer;
+        base_dirs[num_base_dirs].have_stat = true;
+    }
+    else
+    {
+        // create invalid base dir error messages
+        base_dirs[num_base_dirs].path = NULL;
+        char* error_begin = "find: ‘";
+        char* error_end;
+
+        if(get_stat_info(base_path_no_slash, &statbuffer))
+        {
+            // Error message for not a directory.
+            error_end = "’: Not a directory";
+        }
+        else
+        {
+            // Error message for no such file or directory
+            error_end = "’: No such file or directory";
+        }
+
+        int filled_template_length = strlen(error_begin) + strlen(error_end) + strlen(base_path) + 1;
+        char* invalid_dir_message = (char*) calloc(filled_template_length, sizeof(char));
+        if(invalid_dir_message == NULL)
+        {
+            printf("find: insufficient memory\n");
+            exit(1);
+        }
+        strcat(strcat(strcat(invalid_dir_message, error_begin), base_path), error_end);
+        
+        // for invalid base dirs the file_name stores the error message
+        base_dirs[num_base_dirs].file_name = invalid_dir_message;
+        free(base_path);
+    }
+
+    free(base_path_no_slash);
+    num_base_dirs += 1;
+}
+
+/*
+    Parses the argument arg to a time test like -mtime, a number of units
+    of unit_secs that may start with + for more or - for less, into the
+    comparison and reference of pred. Ages count back from origin with
+    find's rounding: -mtime 0 is the last 24 hours, -mmin 1 the last
+    minute, and -mtime -n allows a second more than n days.
+*/
+void parse_time_amount(char* arg, const char* option, predicate_t* pred, struct timespec origin, int unit_secs)
+{
+    const char* digits = arg;
+    pred->comparison = '=';
+    if(arg[0] == '+' || arg[0] == '-')
+    {
+        pred->comparison = arg[0];
+        digits++;
+    }
+    bool valid = digits[0] != '\0' && strlen(digits) <= 12;
+    for(long unsigned int i = 0; i < strlen(digits); i++)
+    {
+        valid = valid && isdigit(digits[i]);
+    }
+    if(!valid)
+    {
+        printf("find: invalid argument `%s' to `%s'\n", arg, option);
+        exit(1);
+    }
+    if(unit_secs == NUM_SECS_PER_DAY && pred->comparison == '-')
+    {
+        origin.tv_sec += NUM_SECS_PER_DAY - 1;
+    }
+    pred->reference = origin;
+    pred->reference.tv_sec -= (time_t) atoll(digits) * unit_secs;
+    pred->window_secs = unit_secs;
+}
+
+/*
+    Returns the start of the day of time in local time. With -daystart
+    ages in days count from there, so -mtime 0 means today.
+*/
+struct timespec start_of_day(struct timespec time)
+{
+    struct tm local;
+    localtime_r(&time.tv_sec, &local);
+    local.tm_sec = 0;
+    local.tm_min = 0;
+    local.tm_hour = 0;
+    local.tm_isdst = -1;
+    struct timespec day = { .tv_sec = mktime(&local), .tv_nsec = 0 };
+    return day;
+}
+
+/*
+    Parses the argument arg to option, which must be a positive number,
+    and returns it.
+*/
+int parse_positive_number(char* arg, const char* option)
+{
+    for(long unsigned int i = 0; i < strlen(arg); i++)
+    {
+        if(!isdigit(arg[i]))
+        {
+            printf("find: invalid argument `%s' to `%s'\n", arg, option);
+            exit(1);
+        }
+    }
+    int number = atoi(arg);
+    if(number <= 0)
+    {
+        printf("find: invalid argument `%s' to `%s'\n", arg, option);
+        exit(1);
+    }
+    return number;
+}
+
+/*
+    Parses the argument arg to -maxdepth or -mindepth, a number of levels
+    that may be 0, and returns it.
+*/
+int parse_depth(char* arg, const char* option)
+{
+    bool valid = arg[0] != '\0' && strlen(arg) <= 9;
+    for(long unsigned int i = 0; i < strlen(arg); i++)
+    {
+        valid = valid && isdigit(arg[i]);
+    }
+    if(!valid)
+    {
+        printf("find: invalid argument `%s' to `%s'\n", arg, option);
+        exit(1);
+    }
+    return atoi(arg);
+}
+
+/*
+    Parses the argument to -dirbuf, a size in KiB, and stores it in
+    dir_buf_size.
+*/
+void parse_dir_buf_size(char* arg)
+{
+    for(long unsigned int i = 0; i < strlen(arg); i++)
+    {
+        if(!isdigit(arg[i]))
+        {
+            printf("find: invalid argument `%s' to `-dirbuf'\n", arg);
+            exit(1);
+        }
+    }
+    long kib = atol(arg);
+    // One KiB always fits the longest possible directory entry.
+    if(kib <= 0 || kib > 1024 * 1024)
+    {
+        printf("find: invalid argument `%s' to `-dirbuf'\n", arg);
+        exit(1);
+    }
+    dir_buf_size = kib * 1024;
+}
+
+/*
+    Parses all of the arguments to myfind. Most are stored as global variables as they change
+    the behavior of the entire program. 
+*/
+void parse_args(int argc, char** argv)
+{
+    bool more_start_dirs = true;
+
+    char* prev_option = NULL;
+    // Time tests count back from the time find started, or with -daystart
+    // ages in days from the start of today.
+    struct timespec start_time;
+    clock_gettime(CLOCK_REALTIME, &start_time);
+    bool daystart = false;
+    int alternative = 0;
+    for(int i = 1; i < argc; i++)
+    {
+        for(int j = 0; parsing_query && QUERY_UNSAFE_OPTIONS[j] != NULL; j++)
+        {
+            if(strcmp(argv[i], QUERY_UNSAFE_OPTIONS[j]) == 0)
+            {
+                printf("find: %s is not allowed in a -watch query\n", argv[i]);
+                exit(1);
+            }
+        }
+        // Check for -L first since we don't want to interpret it as a regular option.
+        if(strcmp(argv[i], "-L") == 0)
+        {
+            prev_option = argv[i];
+            follow_symbolic = true;
+        }
+        // -daystart only changes the time tests after it.
+        else if(strcmp(argv[i], "-daystart") == 0)
+        {
+            prev_option = argv[i];
+            daystart = true;
+        }
+        // -j and the other walk options only change how the tree is walked, like -L.
+        else if(strcmp(argv[i], "-j") == 0)
+        {
+            prev_option = argv[i];
+            if(argv[i+1] == NULL)
+            {
+                printf("find: missing argument to `-j'\n");
+                exit(1);
+            }
+            num_threads = parse_positive_number(argv[i+1], "-j");
+            // Increment i to skip parsing the argument to -j twice.
+            i++;
+        }
+        else if(strcmp(argv[i], "-dirbuf") == 0)
+        {
+            prev_option = argv[i];
+            if(argv[i+1] == NULL)
+            {
+                printf("find: missing argument to `-dirbuf'\n");
+                exit(1);
+            }
+            parse_dir_buf_size(argv[i+1]);
+            // Increment i to skip parsing the argument to -dirbuf twice.
+            i++;
+        }
+        else if(strcmp(argv[i], "-exec-jobs") == 0)
+        {
+            prev_option = argv[i];
+            if(argv[i+1] == NULL)
+            {
+                printf("find: missing argument to `-exec-jobs'\n");
+                exit(1);
+            }
+            max_exec_jobs = parse_positive_number(argv[i+1], "-exec-jobs");
+            // Increment i to skip parsing the argument to -exec-jobs twice.
+            i++;
+        }
+        else if(strcmp(argv[i], "-maxfds") == 0)
+        {
+            prev_option = argv[i];
+            if(argv[i+1] == NULL)
+            {
+                printf("find: missing argument to `-maxfds'\n");
+                exit(1);
+            }
+            max_open_dirs = parse_positive_number(argv[i+1], "-maxfds");
+            // Increment i to skip parsing the argument to -maxfds twice.
+            i++;
+        }
+        else if(strcmp(argv[i], "-bfs") == 0)
+        {
+            prev_option = argv[i];
+            breadth_first = true;
+        }
+        else if(strcmp(argv[i], "-xdev") == 0 || strcmp(argv[i], "-mount") == 0)
+        {
+            prev_option = argv[i];
+            stay_on_device = true;
+        }
+        else if(strcmp(argv[i], "-maxdepth") == 0 || strcmp(argv[i], "-mindepth") == 0)
+        {
+            prev_option = argv[i];
+            if(argv[i+1] == NULL)
+            {
+                printf("find: missing argument to `%s'\n", argv[i]);
+                exit(1);
+            }
+            int depth = parse_depth(argv[i+1], argv[i]);
+            if(argv[i][2] == 'a')
+            {
+                max_depth = depth;
+            }
+            else
+            {
+                min_depth = depth;
+            }
+            // Increment i to skip parsing the depth twice.
+            i++;
+        }
+        else if(strcmp(argv[i], "-stats") == 0)
+        {
+            prev_option = argv[i];
+            collect_stats = true;
+        }
+        else if(strcmp(argv[i], "-stats-json") == 0)
+        {
+            prev_option = argv[i];
+            if(argv[i+1] == NULL)
+            {
+                printf("find: missing argument to `-stats-json'\n");
+                exit(1);
+            }
+            collect_stats = true;
+            stats_json_path = argv[i+1];
+            // Increment i to skip parsing the argument to -stats-json twice.
+            i++;
+        }
+        else if(strcmp(argv[i], "-index-build") == 0 || strcmp(argv[i], "-index-update") == 0
+                || strcmp(argv[i], "-index") == 0)
+        {
+            prev_option = argv[i];
+            if(argv[i+1] == NULL)
+            {
+                printf("find: missing argument to `%s'\n", argv[i]);
+                exit(1);
+            }
+            if(argv[i][6] == '-')
+            {
+                index_build_path = argv[i+1];
+                index_update = argv[i][7] == 'u';
+            }
+            else
+            {
+                index_path = argv[i+1];
+            }
+            // Increment i to skip parsing the argument to the option twice.
+            i++;
+        }
+        else if(strcmp(argv[i], "-watch") == 0 || strcmp(argv[i], "-query") == 0)
+        {
+            prev_option = argv[i];
+            if(argv[i+1] == NULL)
+            {
+                printf("find: missing argument to `%s'\n", argv[i]);
+                exit(1);
+            }
+            if(argv[i][1] == 'w')
+            {
+#ifndef USE_INOTIFY
+                printf("find: -watch is not supported on this system\n");
+                exit(1);
+#endif
+                watch_socket = argv[i+1];
+            }
+            else
+            {
+                query_socket = argv[i+1];
+            }
+            // Increment i to skip parsing the argument to the option twice.
+            i++;
+        }
+        else if(strcmp(argv[i], "-watch-mem") == 0)
+        {
+            prev_option = argv[i];
+            if(argv[i+1] == NULL)
+            {
+                printf("find: missing argument to `-watch-mem'\n");
+                exit(1);
+            }
+            // The limit is given in MiB.
+            watch_mem_limit = (size_t) parse_positive_number(argv[i+1], "-watch-mem") * 1024 * 1024;
+            // Increment i to skip parsing the argument to -watch-mem twice.
+            i++;
+        }
+        else if(strcmp(argv[i], "-uring") == 0)
+        {
+            prev_option = argv[i];
+            use_uring = true;
+        }
+        else if(strcmp(argv[i], "-inode-order") == 0)
+        {
+            prev_option = argv[i];
+            inode_order = true;
+        }
+        else if(strcmp(argv[i], "-unordered") == 0)
+        {
+            prev_option = argv[i];
+            unordered_output = true;
+        }
+        // -o starts the next alternative, tried if a test of the current
+        // one fails.
+        else if(strcmp(argv[i], "-o") == 0 || strcmp(argv[i], "-or") == 0)
+        {
+            more_start_dirs = false;
+            if(program_len == 0 || program[program_len - 1].alternative != alternative)
+            {
+                printf("find: invalid expression; you have used a binary operator '%s' with nothing before it.\n", argv[i]);
+                exit(1);
+            }
+            prev_option = argv[i];
+            alternative++;
+        }
+        // Check the current arg is an option
+        else if(argv[i][0] == '-')
+        {
+            more_start_dirs = false;
+
+            prev_option = argv[i];
+            if(strcmp(argv[i], "-name") == 0 || strcmp(argv[i], "-iname") == 0)
+            {
+                if(argv[i+1] == NULL)
+                {
+                    printf("find: missing argument to `%s'\n", argv[i]);
+                    exit(1);
+                }
+                bool fold_case = argv[i][1] == 'i';
+                add_predicate(run_name, COST_NAME, false)->matcher = compile_name_pattern(argv[i+1], fold_case);
+                // Increment i to skip parsing the argument to -name twice.
+                i++;
+            }
+            else if(strcmp(argv[i], "-name-from") == 0)
+            {
+                if(argv[i+1] == NULL)
+                {
+                    printf("find: missing argument to `-name-from'\n");
+                    exit(1);
+                }
+                add_predicate(run_name_from, COST_NAME, false)->name_set = load_name_set(argv[i+1]);
+                // Increment i to skip parsing the argument to -name-from twice.
+                i++;
+            }
+            else if(strcmp(argv[i], "-regex") == 0 || strcmp(argv[i], "-iregex") == 0)
+            {
+                if(argv[i+1] == NULL)
+                {
+                    printf("find: missing argument to `%s'\n", argv[i]);
+                    exit(1);
+                }
+                bool fold_case = argv[i][1] == 'i';
+                add_predicate(run_regex, COST_PATH, false)->regex = compile_path_regex(argv[i+1], fold_case);
+                // Increment i to skip parsing the argument to -regex twice.
+                i++;
+            }
+            else if(strcmp(argv[i], "-mtime") == 0 || strcmp(argv[i], "-atime") == 0
+                    || strcmp(argv[i], "-ctime") == 0 || strcmp(argv[i], "-mmin") == 0
+                    || strcmp(argv[i], "-amin") == 0 || strcmp(argv[i], "-cmin") == 0)
+            {
+                if(argv[i+1] == NULL)
+                {
+                    printf("find: missing argument to `%s'\n", argv[i]);
+                    exit(1);
+                }
+                predicate_t* pred = add_predicate(run_time, COST_STAT, false);
+                pred->time_field = argv[i][1] == 'a' ? ACCESS_TIME : argv[i][1] == 'c' ? CHANGE_TIME : MODIFY_TIME;
+                // Days count from a day before the start, so that -mtime 0
+                // is the last 24 hours, minutes from the start. With
+                // -daystart both move to the start of today or tomorrow.
+                struct timespec origin = start_time;
+                if(daystart)
+                {
+                    origin = start_of_day(start_time);
+                    origin.tv_sec += NUM_SECS_PER_DAY;
+                }
+                if(argv[i][2] == 'm')
+                {
+                    parse_time_amount(argv[i+1], argv[i], pred, origin, 60);
+                }
+                else
+                {
+                    origin.tv_sec -= NUM_SECS_PER_DAY;
+                    parse_time_amount(argv[i+1], argv[i], pred, origin, NUM_SECS_PER_DAY);
+                }
+                // Increment i to skip parsing the argument to the test twice.
+                i++;
+            }
+            else if(strcmp(argv[i], "-newer") == 0)
+            {
+                if(argv[i+1] == NULL)
+                {
+                    printf("find: missing argument to `-newer'\n");
+                    exit(1);
+                }
+                struct stat statbuffer;
+                if(!get_stat_info(argv[i+1], &statbuffer))
+                {
+                    printf("find: ‘%s’: %s\n", argv[i+1], strerror(errno));
+                    exit(1);
+                }
+                predicate_t* pred = add_predicate(run_time, COST_STAT, false);
+                pred->time_field = MODIFY_TIME;
+                pred->reference = statbuffer.st_mtim;
+                pred->comparison = '-';
+                // Increment i to skip parsing the argument to -newer twice.
+                i++;
+            }
+            else if(strcmp(argv[i], "-type") == 0)
+            {
+                if(argv[i+1] == NULL)
+                {
+                    printf("find: missing argument to `-type'\n");
+                    exit(1);
+                }
+                arg_to_mode(argv[i+1], add_predicate(run_type, COST_TYPE, false));
+                // Increment i to skip parsing the argument to -type twice.
+                i++;
+            }
+            else if(strcmp(argv[i], "-contains") == 0)
+            {
+                if(argv[i+1] == NULL)
+                {
+                    printf("find: missing argument to `-contains'\n");
+                    exit(1);
+                }
+                predicate_t* pred = add_predicate(run_contains, COST_CONTENT, false);
+                pred->needle = argv[i+1];
+                pred->needle_len = strlen(argv[i+1]);
+                // Increment i to skip parsing the argument to -contains twice.
+                i++;
+            }
+            else if(strcmp(argv[i], "-exec") == 0)
+            {
+                if(argv[i+1] == NULL)
+                {
+                    printf("find: missing argument to `-exec'\n");
+                    exit(1);
+                }
+                get_exec_args(argv, argc, &i, add_predicate(run_exec, COST_ACTION, true));
+            }
+            else if(strcmp(argv[i], "-print") == 0)
+            {
+                add_predicate(run_print, COST_ACTION, true)->terminator = '\n';
+            }
+            else if(strcmp(argv[i], "-print0") == 0)
+            {
+                add_predicate(run_print, COST_ACTION, true)->terminator = '\0';
+            }
+            else if(strcmp(argv[i], "-print-pattern") == 0)
+            {
+                add_predicate(run_print_pattern, COST_ACTION, true);
+            }
+            else if(strcmp(argv[i], "-prune") == 0)
+            {
+                add_predicate(run_prune, COST_ACTION, true);
+            }
+            else if(strcmp(argv[i], "-duplicates") == 0)
+            {
+                dup_set_t* dups = (dup_set_t*) checked_alloc(1, sizeof(dup_set_t));
+                pthread_mutex_init(&dups->lock, NULL);
+                dups->terminator = '\n';
+                add_predicate(run_duplicates, COST_ACTION, true)->dups = dups;
+            }
+            else
+            {
+                printf("find: unknown predicate `%s'\n", argv[i]);
+                exit(1);
+            }
+            // Each option adds one predicate, -stats reports it by the option.
+            program[program_len - 1].name = prev_option;
+            program[program_len - 1].alternative = alternative;
+        }
+        else if(more_start_dirs)
+        {
+            char* copy = strdup(argv[i]);
+            if(copy == NULL)
+            {
+                printf("find: insufficient memory\n");
+                exit(1);
+            }
+            base_path_to_file_data(copy);
+        }
+        else
+        {
+            out_printf("find: paths must precede expression: `%s'\n", argv[i]);
+            out_printf("find: possible unquoted pattern after predicate `%s'?\n", prev_option);
+        }
+    }
+    if(alternative > 0 && program[program_len - 1].alternative != alternative)
+    {
+        printf("find: expected an expression after '%s'\n", prev_option);
+        exit(1);
+    }
+    if(index_path != NULL && (num_base_dirs > 0 || index_build_path != NULL))
+    {
+        printf("find: -index reads the start points from the index\n");
+        exit(1);
+    }
+    if(index_build_path != NULL && !index_update && program_len > 0)
+    {
+        printf("find: -index-build indexes every file and takes no expression\n");
+        exit(1);
+    }
+    if(watch_socket != NULL && (program_len > 0 || index_path != NULL || index_build_path != NULL))
+    {
+        printf("find: -watch builds a tree and takes no expression\n");
+        exit(1);
+    }
+    // With -print0 the groups of -duplicates are printed the same way.
+    bool print0 = false;
+    for(int i = 0; i < program_len; i++)
+    {
+        print0 = print0 || (program[i].run == run_print && program[i].terminator == '\0');
+    }
+    for(int i = 0; i < program_len && print0; i++)
+    {
+        if(program[i].dups != NULL)
+        {
+            program[i].dups->terminator = '\0';
+        }
+    }
+    // Indexes and the tree of -watch always hold the whole tree.
+    bool limits_walk = max_depth >= 0 || min_depth > 0;
+    for(int i = 0; i < program_len; i++)
+    {
+        limits_walk = limits_walk || program[i].run == run_prune;
+    }
+    if((index_build_path != NULL || watch_socket != NULL) && limits_walk)
+    {
+        printf("find: -maxdepth, -mindepth and -prune do not apply to %s\n",
+               watch_socket != NULL ? "-watch" : index_update ? "-index-update" : "-index-build");
+        exit(1);
+    }
+    // An index has to hold the whole tree, -index could not tell it
+    // stopped at mount points.
+    if(index_build_path != NULL && stay_on_device)
+    {
+        printf("find: -xdev and -mount do not apply to %s\n", index_update ? "-index-update" : "-index-build");
+        exit(1);
+    }
+    if(query_socket != NULL && num_base_dirs > 0)
+    {
+        printf("find: -query runs on the start points of the -watch daemon\n");
+        exit(1);
+    }
+    // Indexes and the tree of -watch are built and read on one thread,
+    // depth first, which is how the directory of each entry is known.
+    if(index_path != NULL || index_build_path != NULL || watch_socket != NULL)
+    {
+        num_threads = 0;
+        breadth_first = false;
+    }
+    // Loops and mount points are found through the ancestors of each
+    // directory, which -bfs does not keep.
+    track_ancestors = follow_symbolic || stay_on_device;
+    if(track_ancestors)
+    {
+        breadth_first = false;
+    }
+    // If no base_dir was specified use "./"
+    if(num_base_dirs == 0 && index_path == NULL && query_socket == NULL)
+    {
+        char* copy = strdup("./");
+        if(copy == NULL)
+        {
+            printf("find: insufficient memory\n");
+            exit(1);
+        }
+        base_path_to_file_data(copy);
+    }
+    compile_program();
+    if(index_path != NULL && program_needs_atime_ctime)
+    {
+        printf("find: -index only records the modification time\n");
+        exit(1);
+    }
+    if(index_path != NULL && stay_on_device)
+    {
+        printf("find: -index does not record devices, -xdev and -mount do not apply\n");
+        exit(1);
+    }
+}
+
+/*
+    Walks each start point in turn. Start points that are not directories
+    are printed and the ones that do not exist are reported.
+*/
+void walk_base_dirs()
+{
+    for (int i = 0; i < num_base_dirs; i++)
+    {
+        // Only attempt to walk valid directories.
+        if(base_dirs[i].path != NULL)
+        {
+            file_data_t cur_base_dir = {
+                .path = base_dirs[i].path,
+                .file_name = base_dirs[i].file_name,
+                .statbuffer = base_dirs[i].statbuffer,
+                .have_stat = true,
+                .dir_path_len = 0,
+                .parent_fd = AT_FDCWD,
+                .is_base_dir = true
+            };
+            if((base_dirs[i].statbuffer.st_mode & S_IFMT) == S_IFDIR)
+            {
+                if(num_threads > 0)
+                {
+                    parallel_walk_dir(cur_base_dir);
+                }
+                else
+                {
+                    path_truncate(&walk_path, 0);
+                    path_append(&walk_path, cur_base_dir.path, strlen(cur_base_dir.path));
+                    walk_dir(cur_base_dir);
+                }
+            }
+            else if(index_builder != NULL)
+            {
+                handle_file(&cur_base_dir);
+            }
+            else if(min_depth == 0)
+            {
+                out_printf("%s\n", base_dirs[i].path);
+            }
+        }
+        else
+        {
+            out_printf("%s\n", base_dirs[i].file_name);
+        }
+    }
+}
+
+#ifdef USE_INOTIFY
+/*
+    Puts the path of the directory node in walk_path, followed by a slash.
+*/
+void watch_node_path(int node)
+{
+    int depth = 0;
+    for(int i = node; i != -1; i = watch_nodes[i].parent)
+    {
+        depth++;
+    }
+    path_truncate(&walk_path, 0);
+    for(int i = depth - 1; i >= 0; i--)
+    {
+        int ancestor = node;
+        for(int j = 0; j < i; j++)
+        {
+            ancestor = watch_nodes[ancestor].parent;
+        }
+        const char* name = watch_nodes[ancestor].name;
+        path_append(&walk_path, name, strlen(name));
+        if(walk_path.text[walk_path.len - 1] != '/')
+        {
+            path_append(&walk_path, "/", 1);
+        }
+    }
+}
+
+/*
+    Orders nodes by name, for looking up the old children of a directory
+    while it is listed again.
+*/
+int compare_watch_names(const void* a, const void* b)
+{
+    return strcmp(watch_nodes[*(const int*) a].name, watch_nodes[*(const int*) b].name);
+}
+
+/*
+    A directory refresh_watch_dir still has to list.
+*/
+typedef struct
+{
+    int node;
+    bool deep;
+} refresh_t;
+
+/*
+    Lists the directory node again and makes its children match the
+    listing. Children that are still there keep their subtree, which is
+    only listed again too if deep is set. New directories are walked.
+*/
+void refresh_watch_dir(int node, bool deep)
+{
+    refresh_t* stack = (refresh_t*) checked_alloc(1, sizeof(refresh_t));
+    int stack_len = 1;
+    int stack_cap = 1;
+    stack[0].node = node;
+    stack[0].deep = deep;
+
+    while(stack_len > 0)
+    {
+        refresh_t cur = stack[--stack_len];
+        watch_node_t* dir = &watch_nodes[cur.node];
+        dir->dirty = false;
+        watch_node_path(cur.node);
+        size_t dir_path_len = walk_path.len;
+
+        // The old children sorted by name, the ones found again are marked.
+        int num_old = dir->num_children;
+        int* old = dir->children;
+        bool* found = (bool*) checked_alloc(num_old + 1, sizeof(bool));
+        if(num_old > 0)
+        {
+            qsort(old, num_old, sizeof(int), compare_watch_names);
+        }
+        dir->children = NULL;
+        dir->num_children = 0;
+        watch_mem -= dir->children_cap * sizeof(int);
+        dir->children_cap = 0;
+
+        int dir_fd = open(walk_path.text, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        dir_reader_t* reader = dir_fd == -1 ? NULL : open_dir_reader(dir_fd);
+        dir->error = reader == NULL ? errno : 0;
+        struct stat statbuffer;
+        if(reader != NULL && fstat(dir_fd, &statbuffer) == 0)
+        {
+            dir->mtime = timespec_to_ns(statbuffer.st_mtim);
+            dir->size = statbuffer.st_size;
+        }
+
+        int count = 0;
+        while(reader != NULL && (count = read_dir_batch(reader)) > 0)
+        {
+            for(int i = 0; i < count; i++)
+            {
+                dir_entry_t* entry = &reader->entries[i];
+                file_data_t cur_file = {
+                    .file_name = (char*) entry->name,
+                    .d_type = entry->type,
+                    .parent_fd = dir_fd
+                };
+                mode_t type = file_type(&cur_file);
+
+                // Look the name up among the old children.
+                int low = 0;
+                int high = num_old;
+                while(low < high)
+                {
+                    int middle = low + (high - low) / 2;
+                    if(strcmp(watch_nodes[old[middle]].name, entry->name) < 0)
+                    {
+                        low = middle + 1;
+                    }
+                    else
+                    {
+                        high = middle;
+                    }
+                }
+                bool kept = low < num_old && !found[low] && strcmp(watch_nodes[old[low]].name, entry->name) == 0
+                            && watch_nodes[old[low]].type == type;
+                int child;
+                if(kept)
+                {
+                    found[low] = true;
+                    child = old[low];
+                    add_watch_child(cur.node, child);
+                }
+                else
+                {
+                    child = new_watch_node(entry->name, strlen(entry->name), cur.node);
+                }
+                set_watch_node_stat(child, &cur_file);
+                dir = &watch_nodes[cur.node];
+
+                if(type == S_IFDIR && (!kept || cur.deep))
+                {
+                    if(!kept)
+                    {
+                        path_truncate(&walk_path, dir_path_len);
+                        path_append(&walk_path, entry->name, strlen(entry->name));
+                        add_watch(child);
+                    }
+                    if(stack_len == stack_cap)
+                    {
+                        stack_cap *= 2;
+                        stack = (refresh_t*) checked_realloc(stack, stack_cap * sizeof(refresh_t));
+                    }
+                    stack[stack_len].node = child;
+                    stack[stack_len].deep = true;
+                    stack_len++;
+                }
+            }
+        }
+        if(count < 0)
+        {
+            dir->error = errno;
+        }
+        if(reader != NULL)
+        {
+            close_dir_reader(reader);
+        }
+        else if(dir_fd != -1)
+        {
+            close(dir_fd);
+        }
+
+        for(int i = 0; i < num_old; i++)
+        {
+            if(!found[i])
+            {
+                free_watch_subtree(old[i]);
+            }
+        }
+        free(found);
+        free(old);
+    }
+    free(stack);
+}
+/*
+    Reads the pending inotify events and brings the tree up to date.
+    Directories whose listing changed are listed again, files that were
+    only modified are stat'ed again. If events were lost the whole tree
+    is listed again.
+*/
+void handle_watch_events()
+{
+    char buffer[64 * 1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+    bool overflow = false;
+    ssize_t len;
+    while((len = read(inotify_fd, buffer, sizeof(buffer))) > 0)
+    {
+        for(char* pos = buffer; pos < buffer + len;)
+        {
+            struct inotify_event* event = (struct inotify_event*) pos;
+            pos += sizeof(struct inotify_event) + event->len;
+            if(event->mask & IN_Q_OVERFLOW)
+            {
+                overflow = true;
+                continue;
+            }
+            if(event->wd < 0 || event->wd >= watch_wds_cap || watch_wds[event->wd] == -1)
+            {
+                continue;
+            }
+            int node = watch_wds[event->wd];
+            if(event->mask & IN_IGNORED)
+            {
+                watch_wds[event->wd] = -1;
+                watch_nodes[node].wd = -1;
+            }
+            else if((event->mask & WATCH_LISTING_MASK) || event->len == 0)
+            {
+                if(!watch_nodes[node].dirty)
+                {
+                    watch_nodes[node].dirty = true;
+                    if(num_dirty_dirs == dirty_dirs_cap)
+                    {
+                        dirty_dirs_cap = dirty_dirs_cap == 0 ? 64 : dirty_dirs_cap * 2;
+                        dirty_dirs = (int*) checked_realloc(dirty_dirs, dirty_dirs_cap * sizeof(int));
+                    }
+                    dirty_dirs[num_dirty_dirs++] = node;
+                }
+            }
+            else
+            {
+                // Only the file changed, find it and stat it again.
+                watch_node_t* dir = &watch_nodes[node];
+                for(int i = 0; i < dir->num_children; i++)
+                {
+                    int child = dir->children[i];
+                    if(strcmp(watch_nodes[child].name, event->name) == 0)
+                    {
+                        watch_node_path(node);
+                        path_append(&walk_path, event->name, strlen(event->name));
+                        file_data_t cur_file = {
+                            .file_name = event->name,
+                            .d_type = DT_UNKNOWN,
+                            .parent_fd = AT_FDCWD,
+                            .path = walk_path.text
+                        };
+                        if(ensure_stat(&cur_file))
+                        {
+                            set_watch_node_stat(child, &cur_file);
+                        }
+                        break;
+                    }
+                }
+            }
+        }
+    }
+
+    if(overflow)
+    {
+        num_dirty_dirs = 0;
+        for(int i = 0; i < num_watch_roots; i++)
+        {
+            refresh_watch_dir(watch_roots[i], true);
+        }
+    }
+    for(int i = 0; i < num_dirty_dirs; i++)
+    {
+        // Directories below one listed again earlier may be gone.
+        int node = dirty_dirs[i];
+        if(watch_nodes[node].in_use && watch_nodes[node].dirty)
+        {
+            refresh_watch_dir(node, false);
+        }
     }
+    num_dirty_dirs = 0;
+    check_watch_mem();
+}
 
-    // Keep track of if we are expecting another mode.
-    bool needs_mode = false;
-    for(int i = 0; i < length; i++)
+/*
+    A directory run_watch_tree is in, with the next child to visit and
+    the length of its path followed by a slash.
+*/
+typedef struct
+{
+    int node;
+    int next;
+    size_t dir_path_len;
+} visit_t;
+
+/*
+    Runs the program on the tree of -watch, in the order a walk of the
+    start points would find the files.
+*/
+void run_watch_tree()
+{
+    visit_t* stack = NULL;
+    int stack_cap = 0;
+    int root = 0;
+    for(int i = 0; i < num_base_dirs; i++)
     {
-        // if i is odd then it must be a ','
-        if(i % 2 == 1)
+        if(base_dirs[i].path == NULL)
         {
-            // We are expecting another argument to -type since there was a preceeding ','
-            needs_mode = true;
-            if(mode_specifier[i] != ',')
+            out_printf("%s\n", base_dirs[i].file_name);
+            continue;
+        }
+        if((base_dirs[i].statbuffer.st_mode & S_IFMT) != S_IFDIR)
+        {
+            if(min_depth == 0)
             {
-                printf("find: Must separate multiple arguments to -type using: ','\n");
-                exit(1);
+                out_printf("%s\n", base_dirs[i].path);
             }
+            continue;
         }
-        else
+
+        // Each directory is handled when it is found, like walk_dir does.
+        int depth = 0;
+        int node = watch_roots[root++];
+        path_truncate(&walk_path, 0);
+        while(true)
         {
-            needs_mode = false;
-            desired_modes[num_modes] = get_mode_mask(mode_specifier[i]);
-            num_modes += 1;
+            watch_node_t* entry = &watch_nodes[node];
+            file_data_t file = {
+                .file_name = entry->name,
+                .have_stat = true,
+                .d_type = DT_UNKNOWN,
+                .dir_path_len = walk_path.len,
+                .parent_fd = AT_FDCWD,
+                .is_base_dir = entry->parent == -1,
+                .depth = depth
+            };
+            file.statbuffer.st_mode = entry->type;
+            file.statbuffer.st_mtim = ns_to_timespec(entry->mtime);
+            file.statbuffer.st_size = entry->size;
+            if(entry->type == S_IFDIR)
+            {
+                path_append(&walk_path, entry->name, strlen(entry->name));
+                if(!file.is_base_dir)
+                {
+                    path_append(&walk_path, "/", 1);
+                }
+                file.path = walk_path.text;
+                handle_file(&file);
+                bool descend = may_descend(&file);
+                if(descend && entry->error != 0)
+                {
+                    print_dir_error(entry->error);
+                }
+                else if(descend)
+                {
+                    if(walk_path.text[walk_path.len - 1] != '/')
+                    {
+                        path_append(&walk_path, "/", 1);
+                    }
+                    if(depth == stack_cap)
+                    {
+                        stack_cap = stack_cap == 0 ? 16 : stack_cap * 2;
+                        stack = (visit_t*) checked_realloc(stack, stack_cap * sizeof(visit_t));
+                    }
+                    stack[depth].node = node;
+                    stack[depth].next = 0;
+                    stack[depth].dir_path_len = walk_path.len;
+                    depth++;
+                }
+            }
+            else
+            {
+                handle_file(&file);
+            }
+
+            // Go on with the next file of the deepest directory that has one.
+            while(depth > 0 && stack[depth - 1].next == watch_nodes[stack[depth - 1].node].num_children)
+            {
+                depth--;
+            }
+            if(depth == 0)
+            {
+                break;
+            }
+            visit_t* top = &stack[depth - 1];
+            node = watch_nodes[top->node].children[top->next++];
+            path_truncate(&walk_path, top->dir_path_len);
         }
     }
-    if(needs_mode)
-    {
-        printf("find: Last file type in list argument to -type is missing, i.e., list is ending on: ','\n");
-        exit(1);
-    }
+    free(stack);
 }
 
 /*
-    parses the exec commands starting at index index and updates index to hold
-    the the index of the semicolon
+    Answers one query in a child process with stdout connected to the
+    client. The query is the command line of myfind -query, which is
+    parsed again here and run on the tree, or by walking the start
+    points if the tree was dropped or does not keep the times the query
+    looks at. Never returns.
 */
-void get_exec_args(char** argv, int argc, int* index)
+void answer_query(int client)
 {
+    dup2(client, STDOUT_FILENO);
+    close(client);
 
-    int semicolon_index = -1; 
-
-    // start at one so we dont have to add space for terminating char later.
-    int exec_args_len = 1;
-    for(int i = *index + 1; i < argc; i++)
+    // The command line, as strings that each end in a null character.
+    size_t len = 0;
+    size_t cap = 4096;
+    char* request = (char*) checked_alloc(cap, sizeof(char));
+    ssize_t nread;
+    while((nread = read(STDOUT_FILENO, request + len, cap - len)) > 0)
     {
-        if (argv[i][0] == ';' && argv[i][1] == '\0')
-        {
-            semicolon_index = i; 
-            break;
-        }
-        else
+        len += nread;
+        if(len == cap)
         {
-            // add space for the argument and a space
-            exec_args_len += strlen(argv[i]) + 1;
+            cap *= 2;
+            request = (char*) checked_realloc(request, cap);
         }
     }
-    exec_args = (char*) calloc(exec_args_len, sizeof(char));
-    if(exec_args == NULL)
+    int argc = 1;
+    for(size_t i = 0; i < len; i++)
     {
-        printf("find: insufficient memory\n");
-        exit(1);
+        argc += request[i] == '\0';
     }
-    for(int i = *index + 1; i < semicolon_index; i++)
+    char** argv = (char**) checked_alloc(argc + 1, sizeof(char*));
+    argv[0] = "myfind";
+    argc = 1;
+    for(size_t i = 0; i < len; i += strlen(request + i) + 1)
     {
-        strcat(strcat(exec_args, argv[i]), " ");
+        argv[argc++] = request + i;
     }
-    if(semicolon_index == -1)
+
+    free_program();
+    program = NULL;
+    program_len = 0;
+    program_needs_stat = false;
+    program_needs_atime_ctime = false;
+    watch_socket = NULL;
+    // The tree was walked with the -L and -xdev of the daemon, which are
+    // not those of the query.
+    bool tree_follow_symbolic = follow_symbolic;
+    bool tree_stay_on_device = stay_on_device;
+    follow_symbolic = false;
+    stay_on_device = false;
+    int num_watched = num_base_dirs;
+    num_base_dirs = 0;
+    parsing_query = true;
+    parse_args(argc, argv);
+    num_base_dirs = num_watched;
+    num_threads = 0;
+    // The tree only keeps the modification time of each file, and only
+    // holds what a walk with the same -L and -xdev finds.
+    if(watch_tree_valid && !program_needs_atime_ctime && follow_symbolic == tree_follow_symbolic
+       && stay_on_device == tree_stay_on_device)
     {
-        printf("find: missing argument to `-exec'\n");
-        exit(1);
+        run_watch_tree();
     }
     else
     {
-        *index = semicolon_index;
+        walk_base_dirs();
     }
-    return;
+
+    if(max_exec_jobs > 0)
+    {
+        finish_exec_jobs();
+    }
+    flush_exec_batches();
+    report_duplicates();
+    out_flush();
+    fflush(stdout);
+    _exit(exit_status);
 }
 
 /*
-    adds another base dir to the global base_dirs
+    A query being answered by a child process. The exit status of the
+    child is sent as the last byte once it is done.
 */
-void base_path_to_file_data(char* base_path)
+typedef struct
 {
-    struct stat statbuffer;
-    char* base_path_no_slash = remove_last_slash(base_path);
-    if(get_stat_info(base_path, &statbuffer))
+    pid_t pid;
+    // A pidfd for waiting on the child, -1 if not supported.
+    int pidfd;
+    int client;
+} watch_query_t;
+
+/*
+    Opens the socket queries are sent to at path, which only its owner
+    may connect to. A socket left behind by a daemon that is gone is
+    replaced, anything else at path is left alone.
+*/
+int open_watch_socket(const char* path)
+{
+    struct sockaddr_un address = { .sun_family = AF_UNIX };
+    if(strlen(path) >= sizeof(address.sun_path))
     {
-        base_dirs[num_base_dirs].path = base_path;
-        base_dirs[num_base_dirs].file_name = dir_path_to_dir_name(base_path);
-        base_dirs[num_base_dirs].statbuffer = statbuffer;
+        printf("find: ‘%s’: %s\n", path, strerror(ENAMETOOLONG));
+        exit(1);
     }
-    else
+    strcpy(address.sun_path, path);
+    // Nobody else may connect in the moment before the chmod.
+    mode_t old_umask = umask(0177);
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    int result = listen_fd == -1 ? -1 : bind(listen_fd, (struct sockaddr*) &address, sizeof(address));
+    if(result == -1 && errno == EADDRINUSE)
     {
-        // create invalid base dir error messages
-        base_dirs[num_base_dirs].path = NULL;
-        char* error_begin = "find: ‘";
-        char* error_end;
-
-        if(get_stat_info(base_path_no_slash, &statbuffer))
+        // connect also fails with ECONNREFUSED on files that are not
+        // sockets.
+        struct stat statbuffer;
+        int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if(lstat(path, &statbuffer) == 0 && S_ISSOCK(statbuffer.st_mode) && probe != -1
+           && connect(probe, (struct sockaddr*) &address, sizeof(address)) == -1 && errno == ECONNREFUSED)
         {
-            // Error message for not a directory.
-            error_end = "’: Not a directory";
+            unlink(path);
+            result = bind(listen_fd, (struct sockaddr*) &address, sizeof(address));
         }
         else
         {
-            // Error message for no such file or directory
-            error_end = "’: No such file or directory";
+            errno = EADDRINUSE;
         }
-
-        int filled_template_length = strlen(error_begin) + strlen(error_end) + strlen(base_path) + 1;
-        char* invalid_dir_message = (char*) calloc(filled_template_length, sizeof(char));
-        if(invalid_dir_message == NULL)
+        if(probe != -1)
         {
-            printf("find: insufficient memory\n");
-            exit(1);
+            close(probe);
         }
-        strcat(strcat(strcat(invalid_dir_message, error_begin), base_path), error_end);
-        
-        // for invalid base dirs the file_name stores the error message
-        base_dirs[num_base_dirs].file_name = invalid_dir_message;
-        free(base_path);
     }
-
-    free(base_path_no_slash);
-    num_base_dirs += 1;
-}
-
-/*
-    Checks if the arg isdigit(). If it is, the numeric
-    value is extracted with atoi and stored in num_days.
-*/
-void parse_mtime(char* arg)
-{
-    for(long unsigned int i = 0; i < strlen(arg); i++)
+    umask(old_umask);
+    if(result == -1 || chmod(path, 0600) == -1 || listen(listen_fd, 64) == -1)
     {
-        if(!isdigit(arg[i]))
-        {
-            printf("find: invalid argument `%s' to `-mtime'\n", arg);
-            exit(1);
-        }
+        printf("find: ‘%s’: %s\n", path, strerror(errno));
+        exit(1);
     }
-    num_days = atoi(arg);
+    return listen_fd;
 }
 
 /*
-    Parses all of the arguments to myfind. Most are stored as global variables as they change
-    the behavior of the entire program. 
+    Runs the -watch daemon: walks the start points once into the tree,
+    then keeps it up to date and answers queries on watch_socket. Each
+    query is answered by a child process working on a copy of the tree,
+    so a slow query does not hold up the events. Never returns.
 */
-void parse_args(int argc, char** argv)
+void run_watch_daemon()
 {
-    bool more_start_dirs = true;
-
-    // allocate space to store the order of the options. this is an overestimate
-    opt_order = (char**) calloc(argc, sizeof(char*));
+    inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if(inotify_fd == -1)
+    {
+        printf("find: inotify: %s\n", strerror(errno));
+        exit(1);
+    }
+    int listen_fd = open_watch_socket(watch_socket);
+    watch_tree_valid = true;
+    walk_base_dirs();
+    num_watch_build_dirs = 0;
+    // A client going away must not end the daemon.
+    signal(SIGPIPE, SIG_IGN);
+    out_flush();
 
-    char* prev_option;
-    for(int i = 1; i < argc; i++)
+    watch_query_t* queries = NULL;
+    int num_queries = 0;
+    struct pollfd* fds = NULL;
+    while(true)
     {
-        // Check for -L first since we don't want to interpret it as a regular option.
-        if(strcmp(argv[i], "-L") == 0)
+        fds = (struct pollfd*) checked_realloc(fds, (num_queries + 2) * sizeof(struct pollfd));
+        fds[0].fd = listen_fd;
+        fds[0].events = POLLIN;
+        fds[1].fd = watch_tree_valid ? inotify_fd : -1;
+        fds[1].events = POLLIN;
+        // Without pidfds finished children are only noticed every 10ms.
+        int timeout = -1;
+        for(int i = 0; i < num_queries; i++)
         {
-            opt_order[opt_order_len] = strdup("-L");
-            prev_option = opt_order[opt_order_len];
-            opt_order_len += 1;
-            if(prev_option == NULL)
-            {
-                printf("find: insufficient memory\n");
-                exit(1);
-            }
-            follow_symbolic = true;
+            fds[i + 2].fd = queries[i].pidfd;
+            fds[i + 2].events = POLLIN;
+            timeout = queries[i].pidfd == -1 ? 10 : timeout;
         }
-        // Check the current arg is an option
-        else if(argv[i][0] == '-')
+        if(poll(fds, num_queries + 2, timeout) == -1 && errno != EINTR)
         {
-            more_start_dirs = false;
+            printf("find: poll: %s\n", strerror(errno));
+            exit(1);
+        }
 
-            if(strcmp(argv[i], "-name") == 0)
-            {
-                opt_order[opt_order_len] = strdup("-name");
-                prev_option = opt_order[opt_order_len];
-                opt_order_len += 1;
-                if(prev_option == NULL)
-                {
-                    printf("find: insufficient memory\n");
-                    exit(1);
-                }
-                if(argv[i+1] == NULL)
-                {
-                    printf("find: missing argument to `-name'\n");
-                    exit(1);
-                }
-                pattern = argv[i+1];
-                // Increment i to skip parsing the argument to -mtime twice.
-                i++;
-            }
-            else if(strcmp(argv[i], "-mtime") == 0)
+        if(watch_tree_valid && (fds[1].revents & POLLIN))
+        {
+            handle_watch_events();
+        }
+        if(fds[0].revents & POLLIN)
+        {
+            int client = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+            if(client != -1)
             {
-                //handle_mtime();
-                opt_order[opt_order_len] = strdup("-mtime");
-                prev_option = opt_order[opt_order_len];
-                opt_order_len += 1;
-                if(prev_option == NULL)
-                {
-                    printf("find: insufficient memory\n");
-                    exit(1);
-                }
-                if(argv[i+1] == NULL)
+                // The child must not print what the daemon still buffers.
+                out_flush();
+                fflush(stdout);
+                pid_t pid = fork();
+                if(pid == 0)
                 {
-                    printf("find: missing argument to `-mtime'\n");
-                    exit(1);
+                    close(listen_fd);
+                    if(inotify_fd != -1)
+                    {
+                        close(inotify_fd);
+                    }
+                    for(int i = 0; i < num_queries; i++)
+                    {
+                        close(queries[i].client);
+                        if(queries[i].pidfd != -1)
+                        {
+                            close(queries[i].pidfd);
+                        }
+                    }
+                    answer_query(client);
                 }
-                parse_mtime(argv[i+1]);
-                // Increment i to skip parsing the argument to -mtime twice.
-                i++;
-            }
-            else if(strcmp(argv[i], "-type") == 0)
-            {
-                //handle_type();
-                opt_order[opt_order_len] = strdup("-type");
-                prev_option = opt_order[opt_order_len];
-                opt_order_len += 1;
-                if(prev_option == NULL)
+                if(pid == -1)
                 {
-                    printf("find: insufficient memory\n");
-                    exit(1);
+                    close(client);
                 }
-                if(argv[i+1] == NULL)
+                else
                 {
-                    printf("find: missing argument to `-type'\n");
-                    exit(1);
+                    queries = (watch_query_t*) checked_realloc(queries, (num_queries + 1) * sizeof(watch_query_t));
+                    queries[num_queries].pid = pid;
+#ifdef SYS_pidfd_open
+                    queries[num_queries].pidfd = syscall(SYS_pidfd_open, pid, 0);
+#else
+                    queries[num_queries].pidfd = -1;
+#endif
+                    queries[num_queries].client = client;
+                    num_queries++;
                 }
-                arg_to_mode(argv, i);
-                // Increment i to skip parsing the argument to -type twice.
-                i++;
             }
-            else if(strcmp(argv[i], "-exec") == 0)
+        }
+
+        // Send the exit status of finished queries and hang up.
+        for(int i = 0; i < num_queries; i++)
+        {
+            int status;
+            if(waitpid(queries[i].pid, &status, WNOHANG) != queries[i].pid)
             {
-                opt_order[opt_order_len] = strdup("-exec");
-                prev_option = opt_order[opt_order_len];
-                opt_order_len += 1;
-                if(prev_option == NULL)
-                {
-                    printf("find: insufficient memory\n");
-                    exit(1);
-                }
-                if(argv[i+1] == NULL)
-                {
-                    printf("find: missing argument to `-exec'\n");
-                    exit(1);
-                }
-                get_exec_args(argv, argc, &i);
                 continue;
-                
-            }
-            else if(strcmp(argv[i], "-print") == 0)
-            {
-                opt_order[opt_order_len] = strdup("-print");
-                prev_option = opt_order[opt_order_len];
-                opt_order_len += 1;
-                if(prev_option == NULL)
-                {
-                    printf("find: insufficient memory\n");
-                    exit(1);
-                }
-                should_print = true;  
             }
-            else
+            unsigned char exit_byte = WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+            if(write(queries[i].client, &exit_byte, 1) != 1)
             {
-                printf("find: unknown predicate `%s'\n", argv[i]);
-                exit(1);
+                // The client is gone, there is no one left to tell.
             }
-        }
-        else if(more_start_dirs)
-        {
-            char* copy = strdup(argv[i]);
-            if(copy == NULL)
+            close(queries[i].client);
+            if(queries[i].pidfd != -1)
             {
-                printf("find: insufficient memory\n");
-                exit(1);
+                close(queries[i].pidfd);
             }
-            base_path_to_file_data(copy);
-        }
-        else
-        {
-            printf("find: paths must precede expression: `%s'\n", argv[i]);
-            printf("find: possible unquoted pattern after predicate `%s'?\n", prev_option);
+            queries[i--] = queries[--num_queries];
         }
     }
-    // If no base_dir was specified use "./"
-    if(num_base_dirs == 0)
+}
+#endif
+
+/*
+    Sends the command line to the -watch daemon listening on
+    query_socket and copies its answer to stdout. Returns the exit
+    status of the query.
+*/
+int run_query(int argc, char** argv)
+{
+    struct sockaddr_un address = { .sun_family = AF_UNIX };
+    if(strlen(query_socket) >= sizeof(address.sun_path))
     {
-        char* copy = strdup("./");
-        if(copy == NULL)
+        printf("find: ‘%s’: %s\n", query_socket, strerror(ENAMETOOLONG));
+        return 1;
+    }
+    strcpy(address.sun_path, query_socket);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(fd == -1 || connect(fd, (struct sockaddr*) &address, sizeof(address)) == -1)
+    {
+        printf("find: ‘%s’: %s\n", query_socket, strerror(errno));
+        return 1;
+    }
+    for(int i = 1; i < argc; i++)
+    {
+        struct iovec iov = { argv[i], strlen(argv[i]) + 1 };
+        if(writev(fd, &iov, 1) != (ssize_t) iov.iov_len)
         {
-            printf("find: insufficient memory\n");
-            exit(1);
+            printf("find: ‘%s’: %s\n", query_socket, strerror(errno));
+            return 1;
         }
-        base_path_to_file_data(copy);
     }
+    shutdown(fd, SHUT_WR);
+
+    // The last byte is the exit status, so one byte is always held back.
+    char buffer[64 * 1024 + 1];
+    size_t held = 0;
+    ssize_t nread;
+    while((nread = read(fd, buffer + held, sizeof(buffer) - held)) > 0)
+    {
+        size_t len = held + nread;
+        struct iovec iov = { buffer, len - 1 };
+        write_all(&iov, 1);
+        buffer[0] = buffer[len - 1];
+        held = 1;
+    }
+    close(fd);
+    if(held == 0)
+    {
+        printf("find: ‘%s’: the daemon did not answer\n", query_socket);
+        return 1;
+    }
+    return exit_status != 0 ? exit_status : (unsigned char) buffer[0];
 }
 
 int main(int argc, char** argv)
@@ -850,37 +8654,66 @@ int main(int argc, char** argv)
         exit(1);
     }
     parse_args(argc, argv);
-
-    for (int i = 0; i < num_base_dirs; i++)
+    if(query_socket != NULL)
     {
-        // Only attempt to walk valid directories.
-        if(base_dirs[i].path != NULL)
-        {
-            file_data_t cur_base_dir;
-            if((base_dirs[i].statbuffer.st_mode & S_IFMT) == S_IFDIR)
-            {
-                cur_base_dir.path = strdup(base_dirs[i].path);
-                cur_base_dir.file_name = strdup(base_dirs[i].file_name);
-                // check that strdup succeeded
-                if(cur_base_dir.path == NULL || cur_base_dir.file_name == NULL)
-                {
-                    printf("find: insufficient memory\n");
-                    exit(1);
-                }
-
-                cur_base_dir.statbuffer = base_dirs[i].statbuffer;
-                walk_dir(cur_base_dir);
-            }
-            else
-            {
-                printf("%s\n", base_dirs[i].path);
-            }
-        }
-        else
+        return run_query(argc, argv);
+    }
+#ifdef USE_INOTIFY
+    if(watch_socket != NULL)
+    {
+        run_watch_daemon();
+    }
+#endif
+    if(num_threads > 0)
+    {
+        start_workers();
+    }
+    if(index_path != NULL)
+    {
+        run_index(index_path);
+    }
+    if(index_build_path != NULL)
+    {
+        if(index_update)
         {
-            printf("%s\n", base_dirs[i].file_name);
+            load_index_cache(index_build_path);
         }
+        start_index_build(index_build_path);
+    }
+
+    walk_base_dirs();
+
+    if(num_threads > 0)
+    {
+        stop_workers();
+    }
+    if(index_builder != NULL)
+    {
+        finish_index_build();
+        free_index_cache();
+    }
+    // Finished commands may still add paths to a batch.
+    if(max_exec_jobs > 0)
+    {
+        finish_exec_jobs();
+    }
+    flush_exec_batches();
+    report_duplicates();
+    out_flush();
+    free(out_buf);
+    free(walk_path.text);
+    free_walk_stack();
+    for(int i = 0; i < 2; i++)
+    {
+        arena_free(&bfs_levels[i].names);
+        free(bfs_levels[i].paths);
     }
+    free_dir_readers();
+    free_content_buf();
+    free_regex_caches();
+#ifdef USE_IO_URING
+    free_stat_ring();
+#endif
 
     for (int i = 0; i < num_base_dirs; i++)
     {
@@ -888,14 +8721,14 @@ int main(int argc, char** argv)
         free(base_dirs[i].file_name);
     }
 
-    for (int i = 0; i < opt_order_len; i++)
+    free(base_dirs);
+    if(collect_stats)
     {
-        free(opt_order[i]);
+        report_stats();
+        free(total_stats.pred_evals);
+        free(total_stats.pred_rejects);
+        free(total_stats.pred_ns);
     }
-
-    free(base_dirs);
-    free(desired_modes);
-    free(exec_args);
-    free(opt_order);
-    return 0;
+    free_program();
+    return exit_status;
 }
\ No newline at end of file